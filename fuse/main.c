@@ -32,6 +32,7 @@ struct aulsmfs_config {
 	uint64_t major;
 	uint64_t page_size;
 	uint64_t pages;
+	uint64_t levels;
 };
 
 static const struct fuse_opt aulsmfs_opts[] = {
@@ -172,6 +173,13 @@ static int aulsmfs_super_read(struct aulsmfs_config *config)
 	config->major = AULSMFS_GET_MAJOR(le64toh(super.version));
 	config->pages = le64toh(super.pages);
 	config->page_size = le64toh(super.page_size);
+	config->levels = le64toh(super.levels);
+
+	if (!config->levels || config->levels > AULSMFS_MAX_DISK_TREES) {
+		printf("Unsupported number of levels %llu\n",
+					(unsigned long long)config->levels);
+		return -1;
+	}
 	return 0;
 }
 
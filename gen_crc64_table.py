@@ -28,9 +28,43 @@ def print_table(table, name = "crc_table", cols = 2):
         print "\t},"
     print "};"
 
+# x^n mod P in the reflected form, the constant term is the top bit.
+def xpow_mod(poly, n):
+    crc = 1 << 63
+    for _ in xrange(n):
+        crc = poly ^ (crc >> 1) if crc & 1 else crc >> 1
+    return crc
+
+# a * b mod P, both in the reflected form, a must not be zero.
+def mult_mod(poly, a, b):
+    m, p = 1 << 63, 0
+    while True:
+        if a & m:
+            p ^= b
+            if not a & (m - 1):
+                return p
+        m >>= 1
+        b = poly ^ (b >> 1) if b & 1 else b >> 1
+
+# x^(8 * 2^k) mod P, shifts a crc over 2^k zero bytes.
+def gen_shift(poly):
+    table, x = [], xpow_mod(poly, 8)
+    for _ in xrange(64):
+        table.append(x)
+        x = mult_mod(poly, x, x)
+    return table
+
+def gen_fold(poly, distances):
+    return [[xpow_mod(poly, d + 63), xpow_mod(poly, d - 1)]
+        for d in distances]
+
 #polynomial = 0xc96c5795d7870f42 # adler
 polynomial = 0x95ac9329ac4bc9b5 # "Jones"
 
 print "/* This file is generated automatically, don't change it. */"
 print "/* Reversed polynomial: 0x{:016x} */".format(polynomial)
 print_table(gen_table(polynomial))
+print "/* Constants to fold 128 bits over 128, 256, 384 and 512 bits. */"
+print_table(gen_fold(polynomial, [128, 256, 384, 512]), "crc_fold")
+print "/* Constants to shift a crc over 2^k zero bytes. */"
+print_table([gen_shift(polynomial)], "crc_shift")
@@ -6,13 +6,16 @@
 
 #define AULSMFS_MAGIC	0x0A0153F5
 #define AULSMFS_MAJOR	0
-#define AULSMFS_MINOR	1
+#define AULSMFS_MINOR	6
 #define AULSMFS_VERSION	(((uint64_t)AULSMFS_MAJOR << 32) | (AULSMFS_MINOR))
 
 #define AULSMFS_GET_MINOR(version) ((version) & 0xfffffffful)
 #define AULSMFS_GET_MAJOR(version) ((version) >> 32)
 
-#define AULSMFS_MAX_DISK_TREES	3
+/* Upper bound on the number of disk levels of a tree, the number actually
+ * used is a format parameter stored in the super block. */
+#define AULSMFS_MAX_DISK_TREES		6
+#define AULSMFS_DEFAULT_DISK_TREES	3
 
 
 /* We are using little endian since it's native byte order
@@ -53,29 +56,76 @@ struct aulsmfs_log_header {
 	le32_t pages;
 } __attribute__((packed));
 
-/* Both key size and value size are given in bytes. */
+/* Formats of node entries, see aulsmfs_node_header. */
+#define AULSMFS_NODE_PLAIN	0
+#define AULSMFS_NODE_PREFIX	1
+/* Flag of a compressed node, the header of such node is followed by
+ * aulsmfs_lz_header and the lz compressed (see lz.h) bytes of the node
+ * that follow its header. Size in the header covers the compressed node,
+ * the rest of the format field is the format of the node itself. */
+#define AULSMFS_NODE_LZ		0x100
+
+/* Entry of an AULSMFS_NODE_PLAIN node, it's followed by the key and the
+ * value. Both key size and value size are given in bytes. */
 struct aulsmfs_node_entry {
 	le16_t key_size;
 	le16_t val_size;
 } __attribute__((packed));
 
+/* Entries of an AULSMFS_NODE_PREFIX node start with three varints (7 bits
+ * per byte, least significant first): the number of bytes the key shares
+ * with the key of the previous entry, the size of the rest of the key and
+ * the size of the value. They are followed by the rest of the key and the
+ * value. Entries that store the whole key are restart points, le32_t
+ * offsets of some of them in increasing order follow the last entry and
+ * the last le32_t of the node is the number of these offsets. The first
+ * entry is always a restart point. */
+
 struct aulsmfs_node_header {
 	/* How many bytes this tree node really contains. */
 	le64_t size;
 	/* Level of this node in the tree, 0 - leaf node. */
-	le64_t level;
+	le32_t level;
+	/* AULSMFS_NODE_PLAIN or AULSMFS_NODE_PREFIX, nodes written before
+	 * the format was introduced have zero here. */
+	le32_t format;
+} __attribute__((packed));
+
+struct aulsmfs_lz_header {
+	/* Size of the uncompressed node in bytes, its header included. */
+	le64_t size;
+} __attribute__((packed));
+
+/* Bloom filter over all the keys of a ctree, the header is followed by
+ * the filter bit array, size is given in bytes. */
+struct aulsmfs_bloom_header {
+	le64_t size;
+	le64_t hashes;
 } __attribute__((packed));
 
 struct aulsmfs_ctree {
 	struct aulsmfs_ptr ptr;
 	le32_t pages;
 	le32_t height;
+	/* Optional Bloom filter, zero offset and size means no filter. */
+	struct aulsmfs_ptr bloom;
+	/* Optional fence index, a single level 1 node that points to every
+	 * leaf of the tree, so that it can replace all the interior nodes
+	 * in memory. */
+	struct aulsmfs_ptr fence;
 };
 
+/* Every disk level is a sorted run split into key range partitions, ptr
+ * points to the array of aulsmfs_ctree descriptors of the partitions
+ * sorted by key. Zero parts means that the level is empty. */
+struct aulsmfs_level {
+	struct aulsmfs_ptr ptr;
+	le64_t parts;
+} __attribute__((packed));
+
 struct aulsmfs_tree {
-	/* These point on the root nodes of the B+ trees. Zero offset
-	 * and size means that tree is empty. */
-	struct aulsmfs_ctree ci[AULSMFS_MAX_DISK_TREES];
+	/* Only first aulsmfs_super::levels entries are used. */
+	struct aulsmfs_level ci[AULSMFS_MAX_DISK_TREES];
 } __attribute__((packed));
 
 struct aulsmfs_super {
@@ -83,6 +133,8 @@ struct aulsmfs_super {
 	le64_t version;
 	le64_t page_size;
 	le64_t pages;
+	/* Number of disk levels of every tree. */
+	le64_t levels;
 
 	/* Stores information about used blocks. Information includes
 	 * snapshot id when block has been allocated and snapshot id
@@ -0,0 +1,28 @@
+#ifndef __BLOOM_H__
+#define __BLOOM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bloom filter over 32 bit key hashes. Instead of computing independent
+ * hash functions we derive all probes from a single hash using double
+ * hashing, so for every key we only need to store its 32 bit hash until
+ * the filter is built. */
+
+uint32_t bloom_hash(const void *data, size_t size);
+
+/* Returns number of probes per key for the given number of bits per key. */
+int bloom_hashes(size_t bits_per_key);
+
+/* Returns size of the filter bit array in bytes. */
+size_t bloom_size(size_t keys, size_t bits_per_key);
+
+/* Sets bits for all the given hashes, bits array must be zeroed. */
+void bloom_build(void *bits, size_t size, int hashes,
+			const uint32_t *hash, size_t count);
+
+/* Returns 0 if the key with the given hash is definitely not in the set. */
+int bloom_may_contain(const void *bits, size_t size, int hashes,
+			uint32_t hash);
+
+#endif /*__BLOOM_H__*/
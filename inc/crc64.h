@@ -10,11 +10,26 @@ struct crc64_ctx {
 	uint64_t crc;
 };
 
+/* Uses carry-less multiplication if the CPU supports it and falls back
+ * to __crc64_table otherwise, both give the same result. */
 uint64_t __crc64(uint64_t init, const void *data, size_t size);
+uint64_t __crc64_table(uint64_t init, const void *data, size_t size);
 
 static inline uint64_t crc64(const void *data, size_t size)
 { return __crc64(CRC64_INIT, data, size); }
 
+/* Returns the CRC of a buffer followed by len_b bytes given the CRCs of
+ * both, crc_b must be computed with CRC64_INIT. Takes O(log(len_b)). */
+uint64_t crc64_combine(uint64_t crc_a, uint64_t crc_b, size_t len_b);
+
+/* Same as __crc64, but large buffers are split in slices checksummed by
+ * up to threads threads, zero means a thread per CPU. */
+uint64_t __crc64_parallel(uint64_t init, const void *data, size_t size,
+			int threads);
+
+static inline uint64_t crc64_parallel(const void *data, size_t size)
+{ return __crc64_parallel(CRC64_INIT, data, size, 0); }
+
 
 static inline void crc64_ctx_setup(struct crc64_ctx *ctx)
 { ctx->crc = CRC64_INIT; }
@@ -29,4 +44,10 @@ static inline void crc64_ctx_update(struct crc64_ctx *ctx,
 static inline uint64_t crc64_ctx_csum(const struct crc64_ctx *ctx)
 { return ctx->crc; }
 
+/* Copies size bytes from src to dst and updates the CRC with them in the
+ * same pass, so that staging a buffer and checksumming it touches every
+ * byte once. Returns dst. */
+void *memcpy_crc64(void *dst, const void *src, size_t size,
+			struct crc64_ctx *ctx);
+
 #endif /*__CRC64_H__*/
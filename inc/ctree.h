@@ -1,10 +1,13 @@
 #ifndef __CTREE_H__
 #define __CTREE_H__
 
+#include <key_schema.h>
 #include <aulsmfs.h>
+#include <rbtree.h>
 #include <alloc.h>
 #include <io.h>
 
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -18,6 +21,20 @@ struct range {
 	uint64_t end;
 };
 
+struct ctree_writer;
+struct lz_state;
+
+/* A leaf written or appended by a leaves_only builder, its first and last
+ * keys are kept in the leaf_keys buffer of the builder. */
+struct ctree_leaf {
+	struct aulsmfs_ptr ptr;
+	size_t items;
+	size_t key_offs;
+	size_t first_size;
+	size_t last_size;
+	int reused;
+};
+
 struct ctree_builder {
 	struct io *io;
 	struct alloc *alloc;
@@ -31,8 +48,57 @@ struct ctree_builder {
 	size_t max_ranges;
 	size_t pages;
 
+	/* Pages of leaves appended by ctree_builder_append_leaf, they are
+	 * counted in pages, but weren't written by the builder. */
+	size_t reused_pages;
+
+	/* If set the builder only writes leaves and ctree_builder_finish
+	 * doesn't build a tree of them, instead ctree_builder_move_leaf
+	 * appends them to another builder one by one. Leaves are written
+	 * synchronously in this mode. */
+	int leaves_only;
+	struct ctree_leaf *leaf;
+	size_t leaves;
+	size_t max_leaves;
+	char *leaf_keys;
+	size_t leaf_keys_bytes;
+	size_t max_leaf_keys_bytes;
+	size_t moved;
+	size_t moved_hashes;
+
+	/* Bits per key of the Bloom filter, zero means no filter. Since the
+	 * filter hashes raw key bytes it may only be used when keys equal
+	 * according to the comparision function are equal bytewise. */
+	size_t bloom_bits;
+	uint32_t *hash;
+	size_t hashes;
+	size_t max_hashes;
+
+	/* Format of leaf nodes, AULSMFS_NODE_PREFIX by default. Interior
+	 * nodes are always written in AULSMFS_NODE_PLAIN format. */
+	int leaf_format;
+
+	/* If set ctree_builder_finish also writes the fence index of the
+	 * tree, see aulsmfs_ctree. */
+	int fence_index;
+	struct ctree_node *fence_node;
+
+	/* Leaves are filled up to leaf_pages pages (1 by default). If
+	 * compress is set nodes are lz compressed whenever it saves at least
+	 * one page, so it only pays off with leaf_pages above 1. */
+	size_t leaf_pages;
+	int compress;
+	struct lz_state *lz;
+
+	/* Number of finished nodes that may wait for the writer thread, zero
+	 * means that nodes are written synchronously. */
+	size_t write_queue;
+	struct ctree_writer *writer;
+
 	/* These will be set by ctree_builder_finish. */
 	struct aulsmfs_ptr ptr;
+	struct aulsmfs_ptr bloom;
+	struct aulsmfs_ptr fence;
 	int height;
 };
 
@@ -43,13 +109,105 @@ int ctree_builder_append(struct ctree_builder *builder,
 			const struct lsm_key *key, const struct lsm_val *val);
 int ctree_builder_finish(struct ctree_builder *builder);
 void ctree_builder_cancel(struct ctree_builder *builder);
+/* Commits the space reserved by the builder once the tree is in use, from
+ * then on only ctree_free gives it back. */
+int ctree_builder_commit(struct ctree_builder *builder);
+
+struct ctree_iter;
+
+/* Appends the leaf the iterator points to by pointer without rewriting it,
+ * see ctree_iter_leaf_items. The leaf is shared by both trees afterwards. */
+int ctree_builder_append_leaf(struct ctree_builder *builder,
+			const struct ctree_iter *iter);
+
+/* Appends the next leaf of a finished leaves_only builder, unless the leaf
+ * was reused its space belongs to the builder from then on. */
+int ctree_builder_move_leaf(struct ctree_builder *builder,
+			struct ctree_builder *from);
+void ctree_builder_leaf_keys(const struct ctree_builder *builder,
+			size_t leaf, struct lsm_key *first,
+			struct lsm_key *last);
+
+
+struct ctree_pool_stats {
+	/* Nodes allocated with malloc and nodes taken from the pool. */
+	unsigned long long allocs;
+	unsigned long long reuses;
+	/* Nodes freed because the pool was full. */
+	unsigned long long frees;
+	size_t nodes;
+	size_t bytes;
+};
+
+/* Released nodes are kept in a process wide pool of at most max_bytes
+ * (16MB by default) and reused by iterators, caches and builders. */
+void ctree_pool_set_max_bytes(size_t max_bytes);
+void ctree_pool_stats(struct ctree_pool_stats *stats);
+
+
+struct ctree_cache_stats {
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+	size_t bytes;
+};
+
+/* Cache of parsed ctree nodes shared between all the iterators that use it.
+ * Nodes are identified by their aulsmfs_ptr (offset, size and checksum), so
+ * one cache can be shared between all the ctrees that live on the same io.
+ * Nodes used by iterators are pinned and never evicted, unpinned nodes are
+ * evicted in LRU order as soon as cache grows beyond max_bytes. */
+struct ctree_cache {
+	pthread_mutex_t mtx;
+	struct rb_tree tree;
+
+	/* Unpinned nodes only, head is the least recently used one. */
+	struct ctree_node *lru_head;
+	struct ctree_node *lru_tail;
+
+	size_t max_bytes;
+	struct ctree_cache_stats stats;
+};
+
+void ctree_cache_setup(struct ctree_cache *cache, size_t max_bytes);
+void ctree_cache_release(struct ctree_cache *cache);
+void ctree_cache_stats(struct ctree_cache *cache,
+			struct ctree_cache_stats *stats);
 
 
 typedef int (*ctree_cmp_t)(const struct lsm_key *, const struct lsm_key *);
 
+#define CTREE_DEFAULT_READAHEAD	8
+
 struct ctree {
 	struct io *io;
 	ctree_cmp_t cmp;
+	/* Set by ctree_setup according to the comparator. */
+	enum key_schema schema;
+
+	/* Optional, NULL means that every iterator reads nodes on its own. */
+	struct ctree_cache *cache;
+
+	/* If set ctree_reset and ctree_parse load all the interior nodes
+	 * of the tree and keep them in memory until the tree is reset or
+	 * released, so that a lookup reads at most one leaf node. If the
+	 * tree has a fence index it's loaded instead and iterators use it
+	 * as the root of a two level tree. */
+	int pin_interior;
+	struct rb_tree interior;
+	size_t interior_bytes;
+	struct aulsmfs_ptr fence;
+	int fenced;
+
+	/* Number of leaves iterators read ahead once they see a sequential
+	 * forward scan, zero disables readahead. */
+	size_t readahead;
+
+	/* Bloom filter loaded by ctree_reset and ctree_parse. */
+	struct aulsmfs_ptr bloom;
+	void *bloom_data;
+	size_t bloom_size;
+	int bloom_hashes;
 
 	struct aulsmfs_ptr ptr;
 	size_t height;
@@ -58,9 +216,16 @@ struct ctree {
 
 void ctree_setup(struct ctree *ctree, struct io *io, ctree_cmp_t cmp);
 void ctree_release(struct ctree *ctree);
+void ctree_set_cache(struct ctree *ctree, struct ctree_cache *cache);
+void ctree_set_pin_interior(struct ctree *ctree, int pin);
+void ctree_set_readahead(struct ctree *ctree, size_t leaves);
 int ctree_reset(struct ctree *ctree, const struct aulsmfs_ptr *ptr,
-			size_t height, size_t pages);
+			const struct aulsmfs_ptr *bloom,
+			const struct aulsmfs_ptr *fence, size_t height,
+			size_t pages);
 int ctree_is_empty(const struct ctree *ctree);
+/* Returns 0 if the tree definitely doesn't contain the key. */
+int ctree_may_contain(const struct ctree *ctree, const struct lsm_key *key);
 void ctree_swap(struct ctree *l, struct ctree *r);
 void ctree_parse(struct ctree *ctree, const struct aulsmfs_ctree *ondisk);
 void ctree_dump(const struct ctree *ctree, struct aulsmfs_ctree *ondisk);
@@ -69,12 +234,22 @@ void ctree_dump(const struct ctree *ctree, struct aulsmfs_ctree *ondisk);
 struct ctree_iter {
 	struct io *io;
 	ctree_cmp_t cmp;
+	enum key_schema schema;
+	struct ctree_cache *cache;
+	const struct rb_tree *interior;
 
 	struct aulsmfs_ptr ptr;
 	int height;
 
 	struct ctree_node **node;
 	size_t *pos;
+
+	/* Leaves after ra_next of the ra_parent node are not read ahead yet,
+	 * sequential counts leaves crossed by ctree_next in a row. */
+	size_t readahead;
+	size_t sequential;
+	struct aulsmfs_ptr ra_parent;
+	size_t ra_next;
 };
 
 void ctree_iter_setup(struct ctree_iter *iter, struct ctree *ctree);
@@ -91,4 +266,33 @@ int ctree_prev(struct ctree_iter *iter);
 int ctree_key(const struct ctree_iter *iter, struct lsm_key *key);
 int ctree_val(const struct ctree_iter *iter, struct lsm_val *val);
 
+/* If the iterator points to the first item of a leaf returns the number
+ * of items in the leaf, zero otherwise. ctree_iter_leaf_item gives access
+ * to the items of the leaf without moving the iterator, and
+ * ctree_skip_leaf moves the iterator to the first item of the next leaf. */
+size_t ctree_iter_leaf_items(const struct ctree_iter *iter);
+void ctree_iter_leaf_item(const struct ctree_iter *iter, size_t pos,
+			struct lsm_key *key, struct lsm_val *val);
+/* Disk offset of the leaf, it identifies the leaf after it's been appended
+ * to another tree with ctree_builder_append_leaf. */
+uint64_t ctree_iter_leaf_offs(const struct ctree_iter *iter);
+int ctree_skip_leaf(struct ctree_iter *iter);
+
+typedef int (*ctree_key_fn_t)(void *, const struct lsm_key *);
+typedef int (*ctree_keep_fn_t)(void *, uint64_t);
+
+/* Calls fn in key order for separator keys of interior nodes (all but the
+ * first key of the tree), they split the tree into ranges of about the
+ * same size. The next level is used if the root has no more than keys
+ * entries. */
+int ctree_split_keys(struct ctree *ctree, size_t keys, ctree_key_fn_t fn,
+			void *arg);
+
+/* Frees all the pages of the tree except leaves at offsets for which keep
+ * returns non zero, they were appended to another tree and belong to it
+ * now. Pages of the tree are freed even if we fail to read some of its
+ * nodes, only the subtrees of those nodes are left. */
+int ctree_free(struct ctree *ctree, struct alloc *alloc, ctree_keep_fn_t keep,
+			void *arg);
+
 #endif /*__CTREE_H__*/
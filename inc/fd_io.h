@@ -0,0 +1,31 @@
+#ifndef __FD_IO_H__
+#define __FD_IO_H__
+
+#include <io.h>
+
+#include <stddef.h>
+
+
+/* Serve requests with the thread pool even if io_uring is available. */
+#define FD_IO_POOL	1
+
+#define FD_IO_POOL_THREADS	4
+
+struct fd_pool;
+
+/* struct io over a file descriptor. Queues of the io use io_uring with the
+ * file and the registered buffers fixed in the ring if the kernel supports
+ * it, otherwise requests are served by a pool of threads shared by all the
+ * queues of the io. */
+struct fd_io {
+	struct io io;
+	int fd;
+	int uring;
+	struct fd_pool *pool;
+};
+
+int fd_io_setup(struct fd_io *fio, int fd, size_t page_size, int flags);
+/* All the queues must be released before. */
+void fd_io_release(struct fd_io *fio);
+
+#endif /*__FD_IO_H__*/
@@ -6,5 +6,7 @@
 ssize_t file_size(int fd);
 int file_write_at(int fd, const void *data, int size, off_t off);
 int file_read_at(int fd, void *data, int size, off_t off);
+/* Asks the kernel to start reading the range in background. */
+int file_readahead(int fd, size_t size, off_t off);
 
 #endif /*__FILE_WRAPPERS_H__*/
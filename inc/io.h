@@ -2,11 +2,15 @@
 #define __AULSMFS_IO_H__
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <assert.h>
 
 
 struct io;
+struct io_req;
+struct io_queue;
 
 /* All offsets and sizes are given in bytes. It's convenient to use bytes for
  * low-level io operations. */
@@ -14,6 +18,20 @@ struct io_ops {
 	int (*read)(struct io *, void *, size_t, off_t);
 	int (*write)(struct io *, const void *, size_t, off_t);
 	int (*sync)(struct io *);
+	/* Optional, starts reading the range in background without waiting
+	 * for the data, so that a following read finds it ready. */
+	int (*readahead)(struct io *, size_t, off_t);
+
+	/* Optional asynchronous interface, see io_queue. Without it requests
+	 * are served by read and write right at submission. submit is never
+	 * given more requests than the queue has free slots, reap waits for
+	 * at least the given number of requests to complete and passes them
+	 * to io_queue_complete. */
+	int (*queue_setup)(struct io *, struct io_queue *);
+	void (*queue_release)(struct io_queue *);
+	int (*queue_register)(struct io_queue *, const struct iovec *, size_t);
+	int (*submit)(struct io_queue *, struct io_req **, size_t);
+	int (*reap)(struct io_queue *, size_t);
 };
 
 struct io {
@@ -47,6 +65,105 @@ static inline int io_sync(struct io *io)
 	return ops->sync(io);
 }
 
+static inline int io_readahead(struct io *io, size_t size, uint64_t off)
+{
+	struct io_ops * const ops = io->ops;
+
+	if (!ops->readahead)
+		return 0;
+	return ops->readahead(io, size * io->page_size, off * io->page_size);
+}
+
+
+enum io_req_op {
+	IO_REQ_READ,
+	IO_REQ_WRITE,
+};
+
+/* Offset and size are given in pages, like for io_read and io_write. */
+struct io_req {
+	enum io_req_op op;
+	void *buf;
+	size_t size;
+	uint64_t offs;
+	/* Index of the registered buffer that contains buf, or -1. */
+	int buf_index;
+
+	/* Called by io_queue_reap once the request is complete, result is
+	 * the number of bytes transferred (less than requested only if a
+	 * read hits the end of file) or -errno. */
+	void (*done)(struct io_req *);
+	void *arg;
+	ssize_t result;
+
+	/* Private to the queue. */
+	struct io_queue *queue;
+	struct io_req *next;
+	size_t bytes;
+};
+
+static inline void io_req_read(struct io_req *req, void *buf, size_t size,
+			uint64_t off)
+{
+	req->op = IO_REQ_READ;
+	req->buf = buf;
+	req->size = size;
+	req->offs = off;
+	req->buf_index = -1;
+	req->done = NULL;
+	req->arg = NULL;
+	req->result = 0;
+}
+
+static inline void io_req_write(struct io_req *req, const void *buf,
+			size_t size, uint64_t off)
+{
+	io_req_read(req, (void *)buf, size, off);
+	req->op = IO_REQ_WRITE;
+}
+
+/* A queue keeps up to depth requests in flight. It's owned by a single
+ * thread: callbacks are run by io_queue_reap in the thread that calls it,
+ * different threads should use different queues of the same io. */
+struct io_queue {
+	struct io *io;
+	size_t depth;
+	size_t inflight;
+
+	/* Completed requests waiting for io_queue_reap. */
+	struct io_req *head;
+	struct io_req *tail;
+
+	/* Private to the io implementation. */
+	void *priv;
+};
+
+int io_queue_setup(struct io_queue *queue, struct io *io, size_t depth);
+/* Waits for all the requests in flight. */
+void io_queue_release(struct io_queue *queue);
+/* Registers buffers for requests with buf_index set, so that the io doesn't
+ * map them for every request, replaces buffers registered before. It's
+ * only a hint: requests work the same even if it fails. */
+int io_queue_register(struct io_queue *queue, const struct iovec *iov,
+			size_t count);
+/* Queues the requests, waits for (and so reaps) requests in flight if the
+ * queue is full. Errors of the requests are reported to their callbacks,
+ * the return value is an error of the queue itself. */
+int io_queue_submit(struct io_queue *queue, struct io_req **req,
+			size_t count);
+/* Runs callbacks of completed requests, waits for at least min of them
+ * (or all the requests in flight if there are less). Returns the number
+ * of requests completed or -errno. */
+int io_queue_reap(struct io_queue *queue, size_t min);
+void io_queue_complete(struct io_queue *queue, struct io_req *req);
+
+static inline int io_queue_drain(struct io_queue *queue)
+{
+	const int rc = io_queue_reap(queue, queue->inflight);
+
+	return rc < 0 ? rc : 0;
+}
+
 static inline size_t io_align(const struct io *io, size_t size)
 {
 	return (size + io->page_size - 1) & ~(io->page_size - 1);
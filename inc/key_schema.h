@@ -0,0 +1,92 @@
+#ifndef __KEY_SCHEMA_H__
+#define __KEY_SCHEMA_H__
+
+#include <lsm_fwd.h>
+
+#include <endian.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Trees can't look into an arbitrary comparision function, so every key
+ * ordering decision costs an indirect call. Comparators below declare the
+ * layout of the keys instead: mtrees and ctrees set up with one of them
+ * compare keys with the inlined kernels of this file and ctree nodes are
+ * searched by key prefixes, the comparator itself is never called. */
+enum key_schema {
+	/* Keys are ordered by an unknown comparision function. */
+	KEY_SCHEMA_OPAQUE,
+	/* Keys are ordered as memcmp orders them, a key goes before the
+	 * keys it's a prefix of. */
+	KEY_SCHEMA_BYTES,
+	/* 8 byte big endian unsigned integers. */
+	KEY_SCHEMA_U64,
+	/* 8 byte big endian unsigned integer followed by bytes, e.g. parent
+	 * inode number and a name. */
+	KEY_SCHEMA_U64_BYTES,
+};
+
+/* All the schemas but KEY_SCHEMA_OPAQUE are bytewise orders, they only
+ * differ in how fast keys can be compared. */
+int key_bytes_cmp(const struct lsm_key *l, const struct lsm_key *r);
+int key_u64_cmp(const struct lsm_key *l, const struct lsm_key *r);
+int key_u64_bytes_cmp(const struct lsm_key *l, const struct lsm_key *r);
+
+enum key_schema key_schema_of(int (*cmp)(const struct lsm_key *,
+			const struct lsm_key *));
+
+/* Returns the first position in [0, count) with a prefix greater than (if
+ * upper is set) or not less than the given value, prefixes are sorted. */
+size_t key_prefix_search(const uint64_t *prefix, size_t count,
+			uint64_t value, int upper);
+
+/* The first 8 bytes of a key as a big endian number, keys shorter than 8
+ * bytes are padded with zeroes. Prefixes of two keys compare as the keys
+ * do bytewise unless the prefixes are equal. */
+static inline uint64_t key_prefix(const void *key, size_t size)
+{
+	uint64_t prefix = 0;
+
+	memcpy(&prefix, key, size < sizeof(prefix) ? size : sizeof(prefix));
+	return be64toh(prefix);
+}
+
+static inline int key_bytes_compare(const void *l, size_t lsize,
+			const void *r, size_t rsize)
+{
+	const int cmp = memcmp(l, r, lsize < rsize ? lsize : rsize);
+
+	if (cmp)
+		return cmp;
+	return lsize < rsize ? -1 : lsize > rsize;
+}
+
+static inline int key_compare(enum key_schema schema,
+			int (*cmp)(const struct lsm_key *,
+				const struct lsm_key *),
+			const struct lsm_key *l, const struct lsm_key *r)
+{
+	switch (schema) {
+	case KEY_SCHEMA_OPAQUE:
+		break;
+	case KEY_SCHEMA_U64:
+	case KEY_SCHEMA_U64_BYTES:
+		if (l->size >= 8 && r->size >= 8) {
+			const uint64_t lv = key_prefix(l->ptr, 8);
+			const uint64_t rv = key_prefix(r->ptr, 8);
+
+			if (lv != rv)
+				return lv < rv ? -1 : 1;
+			return key_bytes_compare((const char *)l->ptr + 8,
+						l->size - 8,
+						(const char *)r->ptr + 8,
+						r->size - 8);
+		}
+		/* fallthrough */
+	case KEY_SCHEMA_BYTES:
+		return key_bytes_compare(l->ptr, l->size, r->ptr, r->size);
+	}
+	return cmp(l, r);
+}
+
+#endif /*__KEY_SCHEMA_H__*/
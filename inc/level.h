@@ -0,0 +1,125 @@
+#ifndef __LEVEL_H__
+#define __LEVEL_H__
+
+#include <aulsmfs.h>
+#include <lsm_fwd.h>
+#include <ctree.h>
+#include <alloc.h>
+#include <io.h>
+
+#include <stddef.h>
+
+
+/* Level is a sorted run split into key range partitions, every partition
+ * is a separate ctree. Partitions don't overlap and are sorted by key, so
+ * a merge into the level only needs to rebuild partitions that overlap
+ * with the incoming keys. */
+struct level_part {
+	struct ctree ctree;
+
+	/* Copies of the smallest and the largest keys of the partition. */
+	void *keys;
+	struct lsm_key first;
+	struct lsm_key last;
+};
+
+struct level {
+	struct io *io;
+	ctree_cmp_t cmp;
+	struct ctree_cache *cache;
+	int pin_interior;
+	size_t readahead;
+
+	struct level_part *part;
+	size_t parts;
+	size_t max_parts;
+
+	/* Total size of all the partitions in pages. */
+	size_t pages;
+
+	/* Next partition to merge into the next level, partitions are
+	 * merged down in round robin order. */
+	size_t cursor;
+
+	/* On disk array of aulsmfs_ctree descriptors of the partitions. */
+	struct aulsmfs_ptr ptr;
+};
+
+void level_setup(struct level *level, struct io *io, ctree_cmp_t cmp);
+void level_release(struct level *level);
+void level_set_cache(struct level *level, struct ctree_cache *cache);
+void level_set_pin_interior(struct level *level, int pin);
+void level_set_readahead(struct level *level, size_t leaves);
+int level_is_empty(const struct level *level);
+void level_swap(struct level *l, struct level *r);
+/* Returns 0 if the level definitely doesn't contain the key. */
+int level_may_contain(const struct level *level, const struct lsm_key *key);
+
+/* Returns the index of the first partition that may contain keys not less
+ * than the key, parts if there is no such partition. */
+size_t level_find(const struct level *level, const struct lsm_key *key);
+
+/* Adds the tree built by the builder as the last partition, first and last
+ * keys are read from the tree if they aren't given. */
+int level_append(struct level *level, const struct ctree_builder *builder,
+			const struct lsm_key *first, const struct lsm_key *last);
+/* Appends partitions [from, to) of src to the level, the partitions are
+ * shared by both levels until one of them is given up with level_forget or
+ * level_replace. This way a new state of a level can be prepared while
+ * readers still use the old one. */
+int level_share(struct level *level, const struct level *src, size_t from,
+			size_t to);
+/* Drops the partition array without releasing the partitions. */
+void level_forget(struct level *level);
+/* Swaps partitions of the level and next, but not their settings, so a
+ * new state prepared with level_share can be installed and the old one
+ * left in next for level_free_array and level_forget. Partitions the new
+ * state doesn't share have to be kept elsewhere until readers are done. */
+void level_replace(struct level *level, struct level *next);
+size_t level_range_pages(const struct level *level, size_t from, size_t to);
+/* Calls fn for keys that split partitions [from, to) into ranges of
+ * about the same size in key order, see ctree_split_keys. */
+int level_split_keys(struct level *level, size_t from, size_t to,
+			size_t keys, ctree_key_fn_t fn, void *arg);
+/* Writes the partition array to disk, it's the only state of the level
+ * not written by the builders. */
+int level_write(struct level *level, struct alloc *alloc);
+/* Frees the partition array written by level_write. */
+int level_free_array(struct level *level, struct alloc *alloc);
+/* Frees the pages of all the partitions, see ctree_free. */
+int level_free_parts(struct level *level, struct alloc *alloc,
+			ctree_keep_fn_t keep, void *arg);
+
+int level_parse(struct level *level, const struct aulsmfs_level *ondisk);
+void level_dump(const struct level *level, struct aulsmfs_level *ondisk);
+
+
+struct level_iter {
+	struct level *level;
+
+	/* The iterator only walks through partitions [from, to). */
+	size_t from;
+	size_t to;
+
+	size_t part;
+	struct ctree_iter iter;
+};
+
+void level_iter_setup(struct level_iter *iter, struct level *level);
+void level_iter_release(struct level_iter *iter);
+void level_iter_set_range(struct level_iter *iter, size_t from, size_t to);
+
+int level_lookup(struct level_iter *iter, const struct lsm_key *key);
+int level_lower_bound(struct level_iter *iter, const struct lsm_key *key);
+int level_upper_bound(struct level_iter *iter, const struct lsm_key *key);
+int level_begin(struct level_iter *iter);
+int level_end(struct level_iter *iter);
+
+int level_next(struct level_iter *iter);
+int level_prev(struct level_iter *iter);
+/* Moves to the first item of the next leaf, see ctree_skip_leaf. */
+int level_skip_leaf(struct level_iter *iter);
+int level_key(const struct level_iter *iter, struct lsm_key *key);
+int level_val(const struct level_iter *iter, struct lsm_val *val);
+
+#endif /*__LEVEL_H__*/
@@ -2,6 +2,7 @@
 #define __LOG_H__
 
 #include <aulsmfs.h>
+#include <crc64.h>
 #include <alloc.h>
 #include <io.h>
 
@@ -13,6 +14,15 @@ struct log_item {
 	size_t size;
 };
 
+#define TRANS_LOG_QUEUE	4
+
+struct trans_log_write {
+	struct io_req req;
+	void *data;
+	size_t max_size;
+	int complete;
+};
+
 struct trans_log {
 	struct io *io;
 	struct alloc *alloc;
@@ -25,6 +35,22 @@ struct trans_log {
 	void *chunk_data;
 	size_t chunk_size;
 	size_t chunk_max_size;
+	/* CRC of the first chunk_crc_size bytes of the chunk, the rest is
+	 * checksummed once it's long enough or the chunk is flushed. */
+	struct crc64_ctx chunk_crc;
+	size_t chunk_crc_size;
+
+	/* Flushed chunks are written in background, up to TRANS_LOG_QUEUE
+	 * at once. A flushed chunk buffer is swapped with the buffer of the
+	 * oldest write once it's complete, writes complete in any order, so
+	 * written only counts the complete writes in order of submission.
+	 * The first error is reported by the following flush or
+	 * trans_log_finish. */
+	struct io_queue queue;
+	struct trans_log_write write[TRANS_LOG_QUEUE];
+	size_t writes;
+	size_t written;
+	int rc;
 
 	size_t pages;
 	struct aulsmfs_ptr ptr;
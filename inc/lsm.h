@@ -5,27 +5,132 @@
 #include <lsm_fwd.h>
 #include <mtree.h>
 #include <ctree.h>
+#include <level.h>
 #include <alloc.h>
 #include <io.h>
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stddef.h>
 
 
+struct lsm_merge_policy;
+
+/* State of the trees that iterators work with. Every change of the set of
+ * trees publishes a new state, iterators pin the state they started with,
+ * so neither merges nor the c0 swap wait for them. */
+struct lsm_state {
+	/* The next newer state, protected by state_mtx as well as refs,
+	 * the number of iterators that use the state. */
+	struct lsm_state *next;
+	int refs;
+
+	struct mtree *c0;
+	struct mtree *c1;
+
+	/* Copies of the disk levels, they share partitions with lsm->ci. */
+	struct level ci[AULSMFS_MAX_DISK_TREES];
+	int levels;
+
+	/* The merged c1 and partitions replaced by merges, the newer state
+	 * doesn't have them. They are released together with the state once
+	 * neither it nor any older state is used, and so are the pages of
+	 * the partitions but leaves the merge output reused. */
+	struct mtree *drop_mtree;
+	struct level drop;
+	uint64_t *reused;
+	size_t reused_leaves;
+};
+
 struct lsm {
 	struct io *io;
 	struct alloc *alloc;
 
-	/* Key comparision function. */
+	/* Key comparision function, comparators of key_schema.h make
+	 * in memory and disk trees use inlined kernels for the schema. */
 	int (*cmp)(const struct lsm_key *, const struct lsm_key *);
 
 	/* Two in memory trees, all inserts/deletes go to c0, c1 is a temporary
-	 * tree that contains fixed state of c0 during merge. */
-	struct mtree c0;
-	struct mtree c1;
+	 * tree that contains fixed state of c0 during merge. Every swap gets
+	 * a new c0, c1 points to empty when there is nothing to merge. */
+	struct mtree *c0;
+	struct mtree *c1;
+	struct mtree empty;
+	enum mtree_type mtree_type;
+
+	/* Copy of c0->bytes, it's only updated under add_lock, so lsm_add
+	 * can check it without the lock. */
+	size_t c0_bytes;
+
+	/* Disk levels, only the first levels of them are used. Merges
+	 * change them under merge_mtx, readers use copies in states. */
+	struct level ci[AULSMFS_MAX_DISK_TREES];
+	int levels;
+
+	/* The current state and the oldest one not released yet, changes of
+	 * c0, c1, ci and the list of states are protected by state_mtx. */
+	struct lsm_state *state;
+	struct lsm_state *oldest;
+	pthread_mutex_t state_mtx;
+
+	/* Merges cut the output into partitions of about part_pages pages,
+	 * zero means that every merge builds a single partition. */
+	size_t part_pages;
+
+	/* The first disk level may take level_pages pages, every next level
+	 * level_ratio times more, lsm_compact moves partitions of oversized
+	 * levels down. Zero level_pages disables compaction. */
+	size_t level_pages;
+	size_t level_ratio;
+
+	/* Pages written by merges, for write amplification stats. */
+	size_t merge_pages;
+
+	/* Number of threads a merge splits its key range between. Parallel
+	 * builders and releases of old states allocate through merge_alloc,
+	 * which serializes calls to the alloc. */
+	int merge_threads;
+	struct alloc merge_alloc;
+	pthread_mutex_t alloc_mtx;
+
+	/* Write queue length of merge builders, see ctree_builder. */
+	size_t write_queue;
 
-	/* Descriptors of disk trees. */
-	struct ctree ci[AULSMFS_MAX_DISK_TREES];
+	/* Leaf size of merge builders in pages, zero means that nodes aren't
+	 * compressed, see ctree_builder. */
+	size_t compress_pages;
+
+	/* If set merges write fence indexes of partitions, see
+	 * aulsmfs_ctree. */
+	int fence_index;
+
+	/* Bits per key of Bloom filters built by merges, zero disables
+	 * them, see ctree_builder for restrictions. */
+	size_t bloom_bits;
+
+	/* lsm_add holds it for read if c0 is a skiplist and for write
+	 * otherwise, iterators hold it for read while they walk rb tree c0.
+	 * c0 is swapped under write lock. */
+	pthread_rwlock_t add_lock;
+
+	/* Serializes merges, since they all update disk trees. */
+	pthread_mutex_t merge_mtx;
+
+	/* Background merge state, protected by mtx. merging is set while
+	 * c1 is being merged into the first disk tree, either by the merger
+	 * or by lsm_merge. merge_pending is set only when c0 is handed over
+	 * to the merger, so the merger doesn't take merges it wasn't
+	 * given. */
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	pthread_t merger;
+	struct lsm_merge_policy *merger_policy;
+	size_t merge_threshold;
+	int merger_running;
+	int merger_stop;
+	int merging;
+	int merge_pending;
+	int merge_rc;
 };
 
 static inline int lsm_reserve(struct lsm *lsm, uint64_t size, uint64_t *offs)
@@ -48,30 +153,87 @@ static inline int lsm_free(struct lsm *lsm, uint64_t size, uint64_t offs)
 	return alloc_free(lsm->alloc, size, offs);
 }
 
-void lsm_setup(struct lsm *lsm, struct io *io, struct alloc *alloc,
+int lsm_setup(struct lsm *lsm, struct io *io, struct alloc *alloc,
 		int (*cmp)(const struct lsm_key *, const struct lsm_key *));
 void lsm_release(struct lsm *lsm);
+void lsm_set_cache(struct lsm *lsm, struct ctree_cache *cache);
+void lsm_set_pin_interior(struct lsm *lsm, int pin);
+/* Sets how many leaves iterators read ahead during forward scans, see
+ * struct ctree. */
+void lsm_set_readahead(struct lsm *lsm, size_t leaves);
+void lsm_set_bloom_bits(struct lsm *lsm, size_t bits_per_key);
+/* Selects in memory tree implementation, MTREE_SKIPLIST allows concurrent
+ * lsm_add calls. Returns -EBUSY if in memory trees aren't empty. */
+int lsm_set_mtree_type(struct lsm *lsm, enum mtree_type type);
+/* Sets the number of disk levels, it can't be changed for a non empty
+ * lsm, returns -EINVAL if levels isn't in [1, AULSMFS_MAX_DISK_TREES]. */
+int lsm_set_levels(struct lsm *lsm, int levels);
+void lsm_set_compaction(struct lsm *lsm, size_t part_pages,
+			size_t level_pages, size_t level_ratio);
+/* Merges with the default build function split the key range into
+ * threads ranges and write their leaves concurrently, then one tree is
+ * built of the leaves of all the ranges. */
+void lsm_set_merge_threads(struct lsm *lsm, int threads);
+/* Merges write finished nodes in background, while the builder fills the
+ * next one, up to nodes nodes may be in flight. Leaves of parallel merge
+ * ranges are written synchronously by their threads. Zero, the default,
+ * disables it: with synchronous io it hasn't shown a gain yet. */
+void lsm_set_write_queue(struct lsm *lsm, size_t nodes);
+/* Merges build leaves of up to leaf_pages pages and compress them, zero
+ * disables compression. */
+void lsm_set_compression(struct lsm *lsm, size_t leaf_pages);
+/* Merges write fence indexes, levels with pinned interior nodes load them
+ * instead of the interior nodes, see ctree. */
+void lsm_set_fence_index(struct lsm *lsm, int fence);
 
-void lsm_parse(struct lsm *lsm, const struct aulsmfs_tree *ondisk);
+int lsm_parse(struct lsm *lsm, const struct aulsmfs_tree *ondisk);
 void lsm_dump(const struct lsm *lsm, struct aulsmfs_tree *ondisk);
 
+/* Starts a thread that merges c0 into the first disk tree in background
+ * once c0 takes more than threshold bytes. lsm_add swaps c0 into c1 and
+ * continues to fill new c0, if c0 is full again while c1 is still being
+ * merged it grows up to twice the threshold, then lsm_add waits for the
+ * merge. */
+int lsm_start_merger(struct lsm *lsm, size_t threshold);
+void lsm_stop_merger(struct lsm *lsm);
+/* Waits for the current background merge and returns the error of the
+ * last failed background merge if any. */
+int lsm_wait_merger(struct lsm *lsm);
+
 int lsm_add(struct lsm *lsm, const struct lsm_key *key,
 			const struct lsm_val *val);
 
 
 struct lsm_iter {
 	struct lsm *lsm;
+	struct lsm_state *state;
 	int from, to;
 
 	struct mtree_iter it0;
 	struct mtree_iter it1;
-	struct ctree_iter iti[AULSMFS_MAX_DISK_TREES];
+	struct level_iter iti[AULSMFS_MAX_DISK_TREES];
 
 	struct lsm_key keyi[AULSMFS_MAX_DISK_TREES + 2];
 	struct lsm_val vali[AULSMFS_MAX_DISK_TREES + 2];
 
+	/* The current item. By default it's copied into buf, in zero copy
+	 * mode key and val point directly into the source (mtree node or
+	 * ctree node buffer) instead. In that case they stay valid only
+	 * until the iterator is moved, repositioned or released. */
 	struct lsm_key key;
 	struct lsm_val val;
+	int zero_copy;
+	int cur;
+
+	/* Min heap of sources (indices in keyi) that have an item, it's
+	 * only maintained while moving forward. */
+	int heap[AULSMFS_MAX_DISK_TREES + 2];
+	int heap_size;
+	int heap_valid;
+
+	/* Sources (indices in keyi) skipped by lsm_lookup or lsm_get, they
+	 * are positioned lazily when the iterator moves. */
+	int pending[AULSMFS_MAX_DISK_TREES + 2];
 
 	void *buf;
 	size_t buf_size;
@@ -80,7 +242,15 @@ struct lsm_iter {
 void lsm_iter_setup(struct lsm_iter *iter, struct lsm *lsm);
 void lsm_iter_release(struct lsm_iter *iter);
 
+/* Returns positive value if lookup found required key, in this case iterator
+ * points to the key and can be moved as usual. Otherwise the iterator doesn't
+ * point to any item and should be repositioned before use. Disk trees are
+ * only touched if their Bloom filters might contain the key. */
 int lsm_lookup(struct lsm_iter *iter, const struct lsm_key *key);
+/* Point lookup with the same result as lsm_lookup, but it probes c0, c1
+ * and then disk trees from the newest to the oldest and stops at the first
+ * tree that contains the key, without positioning the rest of them. */
+int lsm_get(struct lsm_iter *iter, const struct lsm_key *key);
 int lsm_lower_bound(struct lsm_iter *iter, const struct lsm_key *key);
 int lsm_upper_bound(struct lsm_iter *iter, const struct lsm_key *key);
 
@@ -99,6 +269,29 @@ struct lsm_merge_policy {
 	int drop_deleted;
 	int tree;
 
+	/* Bounds of the key range to build, NULL means no bound. */
+	const struct lsm_key *begin;
+	const struct lsm_key *end;
+
+	/* Partitions [part_from, part_to) of the source disk level. */
+	size_t part_from;
+	size_t part_to;
+
+	/* Partitions built by the merge and copies of the first and the last
+	 * keys of the current one, see lsm_merge_append. */
+	struct level out;
+	struct lsm_key first;
+	struct lsm_key last;
+	size_t first_cap;
+	size_t last_cap;
+	size_t appended;
+
+	/* Disk offsets of source leaves the output reused, they stay when
+	 * the source partitions are freed. */
+	uint64_t *reused;
+	size_t reused_leaves;
+	size_t max_reused;
+
 	/* Only required for default build function. */
 	int (*deleted)(struct lsm_merge_policy *, const struct lsm_key *,
 				const struct lsm_val *);
@@ -108,7 +301,15 @@ struct lsm_merge_policy {
 void lsm_merge_policy_setup(struct lsm_merge_policy *policy);
 void lsm_merge_policy_release(struct lsm_merge_policy *policy);
 
+/* Appends an item to the output of the merge, build functions should use
+ * it instead of ctree_builder_append to get the output partitioned. */
+int lsm_merge_append(struct lsm_merge_policy *policy,
+			const struct lsm_key *key, const struct lsm_val *val);
+
 int lsm_merge(struct lsm *lsm, int tree, struct lsm_merge_policy *policy);
+/* Merges a partition of every level larger than its target size into the
+ * next level until all the levels fit. */
+int lsm_compact(struct lsm *lsm, struct lsm_merge_policy *policy);
 
 
 #endif /*__LSM_H__*/
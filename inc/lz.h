@@ -0,0 +1,30 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Byte oriented LZ77 codec in the spirit of LZ4. Compressed data is a
+ * sequence of tokens, the high nibble of a token is the number of literal
+ * bytes that follow it, the low nibble is the match length minus 4. A
+ * nibble of 15 means that more length bytes follow, every 255 byte adds
+ * 255 and the first other byte ends the length. Literals are followed by
+ * a 16 bit little endian match offset, the last token has no match. */
+
+#define LZ_HASH_BITS	12
+
+/* Compressor state, it's too large for the stack so callers keep it. */
+struct lz_state {
+	uint32_t table[1 << LZ_HASH_BITS];
+};
+
+/* Returns the compressed size or 0 if it doesn't fit into cap bytes. */
+size_t lz_compress(struct lz_state *state, const void *src, size_t size,
+			void *dst, size_t cap);
+
+/* Returns 0 and the decompressed size in *size, or -EIO if the data is
+ * malformed or doesn't fit into cap bytes. */
+int lz_decompress(const void *src, size_t src_size, void *dst, size_t cap,
+			size_t *size);
+
+#endif /*__LZ_H__*/
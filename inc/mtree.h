@@ -1,6 +1,7 @@
 #ifndef __MTREE_H__
 #define __MTREE_H__
 
+#include <key_schema.h>
 #include <rbtree.h>
 
 #include <stddef.h>
@@ -9,14 +10,42 @@
 struct lsm_key;
 struct lsm_val;
 struct mtree_node;
+struct mtree_snode;
+struct mtree_slab;
+
+enum mtree_type {
+	/* Default single threaded implementation, the caller must serialize
+	 * all accesses to the tree. */
+	MTREE_RBTREE,
+
+	/* Lock-free skiplist, mtree_add can be called concurrently with
+	 * other mtree_add calls and with readers. mtree_reset, mtree_release
+	 * and mtree_swap still require exclusive access. A search takes
+	 * about 1.7 times the comparisons of the rb tree, each of them
+	 * likely a cache miss, so on its own an operation is about 1.5 times
+	 * slower, it only pays off with writers running on several cores. */
+	MTREE_SKIPLIST,
+};
+
+#define MTREE_MAX_HEIGHT	16
 
 
 typedef int (*mtree_cmp_t)(const struct lsm_key *, const struct lsm_key *);
 
 struct mtree {
 	mtree_cmp_t cmp;
+	/* Set by mtree_setup according to the comparator. */
+	enum key_schema schema;
+	enum mtree_type type;
+
+	/* Memory used by the tree including allocator overhead. */
 	size_t bytes;
 
+	/* All nodes are allocated from slabs owned by the tree and are never
+	 * freed individually, replaced values are released together with all
+	 * other nodes when the tree is reset or released. */
+	struct mtree_slab *slab;
+
 	/* For now it's just a rb tree, but we probably need a persistent
 	 * ordered map so that we can make snapshot of the structure so
 	 * that iterations doesn't block concurrent updates. Of course
@@ -24,17 +53,24 @@ struct mtree {
 	 * on-disk trees it happens naturally, we only need to make sure
 	 * that on-disk tree won't be freed until we finished iteration. */
 	struct rb_tree tree;
+
+	/* Skiplist heads and the height of the tallest node, used only by
+	 * MTREE_SKIPLIST trees. */
+	struct mtree_snode *head[MTREE_MAX_HEIGHT];
+	int height;
 };
 
 struct mtree_iter {
-	mtree_cmp_t cmp;
-	struct rb_tree *tree;
+	struct mtree *tree;
 
-	/* NULL means end */
-	struct mtree_node *node;
+	/* NULL means end, points to either mtree_node or mtree_snode
+	 * depending on the tree type. */
+	void *node;
 };
 
 void mtree_setup(struct mtree *tree, mtree_cmp_t cmp);
+/* Can be called only for an empty tree. */
+void mtree_set_type(struct mtree *tree, enum mtree_type type);
 void mtree_release(struct mtree *mtree);
 void mtree_reset(struct mtree *mtree);
 int mtree_is_empty(const struct mtree *mtree);
@@ -1,19 +1,24 @@
 #include <ctree.h>
 #include <crc64.h>
+#include <bloom.h>
+#include <key_schema.h>
 #include <lsm_fwd.h>
+#include <lz.h>
 
 #include <endian.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
 
 
+/* Nodes never grow beyond 4GB and on disk sizes are 16 bit. */
 struct ctree_entry {
-	size_t key_offs;
-	size_t key_size;
-	size_t val_offs;
-	size_t val_size;
+	uint32_t key_offs;
+	uint32_t val_offs;
+	uint16_t key_size;
+	uint16_t val_size;
 };
 
 struct ctree_node {
@@ -23,62 +28,198 @@ struct ctree_node {
 	size_t bytes;
 	size_t max_bytes;
 
+	/* The first 8 bytes of every key as a big endian number, so that
+	 * searches in trees with a key schema mostly look at this dense
+	 * array and not at the entries and keys, see key_prefix. */
 	struct ctree_entry *entry;
+	uint64_t *prefix;
 	size_t entries;
 	size_t max_entries;
+	size_t max_prefixes;
+
+	/* Keys of AULSMFS_NODE_PREFIX nodes are kept decoded in keys, so
+	 * that key_offs of their entries point there and not into buf. */
+	int format;
+	char *keys;
+	size_t keys_bytes;
+	size_t max_keys_bytes;
+
+	/* Offsets of restart points, only used while a node is built. */
+	uint32_t *restart;
+	size_t restarts;
+	size_t max_restarts;
+
+	/* The builder fills the node up to fill_pages pages. Compressed
+	 * image of the node goes to zbuf, zbytes is zero if the node is
+	 * written as is. Reads use zbuf for the compressed data. */
+	size_t fill_pages;
+	char *zbuf;
+	size_t zbytes;
+	size_t max_zbytes;
 
 	/* This will be set by ctree_node_write. */
 	struct aulsmfs_ptr ptr;
 	int level;
+
+	/* These are only used by ctree_cache. */
+	struct rb_node rb;
+	struct ctree_node *lru_prev;
+	struct ctree_node *lru_next;
+	size_t refs;
+
+	/* Interior node owned by struct ctree, iterators never free it. */
+	int resident;
 };
 
 
 static const size_t MIN_FANOUT = 100;
+static const size_t RESTART_INTERVAL = 16;
+static const size_t NODE_ALIGN = 4096;
+
+
+/* Nodes that are no longer used go to a process wide pool together with
+ * their buffers and entry arrays, so that iterators crossing leaves and
+ * builders flushing nodes don't go to malloc for every node. Nodes are
+ * shared between ctrees through caches and writer threads, so a per tree
+ * pool wouldn't be of much use. */
+struct ctree_pool {
+	pthread_mutex_t mtx;
+	/* Free nodes linked through lru_next. */
+	struct ctree_node *head;
+	size_t max_bytes;
+	struct ctree_pool_stats stats;
+};
+
+static struct ctree_pool ctree_pool = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+	.max_bytes = 16 * 1024 * 1024,
+};
 
 
-static int __ctree_node_setup(struct io *io, struct ctree_node *node,
-			size_t size, size_t count)
+static size_t ctree_node_footprint(const struct ctree_node *node)
 {
-	assert(io_align(io, size) == size);
+	return sizeof(*node) + node->max_bytes +
+				node->max_entries * sizeof(*node->entry) +
+				node->max_prefixes * sizeof(*node->prefix) +
+				node->max_keys_bytes +
+				node->max_restarts * sizeof(*node->restart) +
+				node->max_zbytes;
+}
 
-	memset(node, 0, sizeof(*node));
+static char *ctree_buf_alloc(size_t size)
+{
+	void *buf;
 
-	node->buf = malloc(size);
-	if (!node->buf)
-		return -ENOMEM;
+	if (posix_memalign(&buf, NODE_ALIGN, size))
+		return NULL;
+	return buf;
+}
+
+/* Makes sure that the node buffer can hold at least size bytes, the
+ * first keep bytes of the buffer are preserved. */
+static int ctree_node_reserve(struct ctree_node *node, size_t size,
+			size_t keep)
+{
+	if (node->max_bytes >= size)
+		return 0;
 
-	node->entry = calloc(count, sizeof(*node->entry));
-	if (!node->entry) {
-		free(node->buf);
-		node->buf = NULL;
+	char *buf = ctree_buf_alloc(size);
+
+	if (!buf)
 		return -ENOMEM;
-	}
 
+	if (keep)
+		memcpy(buf, node->buf, keep);
+	free(node->buf);
+	node->buf = buf;
 	node->max_bytes = size;
-	node->max_entries = count;
 	return 0;
 }
 
+static int ctree_node_reserve_zbuf(struct ctree_node *node, size_t size)
+{
+	if (node->max_zbytes >= size)
+		return 0;
+
+	char *buf = ctree_buf_alloc(size);
+
+	if (!buf)
+		return -ENOMEM;
+
+	free(node->zbuf);
+	node->zbuf = buf;
+	node->max_zbytes = size;
+	return 0;
+}
+
+static int ctree_reserve(void **ptr, size_t *max, size_t count, size_t size)
+{
+	if (*max >= count)
+		return 0;
+
+	const size_t next = *max * 2 < count ? count : *max * 2;
+	void *new = realloc(*ptr, next * size);
+
+	if (!new)
+		return -ENOMEM;
+
+	*ptr = new;
+	*max = next;
+	return 0;
+}
+
+static int ctree_node_reserve_entries(struct ctree_node *node, size_t count)
+{
+	const int rc = ctree_reserve((void **)&node->entry,
+				&node->max_entries, count,
+				sizeof(*node->entry));
+
+	if (rc < 0)
+		return rc;
+	return ctree_reserve((void **)&node->prefix, &node->max_prefixes,
+				count, sizeof(*node->prefix));
+}
+
+static int ctree_node_reserve_keys(struct ctree_node *node, size_t bytes)
+{
+	return ctree_reserve((void **)&node->keys, &node->max_keys_bytes,
+				bytes, 1);
+}
+
+static int ctree_node_reserve_restarts(struct ctree_node *node, size_t count)
+{
+	return ctree_reserve((void **)&node->restart, &node->max_restarts,
+				count, sizeof(*node->restart));
+}
+
 static void ctree_node_reset(struct ctree_node *node)
 {
 	assert(node->buf);
 	assert(node->max_bytes >= sizeof(struct aulsmfs_node_header));
 
-	memset(node->entry, 0, node->max_entries * sizeof(*node->entry));
-	node->entries = 0;
-
-	memset(node->buf, 0, node->max_bytes);
+	/* Only the header and the bytes in use are ever looked at, the tail
+	 * of the last page is cleared by ctree_node_write. */
+	memset(node->buf, 0, sizeof(struct aulsmfs_node_header));
 	node->bytes = sizeof(struct aulsmfs_node_header);
+	node->entries = 0;
+	node->keys_bytes = 0;
+	node->restarts = 0;
+	node->zbytes = 0;
 }
 
 static int ctree_node_setup(struct io *io, struct ctree_node *node)
 {
-	const int rc = __ctree_node_setup(io, node,
-				/* size */ io_align(io, 4096),
-				/* count */ MIN_FANOUT);
+	const size_t size = io_align(io, 4096);
+	int rc;
+
+	rc = ctree_node_reserve(node, size, 0);
+	if (rc < 0)
+		return rc;
 
+	rc = ctree_node_reserve_entries(node, MIN_FANOUT);
 	if (rc < 0)
 		return rc;
+
 	ctree_node_reset(node);
 	return 0;
 }
@@ -87,39 +228,125 @@ static void ctree_node_release(struct ctree_node *node)
 {
 	free(node->buf);
 	free(node->entry);
+	free(node->prefix);
+	free(node->keys);
+	free(node->restart);
+	free(node->zbuf);
 	memset(node, 0, sizeof(*node));
 }
 
+/* Returns a node that may already have a buffer and an entry array, but
+ * otherwise is empty. */
 static struct ctree_node *ctree_node_create(void)
 {
-	struct ctree_node *node = malloc(sizeof(*node));
+	struct ctree_pool *pool = &ctree_pool;
+	struct ctree_node *node;
 
-	memset(node, 0, sizeof(*node));
+	pthread_mutex_lock(&pool->mtx);
+	node = pool->head;
+	if (node) {
+		pool->head = node->lru_next;
+		pool->stats.bytes -= ctree_node_footprint(node);
+		--pool->stats.nodes;
+		++pool->stats.reuses;
+	} else {
+		++pool->stats.allocs;
+	}
+	pthread_mutex_unlock(&pool->mtx);
+
+	if (node) {
+		const struct ctree_node old = *node;
+
+		memset(node, 0, sizeof(*node));
+		node->buf = old.buf;
+		node->max_bytes = old.max_bytes;
+		node->entry = old.entry;
+		node->max_entries = old.max_entries;
+		node->prefix = old.prefix;
+		node->max_prefixes = old.max_prefixes;
+		node->keys = old.keys;
+		node->max_keys_bytes = old.max_keys_bytes;
+		node->restart = old.restart;
+		node->max_restarts = old.max_restarts;
+		node->zbuf = old.zbuf;
+		node->max_zbytes = old.max_zbytes;
+		return node;
+	}
+
+	node = malloc(sizeof(*node));
+	if (node)
+		memset(node, 0, sizeof(*node));
 	return node;
 }
 
 static void ctree_node_destroy(struct ctree_node *node)
 {
+	struct ctree_pool *pool = &ctree_pool;
+
+	if (!node)
+		return;
+
+	const size_t bytes = ctree_node_footprint(node);
+
+	pthread_mutex_lock(&pool->mtx);
+	if (node->buf && pool->stats.bytes + bytes <= pool->max_bytes) {
+		node->lru_next = pool->head;
+		pool->head = node;
+		pool->stats.bytes += bytes;
+		++pool->stats.nodes;
+		node = NULL;
+	} else {
+		++pool->stats.frees;
+	}
+	pthread_mutex_unlock(&pool->mtx);
+
 	if (node) {
 		ctree_node_release(node);
 		free(node);
 	}
 }
 
-static int ctree_node_parse(struct io *io, struct ctree_node *node)
+void ctree_pool_set_max_bytes(size_t max_bytes)
 {
-	const struct aulsmfs_node_header *header = (void *)node->buf;
-	const int level = le64toh(header->level);
-	const size_t bytes = le64toh(header->size);
-	const size_t pages = le64toh(node->ptr.size);
+	struct ctree_pool *pool = &ctree_pool;
+	struct ctree_node *node;
 
-	if (bytes > io_bytes(io, pages))
-		return -EIO;
+	pthread_mutex_lock(&pool->mtx);
+	pool->max_bytes = max_bytes;
+	node = NULL;
+	while (pool->head && pool->stats.bytes > pool->max_bytes) {
+		struct ctree_node *next = pool->head;
+
+		pool->head = next->lru_next;
+		pool->stats.bytes -= ctree_node_footprint(next);
+		--pool->stats.nodes;
+		++pool->stats.frees;
+		next->lru_next = node;
+		node = next;
+	}
+	pthread_mutex_unlock(&pool->mtx);
 
-	if (level != node->level)
-		return -EIO;
+	while (node) {
+		struct ctree_node *next = node->lru_next;
+
+		ctree_node_release(node);
+		free(node);
+		node = next;
+	}
+}
 
-	size_t offs = sizeof(*header);
+void ctree_pool_stats(struct ctree_pool_stats *stats)
+{
+	struct ctree_pool *pool = &ctree_pool;
+
+	pthread_mutex_lock(&pool->mtx);
+	*stats = pool->stats;
+	pthread_mutex_unlock(&pool->mtx);
+}
+
+static int ctree_node_parse_plain(struct ctree_node *node, size_t bytes)
+{
+	size_t offs = sizeof(struct aulsmfs_node_header);
 
 	while (offs != bytes) {
 		struct aulsmfs_node_entry entry;
@@ -135,26 +362,20 @@ static int ctree_node_parse(struct io *io, struct ctree_node *node)
 		if (offs + sizeof(entry) + key_size + val_size > bytes)
 			return -EIO;
 
-		if (node->entries == node->max_entries) {
-			const size_t entries = node->max_entries
-						? node->max_entries * 2
-						: MIN_FANOUT;
-			struct ctree_entry *ptr = realloc(node->entry,
-						sizeof(*ptr) * entries);
-
-			if (!ptr)
-				return -ENOMEM;
+		const int rc = ctree_node_reserve_entries(node,
+					node->entries + 1);
 
-			node->max_entries = entries;
-			node->entry = ptr;
-		}
+		if (rc < 0)
+			return rc;
 
-		struct ctree_entry *ptr = &node->entry[node->entries++];
+		struct ctree_entry *ptr = &node->entry[node->entries];
 
 		offs += sizeof(entry);
 
 		ptr->key_offs = offs;
 		ptr->key_size = key_size;
+		node->prefix[node->entries++] = key_prefix(
+					node->buf + offs, key_size);
 		offs += key_size;
 
 		ptr->val_offs = offs;
@@ -164,417 +385,2008 @@ static int ctree_node_parse(struct io *io, struct ctree_node *node)
 	return 0;
 }
 
-static int ctree_node_read(struct io *io, struct ctree_node *node,
-			const struct aulsmfs_ptr *ptr, int level)
-{
-	const size_t pages = le64toh(ptr->size);
-	const size_t buf_size = io_bytes(io, pages);
-	void *buf = malloc(buf_size);
-	int rc;
-
-	if (!buf)
-		return -ENOMEM;
-
-	node->buf = buf;
-	node->max_bytes = buf_size;
-	rc = io_read(io, buf, pages, le64toh(ptr->offs));
-	if (rc < 0)
-		return rc;
+/* Sizes stored in varints never exceed 16 bits, so they take at most three
+ * bytes. */
+static const size_t MAX_VARINT = 3;
 
-	if (crc64(buf, buf_size) != le64toh(ptr->csum))
-		return -EIO;
+static size_t ctree_varint_size(size_t value)
+{
+	size_t size = 1;
 
-	node->ptr = *ptr;
-	node->level = level;
-	rc = ctree_node_parse(io, node);
-	if (rc < 0)
-		return rc;
-	return 0;
+	while (value >= 0x80) {
+		value >>= 7;
+		++size;
+	}
+	return size;
 }
 
-static void ctree_node_key(const struct ctree_node *node, size_t pos,
-			struct lsm_key *key)
+static char *ctree_put_varint(char *ptr, size_t value)
 {
-	key->ptr = node->buf + node->entry[pos].key_offs;
-	key->size = node->entry[pos].key_size;
+	while (value >= 0x80) {
+		*ptr++ = (char)(value | 0x80);
+		value >>= 7;
+	}
+	*ptr++ = (char)value;
+	return ptr;
 }
 
-static void ctree_node_val(const struct ctree_node *node, size_t pos,
-			struct lsm_val *val)
+static int ctree_get_varint(const char *buf, size_t *offs, size_t end,
+			size_t *value)
 {
-	val->ptr = node->buf + node->entry[pos].val_offs;
-	val->size = node->entry[pos].val_size;
+	size_t res = 0;
+
+	for (size_t i = 0; i != MAX_VARINT && *offs != end; ++i) {
+		const unsigned char byte = buf[(*offs)++];
+
+		res |= (size_t)(byte & 0x7f) << (7 * i);
+		if (!(byte & 0x80)) {
+			*value = res;
+			return res > UINT16_MAX ? -EIO : 0;
+		}
+	}
+	return -EIO;
 }
 
-static int ctree_node_can_append(const struct io *io,
-			const struct ctree_node *node,
-			size_t count, size_t size)
+/* Keys are decoded into node->keys once the node is read, so the rest of
+ * the code sees the same entries as for a plain node. The restart array
+ * is only checked: every restart point it lists must store a whole key. */
+static int ctree_node_parse_prefix(struct ctree_node *node, size_t bytes)
 {
-	const size_t bytes = count * sizeof(struct aulsmfs_node_entry) + size;
+	const size_t header = sizeof(struct aulsmfs_node_header);
+	le32_t count;
 
-	if (node->entries + count <= MIN_FANOUT)
-		return 1;
+	if (bytes < header + sizeof(count))
+		return -EIO;
 
-	if (io_pages(io, node->bytes + bytes) == io_pages(io, node->bytes))
-		return 1;
+	memcpy(&count, node->buf + bytes - sizeof(count), sizeof(count));
 
-	return 0;
-}
+	const size_t restarts = le32toh(count);
 
-static int ctree_ensure_entries(const struct io *io, struct ctree_node *node,
-			size_t count, size_t size)
-{
-	const size_t entries = node->entries + count;
-	const size_t pages = io_pages(io, node->bytes + size);
-	const size_t bytes = io_bytes(io, pages);
+	if (restarts > (bytes - header) / sizeof(count) - 1)
+		return -EIO;
 
-	if (node->max_entries < entries) {
-		const size_t prev_entries = node->max_entries;
-		const size_t next_entries = prev_entries * 2 < entries
-					? prev_entries * 2 : entries;
-		const size_t new = next_entries - prev_entries;
+	const size_t end = bytes - (restarts + 1) * sizeof(count);
+	size_t offs = header;
+	size_t restart = 0;
+
+	while (offs != end) {
+		const size_t entry = offs;
+		size_t shared, key_size, val_size;
+		le32_t point;
+		int rc;
+
+		if (ctree_get_varint(node->buf, &offs, end, &shared) ||
+				ctree_get_varint(node->buf, &offs, end,
+					&key_size) ||
+				ctree_get_varint(node->buf, &offs, end,
+					&val_size))
+			return -EIO;
 
-		struct ctree_entry *entry = realloc(node->entry,
-					next_entries * sizeof(*node->entry));
+		if (offs + key_size + val_size > end)
+			return -EIO;
 
-		if (!entry)
-			return -ENOMEM;
+		if (restart != restarts)
+			memcpy(&point, node->buf + end +
+					restart * sizeof(point), sizeof(point));
+		if (restart != restarts && le32toh(point) == entry) {
+			if (shared)
+				return -EIO;
+			++restart;
+		} else if (!node->entries) {
+			return -EIO;
+		}
 
-		memset(entry + prev_entries, 0, new * sizeof(*node->entry));
-		node->entry = entry;
-		node->max_entries = next_entries;
-	}
+		const struct ctree_entry *prev = node->entries
+					? &node->entry[node->entries - 1]
+					: NULL;
 
-	if (node->max_bytes < bytes) {
-		const size_t prev_bytes = node->max_bytes;
-		const size_t next_bytes = prev_bytes * 2 < bytes
-					? prev_bytes * 2 : bytes;
-		const size_t new = next_bytes - prev_bytes;
-		char *buf = realloc(node->buf, next_bytes);
+		if (shared && shared > prev->key_size)
+			return -EIO;
+		/* Both parts fit 16 bits, the whole key must fit too. */
+		if (shared + key_size > UINT16_MAX)
+			return -EIO;
 
-		if (!buf)
-			return -ENOMEM;
+		rc = ctree_node_reserve_entries(node, node->entries + 1);
+		if (rc < 0)
+			return rc;
+
+		rc = ctree_node_reserve_keys(node,
+					node->keys_bytes + shared + key_size);
+		if (rc < 0)
+			return rc;
+
+		struct ctree_entry *ptr = &node->entry[node->entries];
+		char *key = node->keys + node->keys_bytes;
+
+		if (shared)
+			memcpy(key, node->keys + ptr[-1].key_offs, shared);
+		memcpy(key + shared, node->buf + offs, key_size);
+		offs += key_size;
 
-		memset(buf + prev_bytes, 0, new);
-		node->buf = buf;
-		node->max_bytes = next_bytes;
+		ptr->key_offs = node->keys_bytes;
+		ptr->key_size = shared + key_size;
+		node->prefix[node->entries] = key_prefix(key,
+					ptr->key_size);
+		node->keys_bytes += ptr->key_size;
+
+		ptr->val_offs = offs;
+		ptr->val_size = val_size;
+		offs += val_size;
+		++node->entries;
 	}
 
+	if (restart != restarts)
+		return -EIO;
 	return 0;
 }
 
-static int ctree_node_append(const struct io *io, struct ctree_node *node,
-			const struct lsm_key *key, const struct lsm_val *val)
+static int ctree_node_parse(struct ctree_node *node)
 {
-	struct aulsmfs_node_entry nentry;
-	const size_t size = key->size + val->size + sizeof(nentry);
-	const int rc = ctree_ensure_entries(io, node, 1, size);
+	const struct aulsmfs_node_header *header = (void *)node->buf;
+	const int level = le32toh(header->level);
+	const int format = le32toh(header->format);
+	const size_t bytes = le64toh(header->size);
 
-	if (rc < 0)
-		return rc;
+	if (bytes > node->max_bytes)
+		return -EIO;
 
-	char *nentry_ptr = node->buf + node->bytes;
-	char *key_ptr = nentry_ptr + sizeof(nentry);
-	char *val_ptr = key_ptr + key->size;
+	if (level != node->level)
+		return -EIO;
 
-	nentry.key_size = htole16(key->size);
-	nentry.val_size = htole16(val->size);
+	node->format = format;
+	switch (format) {
+	case AULSMFS_NODE_PLAIN:
+		return ctree_node_parse_plain(node, bytes);
+	case AULSMFS_NODE_PREFIX:
+		return ctree_node_parse_prefix(node, bytes);
+	}
+	return -EIO;
+}
 
-	memcpy(nentry_ptr, &nentry, sizeof(nentry));
-	memcpy(key_ptr, key->ptr, key->size);
-	memcpy(val_ptr, val->ptr, val->size);
+/* Moves the compressed node to zbuf and decompresses it into buf, so
+ * that the cache keeps the node decompressed. */
+static int ctree_node_inflate(struct io *io, struct ctree_node *node)
+{
+	const size_t header_size = sizeof(struct aulsmfs_node_header);
+	struct aulsmfs_node_header header;
+	struct aulsmfs_lz_header lz;
+	size_t size;
+	int rc;
 
-	struct ctree_entry *centry = &node->entry[node->entries];
+	memcpy(&header, node->buf, sizeof(header));
+	memcpy(&lz, node->buf + header_size, sizeof(lz));
 
-	centry->key_offs = key_ptr - node->buf;
-	centry->key_size = key->size;
+	const size_t bytes = le64toh(header.size);
+	const size_t raw = le64toh(lz.size);
 
-	centry->val_offs = val_ptr - node->buf;
-	centry->val_size = val->size;
+	if (bytes > node->max_bytes || bytes < header_size + sizeof(lz))
+		return -EIO;
+	if (raw < header_size || raw > UINT32_MAX)
+		return -EIO;
 
-	node->bytes += size;
-	++node->entries;
+	char *buf = node->buf;
+	const size_t max_bytes = node->max_bytes;
+
+	node->buf = node->zbuf;
+	node->max_bytes = node->max_zbytes;
+	node->zbuf = buf;
+	node->max_zbytes = max_bytes;
+
+	rc = ctree_node_reserve(node, io_align(io, raw), 0);
+	if (rc < 0)
+		return rc;
+
+	rc = lz_decompress(node->zbuf + header_size + sizeof(lz),
+				bytes - header_size - sizeof(lz),
+				node->buf + header_size, raw - header_size,
+				&size);
+	if (rc < 0 || size != raw - header_size)
+		return -EIO;
+
+	header.size = htole64(raw);
+	header.format = htole32(le32toh(header.format) & ~AULSMFS_NODE_LZ);
+	memcpy(node->buf, &header, sizeof(header));
 	return 0;
 }
 
-static int ctree_node_write(struct io *io, struct ctree_node *node,
-			uint64_t offs, int level)
+/* Checks and parses the node read into the buffer. */
+static int ctree_node_load(struct io *io, struct ctree_node *node,
+			const struct aulsmfs_ptr *ptr, int level)
 {
-	const size_t size = io_pages(io, node->bytes);
-	struct aulsmfs_node_header *header = (void *)node->buf;
+	const size_t buf_size = io_bytes(io, le64toh(ptr->size));
+	int rc;
 
-	header->size = htole64(node->bytes);
-	header->level = htole64(level);
+	if (crc64_parallel(node->buf, buf_size) != le64toh(ptr->csum))
+		return -EIO;
 
-	const int rc = io_write(io, node->buf, size, offs);
+	const struct aulsmfs_node_header *header = (void *)node->buf;
 
-	if (rc < 0)
-		return rc;
+	if (le32toh(header->format) & AULSMFS_NODE_LZ) {
+		rc = ctree_node_inflate(io, node);
+		if (rc < 0)
+			return rc;
+	}
 
-	node->ptr.offs = htole64(offs);
-	node->ptr.size = htole64(size);
-	node->ptr.csum = htole64(crc64(node->buf, io_bytes(io, size)));
+	node->ptr = *ptr;
 	node->level = level;
+	rc = ctree_node_parse(node);
+	if (rc < 0)
+		return rc;
 	return 0;
 }
 
+static int ctree_node_read(struct io *io, struct ctree_node *node,
+			const struct aulsmfs_ptr *ptr, int level)
+{
+	const size_t pages = le64toh(ptr->size);
+	int rc;
+
+	rc = ctree_node_reserve(node, io_bytes(io, pages), 0);
+	if (rc < 0)
+		return rc;
 
-void ctree_builder_setup(struct ctree_builder *builder, struct io *io,
-			struct alloc *alloc)
+	rc = io_read(io, node->buf, pages, le64toh(ptr->offs));
+	if (rc < 0)
+		return rc;
+	return ctree_node_load(io, node, ptr, level);
+}
+
+static int ctree_ptr_cmp(const struct aulsmfs_ptr *l,
+			const struct aulsmfs_ptr *r)
 {
-	memset(builder, 0, sizeof(*builder));
-	builder->io = io;
-	builder->alloc = alloc;
+	const uint64_t loffs = le64toh(l->offs), roffs = le64toh(r->offs);
+	const uint64_t lcsum = le64toh(l->csum), rcsum = le64toh(r->csum);
+	const uint64_t lsize = le64toh(l->size), rsize = le64toh(r->size);
+
+	if (loffs != roffs)
+		return loffs < roffs ? -1 : 1;
+	if (lcsum != rcsum)
+		return lcsum < rcsum ? -1 : 1;
+	if (lsize != rsize)
+		return lsize < rsize ? -1 : 1;
+	return 0;
 }
 
-void ctree_builder_release(struct ctree_builder *builder)
+void ctree_cache_setup(struct ctree_cache *cache, size_t max_bytes)
 {
-	for (int i = 0; i != builder->nodes; ++i)
-		ctree_node_destroy(builder->node[i]);
-	free(builder->node);
-	free(builder->reserved);
-	memset(builder, 0, sizeof(*builder));
+	memset(cache, 0, sizeof(*cache));
+	pthread_mutex_init(&cache->mtx, NULL);
+	cache->max_bytes = max_bytes;
 }
 
-static int ctree_builder_alloc(struct ctree_builder *builder, uint64_t size,
-			uint64_t *offs)
+static struct ctree_node *ctree_node_of(struct rb_node *rb)
 {
-	if (builder->ranges == builder->max_ranges) {
-		const size_t ranges = builder->ranges
-					? builder->ranges * 2 : 16;
-		struct range *range = realloc(builder->reserved,
-					ranges * sizeof(*range));
+	return (struct ctree_node *)((char *)rb -
+				offsetof(struct ctree_node, rb));
+}
 
-		if (!range)
-			return -ENOMEM;
+static void ctree_nodes_release(struct rb_node *node)
+{
+	while (node) {
+		struct rb_node *to_free = node;
 
-		builder->reserved = range;
-		builder->max_ranges = ranges;
+		ctree_nodes_release(node->right);
+		node = node->left;
+		ctree_node_destroy(ctree_node_of(to_free));
 	}
+}
 
-	struct alloc *alloc = builder->alloc;
+void ctree_cache_release(struct ctree_cache *cache)
+{
+	/* All the iterators must be released by this time. */
+	ctree_nodes_release(cache->tree.root);
+	pthread_mutex_destroy(&cache->mtx);
+	memset(cache, 0, sizeof(*cache));
+}
 
-	const int rc = alloc_reserve(alloc, size, offs);
+void ctree_cache_stats(struct ctree_cache *cache,
+			struct ctree_cache_stats *stats)
+{
+	pthread_mutex_lock(&cache->mtx);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->mtx);
+}
 
-	if (rc < 0)
+/* Both ctree_cache and resident interior nodes of a ctree are kept in
+ * rb trees ordered by aulsmfs_ptr. */
+static struct ctree_node *ctree_nodes_lookup(const struct rb_tree *tree,
+			const struct aulsmfs_ptr *ptr)
+{
+	struct rb_node *p = tree->root;
+
+	while (p) {
+		struct ctree_node *node = ctree_node_of(p);
+		const int cmp = ctree_ptr_cmp(&node->ptr, ptr);
+
+		if (!cmp)
+			return node;
+		p = cmp < 0 ? p->right : p->left;
+	}
+	return NULL;
+}
+
+static void ctree_nodes_insert(struct rb_tree *tree, struct ctree_node *new)
+{
+	struct rb_node **plink = &tree->root;
+	struct rb_node *parent = NULL;
+
+	while (*plink) {
+		struct ctree_node *old = ctree_node_of(*plink);
+
+		parent = *plink;
+		if (ctree_ptr_cmp(&old->ptr, &new->ptr) < 0)
+			plink = &parent->right;
+		else
+			plink = &parent->left;
+	}
+
+	rb_link(&new->rb, parent, plink);
+	rb_insert(&new->rb, tree);
+}
+
+static void __ctree_cache_lru_remove(struct ctree_cache *cache,
+			struct ctree_node *node)
+{
+	if (node->lru_prev)
+		node->lru_prev->lru_next = node->lru_next;
+	else
+		cache->lru_head = node->lru_next;
+
+	if (node->lru_next)
+		node->lru_next->lru_prev = node->lru_prev;
+	else
+		cache->lru_tail = node->lru_prev;
+
+	node->lru_prev = node->lru_next = NULL;
+}
+
+static void __ctree_cache_lru_append(struct ctree_cache *cache,
+			struct ctree_node *node)
+{
+	node->lru_next = NULL;
+	node->lru_prev = cache->lru_tail;
+	if (cache->lru_tail)
+		cache->lru_tail->lru_next = node;
+	else
+		cache->lru_head = node;
+	cache->lru_tail = node;
+}
+
+static void __ctree_cache_shrink(struct ctree_cache *cache)
+{
+	while (cache->stats.bytes > cache->max_bytes && cache->lru_head) {
+		struct ctree_node *node = cache->lru_head;
+
+		__ctree_cache_lru_remove(cache, node);
+		rb_erase(&node->rb, &cache->tree);
+		cache->stats.bytes -= ctree_node_footprint(node);
+		++cache->stats.evictions;
+		ctree_node_destroy(node);
+	}
+}
+
+static void ctree_node_put(struct ctree_cache *cache, struct ctree_node *node)
+{
+	if (!node || node->resident)
+		return;
+
+	if (!cache) {
+		ctree_node_destroy(node);
+		return;
+	}
+
+	pthread_mutex_lock(&cache->mtx);
+	assert(node->refs);
+	if (!--node->refs) {
+		__ctree_cache_lru_append(cache, node);
+		__ctree_cache_shrink(cache);
+	}
+	pthread_mutex_unlock(&cache->mtx);
+}
+
+/* Returns pinned node, the node must be returned with ctree_node_put. If
+ * cache is NULL the node is just read from the disk. */
+static int ctree_node_get(struct io *io, struct ctree_cache *cache,
+			const struct aulsmfs_ptr *ptr, int level,
+			struct ctree_node **res)
+{
+	struct ctree_node *node;
+	int rc;
+
+	if (cache) {
+		pthread_mutex_lock(&cache->mtx);
+		node = ctree_nodes_lookup(&cache->tree, ptr);
+		if (node) {
+			if (!node->refs++)
+				__ctree_cache_lru_remove(cache, node);
+			++cache->stats.hits;
+		} else {
+			++cache->stats.misses;
+		}
+		pthread_mutex_unlock(&cache->mtx);
+
+		if (node) {
+			if (node->level != level) {
+				ctree_node_put(cache, node);
+				return -EIO;
+			}
+			*res = node;
+			return 0;
+		}
+	}
+
+	node = ctree_node_create();
+	if (!node)
+		return -ENOMEM;
+
+	rc = ctree_node_read(io, node, ptr, level);
+	if (rc < 0) {
+		ctree_node_destroy(node);
+		return rc;
+	}
+
+	if (cache) {
+		struct ctree_node *old;
+
+		pthread_mutex_lock(&cache->mtx);
+		/* Somebody might have read the same node concurrently. */
+		old = ctree_nodes_lookup(&cache->tree, ptr);
+		if (old) {
+			if (!old->refs++)
+				__ctree_cache_lru_remove(cache, old);
+		} else {
+			node->refs = 1;
+			ctree_nodes_insert(&cache->tree, node);
+			cache->stats.bytes += ctree_node_footprint(node);
+			__ctree_cache_shrink(cache);
+		}
+		pthread_mutex_unlock(&cache->mtx);
+
+		if (old) {
+			ctree_node_destroy(node);
+			node = old;
+		}
+	}
+
+	*res = node;
+	return 0;
+}
+
+static void ctree_node_key(const struct ctree_node *node, size_t pos,
+			struct lsm_key *key)
+{
+	char *keys = node->format == AULSMFS_NODE_PREFIX
+				? node->keys : node->buf;
+
+	key->ptr = keys + node->entry[pos].key_offs;
+	key->size = node->entry[pos].key_size;
+}
+
+static void ctree_node_val(const struct ctree_node *node, size_t pos,
+			struct lsm_val *val)
+{
+	val->ptr = node->buf + node->entry[pos].val_offs;
+	val->size = node->entry[pos].val_size;
+}
+
+static int ctree_node_ptr(const struct ctree_node *node, size_t pos,
+			struct aulsmfs_ptr *ptr)
+{
+	struct lsm_val val;
+
+	ctree_node_val(node, pos, &val);
+	if (val.size != sizeof(*ptr))
+		return -ENOBUFS;
+	memcpy(ptr, val.ptr, sizeof(*ptr));
+	return 0;
+}
+
+/* Bytes the node takes on disk, restart points of a prefix node are only
+ * written out by ctree_node_write. */
+static size_t ctree_node_size(const struct ctree_node *node)
+{
+	if (node->format != AULSMFS_NODE_PREFIX)
+		return node->bytes;
+	return node->bytes + (node->restarts + 1) * sizeof(le32_t);
+}
+
+/* Returns the number of bytes the key shares with the last key of a
+ * prefix node, every RESTART_INTERVAL-th entry is a restart point. */
+static size_t ctree_node_shared(const struct ctree_node *node,
+			const struct lsm_key *key)
+{
+	if (node->format != AULSMFS_NODE_PREFIX ||
+				!(node->entries % RESTART_INTERVAL))
+		return 0;
+
+	struct lsm_key prev;
+
+	ctree_node_key(node, node->entries - 1, &prev);
+
+	const size_t size = prev.size < key->size ? prev.size : key->size;
+	const char *l = prev.ptr, *r = key->ptr;
+	size_t shared = 0;
+
+	while (shared != size && l[shared] == r[shared])
+		++shared;
+	return shared;
+}
+
+/* Returns how much the node grows on disk if the item is appended. */
+static size_t ctree_node_append_bytes(const struct ctree_node *node,
+			const struct lsm_key *key, const struct lsm_val *val,
+			size_t shared)
+{
+	if (node->format != AULSMFS_NODE_PREFIX)
+		return sizeof(struct aulsmfs_node_entry) + key->size +
+					val->size;
+
+	const size_t rest = key->size - shared;
+	const size_t restart = node->entries % RESTART_INTERVAL
+				? 0 : sizeof(le32_t);
+
+	return ctree_varint_size(shared) + ctree_varint_size(rest) +
+				ctree_varint_size(val->size) + rest +
+				val->size + restart;
+}
+
+static int ctree_node_can_append(const struct io *io,
+			const struct ctree_node *node,
+			const struct lsm_key *key, const struct lsm_val *val)
+{
+	const size_t shared = ctree_node_shared(node, key);
+	const size_t bytes = ctree_node_append_bytes(node, key, val, shared);
+	const size_t size = ctree_node_size(node);
+	const size_t pages = io_pages(io, size);
+
+	if (node->entries + 1 <= MIN_FANOUT)
+		return 1;
+
+	if (io_pages(io, size + bytes) <= (pages > node->fill_pages
+				? pages : node->fill_pages))
+		return 1;
+
+	return 0;
+}
+
+static int ctree_ensure_entries(const struct io *io, struct ctree_node *node,
+			size_t size)
+{
+	const size_t pages = io_pages(io, ctree_node_size(node) + size);
+	const size_t bytes = io_bytes(io, pages);
+	int rc;
+
+	rc = ctree_node_reserve_entries(node, node->entries + 1);
+	if (rc < 0)
+		return rc;
+
+	if (node->max_bytes < bytes) {
+		const size_t prev_bytes = node->max_bytes;
+		const size_t next_bytes = prev_bytes * 2 < bytes
+					? bytes : prev_bytes * 2;
+
+		return ctree_node_reserve(node, next_bytes, node->bytes);
+	}
+	return 0;
+}
+
+static int ctree_node_append_prefix(struct ctree_node *node,
+			const struct lsm_key *key, const struct lsm_val *val,
+			size_t shared)
+{
+	int rc;
+
+	rc = ctree_node_reserve_keys(node, node->keys_bytes + key->size);
+	if (rc < 0)
+		return rc;
+
+	if (!(node->entries % RESTART_INTERVAL)) {
+		rc = ctree_node_reserve_restarts(node, node->restarts + 1);
+		if (rc < 0)
+			return rc;
+		node->restart[node->restarts++] = node->bytes;
+	}
+
+	char *ptr = node->buf + node->bytes;
+
+	ptr = ctree_put_varint(ptr, shared);
+	ptr = ctree_put_varint(ptr, key->size - shared);
+	ptr = ctree_put_varint(ptr, val->size);
+	memcpy(ptr, (const char *)key->ptr + shared, key->size - shared);
+	ptr += key->size - shared;
+	memcpy(ptr, val->ptr, val->size);
+
+	struct ctree_entry *centry = &node->entry[node->entries];
+
+	memcpy(node->keys + node->keys_bytes, key->ptr, key->size);
+	centry->key_offs = node->keys_bytes;
+	centry->key_size = key->size;
+	node->prefix[node->entries] = key_prefix(key->ptr, key->size);
+	node->keys_bytes += key->size;
+
+	centry->val_offs = ptr - node->buf;
+	centry->val_size = val->size;
+
+	node->bytes = ptr + val->size - node->buf;
+	++node->entries;
+	return 0;
+}
+
+static int ctree_node_append(const struct io *io, struct ctree_node *node,
+			const struct lsm_key *key, const struct lsm_val *val)
+{
+	const size_t shared = ctree_node_shared(node, key);
+	const size_t size = ctree_node_append_bytes(node, key, val, shared);
+	const int rc = ctree_ensure_entries(io, node, size);
+
+	if (rc < 0)
+		return rc;
+
+	if (node->format == AULSMFS_NODE_PREFIX)
+		return ctree_node_append_prefix(node, key, val, shared);
+
+	struct aulsmfs_node_entry nentry;
+	char *nentry_ptr = node->buf + node->bytes;
+	char *key_ptr = nentry_ptr + sizeof(nentry);
+	char *val_ptr = key_ptr + key->size;
+
+	nentry.key_size = htole16(key->size);
+	nentry.val_size = htole16(val->size);
+
+	memcpy(nentry_ptr, &nentry, sizeof(nentry));
+	memcpy(key_ptr, key->ptr, key->size);
+	memcpy(val_ptr, val->ptr, val->size);
+
+	struct ctree_entry *centry = &node->entry[node->entries];
+
+	centry->key_offs = key_ptr - node->buf;
+	centry->key_size = key->size;
+	node->prefix[node->entries] = key_prefix(key->ptr, key->size);
+
+	centry->val_offs = val_ptr - node->buf;
+	centry->val_size = val->size;
+
+	node->bytes += size;
+	++node->entries;
+	return 0;
+}
+
+static void ctree_node_write_restarts(struct ctree_node *node)
+{
+	char *ptr = node->buf + node->bytes;
+	le32_t value;
+
+	for (size_t i = 0; i != node->restarts; ++i) {
+		value = htole32(node->restart[i]);
+		memcpy(ptr, &value, sizeof(value));
+		ptr += sizeof(value);
+	}
+	value = htole32(node->restarts);
+	memcpy(ptr, &value, sizeof(value));
+}
+
+/* Fills in the header and the tail of the node, so that buf holds the
+ * node exactly as it's written, returns the size in pages. */
+static size_t ctree_node_seal(struct io *io, struct ctree_node *node,
+			int level)
+{
+	const size_t bytes = ctree_node_size(node);
+	const size_t size = io_pages(io, bytes);
+	struct aulsmfs_node_header *header = (void *)node->buf;
+
+	if (node->format == AULSMFS_NODE_PREFIX)
+		ctree_node_write_restarts(node);
+
+	header->size = htole64(bytes);
+	header->level = htole32(level);
+	header->format = htole32(node->format);
+	memset(node->buf + bytes, 0, io_bytes(io, size) - bytes);
+	return size;
+}
+
+/* Prepares the compressed image of the node in zbuf if it takes fewer
+ * pages than the node itself, returns the number of pages to write. */
+static int ctree_node_compress(struct io *io, struct ctree_node *node,
+			int level, struct lz_state *state, size_t *pages)
+{
+	const size_t header_size = sizeof(struct aulsmfs_node_header);
+	const size_t size = ctree_node_seal(io, node, level);
+	const size_t bytes = ctree_node_size(node);
+	const size_t prefix = header_size + sizeof(struct aulsmfs_lz_header);
+	int rc;
+
+	*pages = size;
+	if (size == 1)
+		return 0;
+
+	rc = ctree_node_reserve_zbuf(node, io_bytes(io, size));
+	if (rc < 0)
+		return rc;
+
+	/* Only compressed images shorter by at least a page are useful. */
+	const size_t cap = io_bytes(io, size - 1) - prefix;
+	const size_t zsize = lz_compress(state, node->buf + header_size,
+				bytes - header_size, node->zbuf + prefix, cap);
+
+	if (!zsize)
+		return 0;
+
+	struct aulsmfs_node_header header;
+	struct aulsmfs_lz_header lz;
+
+	memcpy(&header, node->buf, sizeof(header));
+	header.size = htole64(prefix + zsize);
+	header.format = htole32(node->format | AULSMFS_NODE_LZ);
+	lz.size = htole64(bytes);
+	memcpy(node->zbuf, &header, sizeof(header));
+	memcpy(node->zbuf + header_size, &lz, sizeof(lz));
+
+	node->zbytes = prefix + zsize;
+	*pages = io_pages(io, node->zbytes);
+	memset(node->zbuf + node->zbytes, 0,
+				io_bytes(io, *pages) - node->zbytes);
+	return 0;
+}
+
+/* Seals the node and sets its pointer, returns the image to write. The
+ * image is checksummed in one pass, a running CRC updated by every entry
+ * of a few dozen bytes would take the table path and is many times
+ * slower, see bench_node in crc64_test. */
+static const char *ctree_node_prepare(struct io *io, struct ctree_node *node,
+			uint64_t offs, int level, size_t *pages)
+{
+	const size_t size = node->zbytes ? io_pages(io, node->zbytes)
+				: ctree_node_seal(io, node, level);
+	const char *buf = node->zbytes ? node->zbuf : node->buf;
+
+	node->ptr.offs = htole64(offs);
+	node->ptr.size = htole64(size);
+	node->ptr.csum = htole64(crc64_parallel(buf, io_bytes(io, size)));
+	node->level = level;
+	*pages = size;
+	return buf;
+}
+
+static int ctree_node_write(struct io *io, struct ctree_node *node,
+			uint64_t offs, int level)
+{
+	size_t size;
+	const char *buf = ctree_node_prepare(io, node, offs, level, &size);
+
+	return io_write(io, buf, size, offs);
+}
+
+
+/* Finished nodes are handed over to a writer thread through a bounded
+ * ring of slots, so that the builder fills the next node while the previous
+ * ones are checksummed and written. The writer keeps the writes of all the
+ * pending slots in flight at once. The parent entry of a node is appended
+ * before the node is written, so its checksum is patched in when the slot
+ * is reclaimed. A parent is only flushed after all the slots are reclaimed,
+ * see ctree_writer_drain. */
+struct ctree_write {
+	struct ctree_node *node;
+	uint64_t offs;
+	int level;
+
+	struct ctree_node *parent;
+	size_t index;
+
+	struct io_req req;
+	int complete;
+};
+
+struct ctree_writer {
+	struct io *io;
+	struct io_queue queue;
+
+	pthread_t thread;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+
+	struct ctree_write *slot;
+	size_t slots;
+
+	/* Slots [reclaimed, done) are written, [done, queued) are pending,
+	 * the counters only grow. Slots [done, submitted) are in flight,
+	 * submitted is only used by the writer thread. */
+	size_t queued;
+	size_t submitted;
+	size_t done;
+	size_t reclaimed;
+
+	struct ctree_node **spare;
+	size_t spares;
+
+	int stop;
+	int rc;
+};
+
+static void ctree_write_complete(struct io_req *req)
+{
+	struct ctree_write *write = req->arg;
+
+	write->complete = 1;
+}
+
+static void ctree_writer_submit(struct ctree_writer *writer,
+			struct ctree_write *write, int failed)
+{
+	struct io_req *req = &write->req;
+	const char *buf;
+	size_t size;
+	int rc = failed;
+
+	if (!rc) {
+		buf = ctree_node_prepare(writer->io, write->node, write->offs,
+					write->level, &size);
+		io_req_write(req, buf, size, write->offs);
+		req->done = &ctree_write_complete;
+		req->arg = write;
+		rc = io_queue_submit(&writer->queue, &req, 1);
+	}
+
+	if (rc < 0) {
+		req->result = rc;
+		write->complete = 1;
+	}
+}
+
+static void *ctree_writer_run(void *arg)
+{
+	struct ctree_writer *writer = arg;
+
+	pthread_mutex_lock(&writer->mtx);
+	while (1) {
+		while (writer->submitted == writer->queued &&
+					!writer->queue.inflight && !writer->stop)
+			pthread_cond_wait(&writer->cond, &writer->mtx);
+
+		if (writer->done == writer->queued)
+			break;
+
+		const size_t queued = writer->queued;
+		const size_t submitted = writer->submitted;
+		const int failed = writer->rc;
+
+		pthread_mutex_unlock(&writer->mtx);
+
+		for (; writer->submitted != queued; ++writer->submitted)
+			ctree_writer_submit(writer, &writer->slot[
+					writer->submitted % writer->slots],
+					failed);
+
+		/* Blocks only if there is nothing else to do. */
+		if (writer->queue.inflight)
+			io_queue_reap(&writer->queue,
+					submitted == queued ? 1 : 0);
+
+		pthread_mutex_lock(&writer->mtx);
+		while (writer->done != writer->submitted) {
+			struct ctree_write *write = &writer->slot[writer->done %
+						writer->slots];
+
+			if (!write->complete)
+				break;
+			if (write->req.result < 0 && !writer->rc)
+				writer->rc = (int)write->req.result;
+			++writer->done;
+		}
+		pthread_cond_broadcast(&writer->cond);
+	}
+	pthread_mutex_unlock(&writer->mtx);
+	return NULL;
+}
+
+static void ctree_writer_destroy(struct ctree_writer *writer)
+{
+	for (size_t i = 0; i != writer->spares; ++i)
+		ctree_node_destroy(writer->spare[i]);
+
+	if (writer->queue.io)
+		io_queue_release(&writer->queue);
+	pthread_cond_destroy(&writer->cond);
+	pthread_mutex_destroy(&writer->mtx);
+	free(writer->spare);
+	free(writer->slot);
+	free(writer);
+}
+
+static int ctree_writer_start(struct ctree_builder *builder)
+{
+	struct ctree_writer *writer = calloc(1, sizeof(*writer));
+
+	if (!writer)
+		return -ENOMEM;
+
+	writer->io = builder->io;
+	writer->slots = builder->write_queue;
+	pthread_mutex_init(&writer->mtx, NULL);
+	pthread_cond_init(&writer->cond, NULL);
+
+	writer->slot = calloc(writer->slots, sizeof(*writer->slot));
+	writer->spare = calloc(writer->slots, sizeof(*writer->spare));
+	if (!writer->slot || !writer->spare) {
+		ctree_writer_destroy(writer);
+		return -ENOMEM;
+	}
+
+	int rc = io_queue_setup(&writer->queue, writer->io, writer->slots);
+
+	if (rc < 0) {
+		ctree_writer_destroy(writer);
+		return rc;
+	}
+
+	rc = pthread_create(&writer->thread, NULL, &ctree_writer_run, writer);
+
+	if (rc) {
+		ctree_writer_destroy(writer);
+		return -rc;
+	}
+	builder->writer = writer;
+	return 0;
+}
+
+/* Patches checksums of written nodes into their parents and takes their
+ * buffers back. */
+static void ctree_writer_reclaim(struct ctree_writer *writer)
+{
+	while (writer->reclaimed != writer->done) {
+		struct ctree_write *write = &writer->slot[writer->reclaimed %
+					writer->slots];
+		struct ctree_node *parent = write->parent;
+		struct lsm_val val;
+
+		ctree_node_val(parent, write->index, &val);
+		memcpy((char *)val.ptr + offsetof(struct aulsmfs_ptr, csum),
+					&write->node->ptr.csum,
+					sizeof(write->node->ptr.csum));
+
+		ctree_node_reset(write->node);
+		writer->spare[writer->spares++] = write->node;
+		++writer->reclaimed;
+	}
+}
+
+/* Waits until at most slots - 1 writes are pending, so that we can queue
+ * one more. */
+static int ctree_writer_wait(struct ctree_writer *writer, size_t pending)
+{
+	int rc;
+
+	pthread_mutex_lock(&writer->mtx);
+	while (writer->queued - writer->done > pending)
+		pthread_cond_wait(&writer->cond, &writer->mtx);
+	rc = writer->rc;
+	pthread_mutex_unlock(&writer->mtx);
+
+	if (rc == 0)
+		ctree_writer_reclaim(writer);
+	return rc;
+}
+
+static int ctree_writer_drain(struct ctree_builder *builder)
+{
+	if (!builder->writer)
+		return 0;
+	return ctree_writer_wait(builder->writer, 0);
+}
+
+/* Queues the node at the level, the builder continues with a spare node. */
+static int ctree_writer_push(struct ctree_builder *builder, int level,
+			uint64_t offs, struct ctree_node *parent, size_t index)
+{
+	struct ctree_writer *writer = builder->writer;
+	struct ctree_node *spare;
+	int rc;
+
+	rc = ctree_writer_wait(writer, writer->slots - 1);
+	if (rc < 0)
+		return rc;
+
+	if (writer->spares) {
+		spare = writer->spare[--writer->spares];
+	} else {
+		spare = ctree_node_create();
+		if (!spare)
+			return -ENOMEM;
+
+		rc = ctree_node_setup(builder->io, spare);
+		if (rc < 0) {
+			ctree_node_destroy(spare);
+			return rc;
+		}
+	}
+
+	struct ctree_write *write = &writer->slot[writer->queued %
+				writer->slots];
+
+	write->node = builder->node[level];
+	write->offs = offs;
+	write->level = level;
+	write->parent = parent;
+	write->index = index;
+	write->complete = 0;
+	spare->format = write->node->format;
+	spare->fill_pages = write->node->fill_pages;
+	builder->node[level] = spare;
+
+	pthread_mutex_lock(&writer->mtx);
+	++writer->queued;
+	pthread_cond_signal(&writer->cond);
+	pthread_mutex_unlock(&writer->mtx);
+	return 0;
+}
+
+static void ctree_writer_stop(struct ctree_builder *builder)
+{
+	struct ctree_writer *writer = builder->writer;
+
+	if (!writer)
+		return;
+
+	pthread_mutex_lock(&writer->mtx);
+	writer->stop = 1;
+	pthread_cond_signal(&writer->cond);
+	pthread_mutex_unlock(&writer->mtx);
+	pthread_join(writer->thread, NULL);
+
+	/* Parents might be gone already, so we don't patch them. */
+	while (writer->reclaimed != writer->queued) {
+		ctree_node_destroy(writer->slot[writer->reclaimed %
+					writer->slots].node);
+		++writer->reclaimed;
+	}
+	ctree_writer_destroy(writer);
+	builder->writer = NULL;
+}
+
+void ctree_builder_setup(struct ctree_builder *builder, struct io *io,
+			struct alloc *alloc)
+{
+	memset(builder, 0, sizeof(*builder));
+	builder->io = io;
+	builder->alloc = alloc;
+	builder->leaf_format = AULSMFS_NODE_PREFIX;
+	builder->leaf_pages = 1;
+}
+
+void ctree_builder_release(struct ctree_builder *builder)
+{
+	ctree_writer_stop(builder);
+	for (int i = 0; i != builder->nodes; ++i)
+		ctree_node_destroy(builder->node[i]);
+	free(builder->node);
+	free(builder->reserved);
+	free(builder->hash);
+	free(builder->lz);
+	free(builder->leaf);
+	free(builder->leaf_keys);
+	ctree_node_destroy(builder->fence_node);
+	memset(builder, 0, sizeof(*builder));
+}
+
+/* Makes room for one more reserved range. */
+static int ctree_builder_grow_ranges(struct ctree_builder *builder)
+{
+	if (builder->ranges == builder->max_ranges) {
+		const size_t ranges = builder->ranges
+					? builder->ranges * 2 : 16;
+		struct range *range = realloc(builder->reserved,
+					ranges * sizeof(*range));
+
+		if (!range)
+			return -ENOMEM;
+
+		builder->reserved = range;
+		builder->max_ranges = ranges;
+	}
+	return 0;
+}
+
+static void ctree_builder_add_range(struct ctree_builder *builder,
+			uint64_t size, uint64_t offs)
+{
+	builder->pages += size;
+	if (builder->ranges) {
+		struct range *last = &builder->reserved[builder->ranges - 1];
+
+		if (last->end == offs) {
+			last->end = offs + size;
+			return;
+		}
+	}
+
+	struct range *new = &builder->reserved[builder->ranges++];
+
+	new->begin = offs;
+	new->end = offs + size;
+}
+
+static int ctree_builder_alloc(struct ctree_builder *builder, uint64_t size,
+			uint64_t *offs)
+{
+	int rc = ctree_builder_grow_ranges(builder);
+
+	if (rc < 0)
+		return rc;
+
+	rc = alloc_reserve(builder->alloc, size, offs);
+	if (rc < 0)
+		return rc;
+
+	ctree_builder_add_range(builder, size, *offs);
+	return 0;
+}
+
+static void ctree_builder_free(struct ctree_builder *builder, uint64_t size,
+			uint64_t offs)
+{
+	struct alloc *alloc = builder->alloc;
+
+	alloc_cancel(alloc, size, offs);
+}
+
+static int __ctree_builder_append(struct ctree_builder *builder, int level,
+			const struct lsm_key *key, const struct lsm_val *val);
+
+static struct ctree_node *ctree_builder_node(
+			const struct ctree_builder *builder,
+			int level)
+{
+	return builder->node[level];
+}
+
+/* Fence index is all the level 1 entries of the tree in one node, so we
+ * copy entries of every level 1 node once their children are written. */
+static int ctree_builder_add_fences(struct ctree_builder *builder,
+			const struct ctree_node *node)
+{
+	struct ctree_node *fence = builder->fence_node;
+
+	if (!fence) {
+		int rc;
+
+		fence = ctree_node_create();
+		if (!fence)
+			return -ENOMEM;
+
+		rc = ctree_node_setup(builder->io, fence);
+		if (rc < 0) {
+			ctree_node_destroy(fence);
+			return rc;
+		}
+		builder->fence_node = fence;
+	}
+
+	for (size_t i = 0; i != node->entries; ++i) {
+		struct lsm_key key;
+		struct lsm_val val;
+		int rc;
+
+		ctree_node_key(node, i, &key);
+		ctree_node_val(node, i, &val);
+		rc = ctree_node_append(builder->io, fence, &key, &val);
+		if (rc < 0)
+			return rc;
+	}
+	return 0;
+}
+
+static int ctree_builder_write_fence(struct ctree_builder *builder)
+{
+	struct ctree_node *fence = builder->fence_node;
+	const size_t size = io_pages(builder->io, ctree_node_size(fence));
+	uint64_t offs;
+	int rc;
+
+	rc = ctree_builder_alloc(builder, size, &offs);
+	if (rc < 0)
+		return rc;
+
+	rc = ctree_node_write(builder->io, fence, offs, 1);
+	if (rc < 0)
+		return rc;
+
+	builder->fence = fence->ptr;
+	return 0;
+}
+
+/* Remembers a leaf of a leaves_only builder with its first and last keys,
+ * so that it can be moved to another builder later. */
+static int ctree_builder_add_leaf(struct ctree_builder *builder,
+			const struct ctree_node *node, int reused)
+{
+	struct lsm_key first, last;
+
+	ctree_node_key(node, 0, &first);
+	ctree_node_key(node, node->entries - 1, &last);
+
+	if (builder->leaves == builder->max_leaves) {
+		const size_t leaves = builder->max_leaves
+					? builder->max_leaves * 2 : 256;
+		struct ctree_leaf *leaf = realloc(builder->leaf,
+					leaves * sizeof(*leaf));
+
+		if (!leaf)
+			return -ENOMEM;
+		builder->leaf = leaf;
+		builder->max_leaves = leaves;
+	}
+
+	const size_t bytes = builder->leaf_keys_bytes + first.size + last.size;
+
+	if (bytes > builder->max_leaf_keys_bytes) {
+		const size_t max = builder->max_leaf_keys_bytes * 2 < bytes
+					? bytes + 4096
+					: builder->max_leaf_keys_bytes * 2;
+		char *keys = realloc(builder->leaf_keys, max);
+
+		if (!keys)
+			return -ENOMEM;
+		builder->leaf_keys = keys;
+		builder->max_leaf_keys_bytes = max;
+	}
+
+	struct ctree_leaf *leaf = &builder->leaf[builder->leaves++];
+	char *keys = builder->leaf_keys + builder->leaf_keys_bytes;
+
+	leaf->ptr = node->ptr;
+	leaf->items = node->entries;
+	leaf->key_offs = builder->leaf_keys_bytes;
+	leaf->first_size = first.size;
+	leaf->last_size = last.size;
+	leaf->reused = reused;
+	memcpy(keys, first.ptr, first.size);
+	memcpy(keys + first.size, last.ptr, last.size);
+	builder->leaf_keys_bytes = bytes;
+	return 0;
+}
+
+static int ctree_builder_compress(struct ctree_builder *builder,
+			struct ctree_node *node, int level, size_t *pages)
+{
+	if (!builder->lz) {
+		builder->lz = malloc(sizeof(*builder->lz));
+		if (!builder->lz)
+			return -ENOMEM;
+	}
+	return ctree_node_compress(builder->io, node, level, builder->lz,
+				pages);
+}
+
+static int ctree_builder_flush(struct ctree_builder *builder, int level)
+{
+	struct io *io = builder->io;
+	struct ctree_node *node = ctree_builder_node(builder, level);
+	size_t size = io_pages(io, ctree_node_size(node));
+	uint64_t offs;
+	int rc;
+
+	if (!node->entries)
+		return 0;
+
+	/* Checksums of all the children must be in place. */
+	if (level) {
+		rc = ctree_writer_drain(builder);
+		if (rc < 0)
+			return rc;
+	}
+
+	if (level == 1 && builder->fence_index) {
+		rc = ctree_builder_add_fences(builder, node);
+		if (rc < 0)
+			return rc;
+	}
+
+	if (builder->compress) {
+		rc = ctree_builder_compress(builder, node, level, &size);
+		if (rc < 0)
+			return rc;
+	}
+
+	rc = ctree_builder_alloc(builder, size, &offs);
+	if (rc < 0)
+		return rc;
+
+	if (builder->write_queue && !builder->writer &&
+				!builder->leaves_only &&
+				ctree_writer_start(builder) < 0)
+		builder->write_queue = 0;
+
+	if (!builder->writer) {
+		rc = ctree_node_write(io, node, offs, level);
+		if (rc < 0)
+			return rc;
+	} else {
+		node->ptr.offs = htole64(offs);
+		node->ptr.size = htole64(size);
+		node->ptr.csum = 0;
+	}
+
+	if (builder->leaves_only) {
+		rc = ctree_builder_add_leaf(builder, node, 0);
+		if (rc < 0)
+			return rc;
+
+		ctree_node_reset(node);
+		return 0;
+	}
+
+	const struct lsm_val val = {
+		.ptr = &node->ptr,
+		.size = sizeof(node->ptr)
+	};
+	struct lsm_key key;
+
+	ctree_node_key(node, 0, &key);
+	rc = __ctree_builder_append(builder, level + 1, &key, &val);
+	if (rc < 0)
 		return rc;
 
-	builder->pages += size;
-	if (builder->ranges) {
-		struct range *last = &builder->reserved[builder->ranges - 1];
+	if (builder->writer) {
+		struct ctree_node *parent = ctree_builder_node(builder,
+					level + 1);
 
-		if (last->end == *offs) {
-			last->end = *offs + size;
-			return 0;
-		}
+		return ctree_writer_push(builder, level, offs, parent,
+					parent->entries - 1);
 	}
 
-	struct range *new = &builder->reserved[builder->ranges++];
+	ctree_node_reset(node);
+	return 0;
+}
+
+static int ctree_builder_ensure_level(struct ctree_builder *builder, int level)
+{
+	if (level < builder->nodes)
+		return 0;
+
+	if (level >= builder->max_nodes) {
+		const int max_nodes = builder->max_nodes * 2 < level + 1
+					? level + 1 : builder->max_nodes * 2;
+		struct ctree_node **node = realloc(builder->node,
+					max_nodes * sizeof(*node));
+
+		if (!node)
+			return -ENOMEM;
+		builder->node = node;
+		builder->max_nodes = max_nodes;
+	}
+
+	for (int i = builder->nodes; i <= level; ++i) {
+		struct ctree_node *node = ctree_node_create();
+
+		if (!node)
+			return -ENOMEM;
 
-	new->begin = *offs;
-	new->end = *offs + size;
+		const int rc = ctree_node_setup(builder->io, node);
+
+		if (rc < 0) {
+			ctree_node_destroy(node);
+			return rc;
+		}
+		node->format = i ? AULSMFS_NODE_PLAIN : builder->leaf_format;
+		node->fill_pages = i ? 1 : builder->leaf_pages;
+		builder->node[builder->nodes++] = node;
+	}
 	return 0;
 }
 
-static void ctree_builder_free(struct ctree_builder *builder, uint64_t size,
-			uint64_t offs)
+static int ctree_builder_can_append(const struct ctree_builder *builder,
+			int level, const struct lsm_key *key,
+			const struct lsm_val *val)
 {
-	struct alloc *alloc = builder->alloc;
+	const struct io *io = builder->io;
+	const struct ctree_node *node = ctree_builder_node(builder,
+				level);
 
-	alloc_cancel(alloc, size, offs);
+	return ctree_node_can_append(io, node, key, val);
 }
 
 static int __ctree_builder_append(struct ctree_builder *builder, int level,
-			const struct lsm_key *key, const struct lsm_val *val);
+			const struct lsm_key *key, const struct lsm_val *val)
+{
+	struct io *io = builder->io;
+	const int rc = ctree_builder_ensure_level(builder, level);
 
-static struct ctree_node *ctree_builder_node(
-			const struct ctree_builder *builder,
-			int level)
+	if (rc < 0)
+		return rc;
+
+	if (!ctree_builder_can_append(builder, level, key, val)) {
+		const int rc = ctree_builder_flush(builder, level);
+
+		if (rc < 0)
+			return rc;
+	}
+
+	struct ctree_node *node = ctree_builder_node(builder, level);
+
+	return ctree_node_append(io, node, key, val);
+}
+
+static int ctree_builder_push_hash(struct ctree_builder *builder,
+			uint32_t hash)
 {
-	return builder->node[level];
+	if (builder->hashes == builder->max_hashes) {
+		const size_t hashes = builder->max_hashes
+					? builder->max_hashes * 2 : 1024;
+		uint32_t *hash = realloc(builder->hash,
+					hashes * sizeof(*hash));
+
+		if (!hash)
+			return -ENOMEM;
+
+		builder->hash = hash;
+		builder->max_hashes = hashes;
+	}
+
+	builder->hash[builder->hashes++] = hash;
+	return 0;
 }
 
-static int ctree_builder_flush(struct ctree_builder *builder, int level)
+static int ctree_builder_add_hash(struct ctree_builder *builder,
+			const struct lsm_key *key)
 {
-	struct io *io = builder->io;
-	struct ctree_node *node = ctree_builder_node(builder, level);
-	uint64_t size = io_pages(io, node->bytes);
-	uint64_t offs;
+	return ctree_builder_push_hash(builder,
+				bloom_hash(key->ptr, key->size));
+}
+
+int ctree_builder_append(struct ctree_builder *builder,
+			const struct lsm_key *key, const struct lsm_val *val)
+{
+	if (builder->bloom_bits) {
+		const int rc = ctree_builder_add_hash(builder, key);
+
+		if (rc < 0)
+			return rc;
+	}
+	return __ctree_builder_append(builder, 0, key, val);
+}
+
+/* The leaf is already on disk, so we only add a pointer to it into the
+ * parent level. The current leaf is flushed first to keep entries sorted,
+ * but the Bloom filter still needs every key, so we hash them. */
+int ctree_builder_append_leaf(struct ctree_builder *builder,
+			const struct ctree_iter *iter)
+{
+	const struct ctree_node *leaf = iter->node[0];
+	const struct lsm_val val = {
+		.ptr = (void *)&leaf->ptr,
+		.size = sizeof(leaf->ptr)
+	};
+	const size_t pages = le64toh(leaf->ptr.size);
+	struct lsm_key key;
 	int rc;
 
-	if (!node->entries)
-		return 0;
+	for (size_t i = 0; builder->bloom_bits && i != leaf->entries; ++i) {
+		ctree_node_key(leaf, i, &key);
+		rc = ctree_builder_add_hash(builder, &key);
+		if (rc < 0)
+			return rc;
+	}
 
-	rc = ctree_builder_alloc(builder, size, &offs);
+	rc = ctree_builder_ensure_level(builder, 0);
+	if (rc < 0)
+		return rc;
+
+	rc = ctree_builder_flush(builder, 0);
 	if (rc < 0)
 		return rc;
 
-	rc = ctree_node_write(io, node, offs, level);
+	if (builder->leaves_only) {
+		rc = ctree_builder_add_leaf(builder, leaf, 1);
+	} else {
+		ctree_node_key(leaf, 0, &key);
+		rc = __ctree_builder_append(builder, 1, &key, &val);
+	}
 	if (rc < 0)
 		return rc;
 
+	builder->pages += pages;
+	builder->reused_pages += pages;
+	return 0;
+}
+
+/* Only the pointer to the leaf goes into the builder, the leaf was written
+ * already, so moving leaves of several builders in key order into one
+ * builds a single tree of them. */
+int ctree_builder_move_leaf(struct ctree_builder *builder,
+			struct ctree_builder *from)
+{
+	const struct ctree_leaf *leaf = &from->leaf[from->moved];
 	const struct lsm_val val = {
-		.ptr = &node->ptr,
-		.size = sizeof(node->ptr)
+		.ptr = (void *)&leaf->ptr,
+		.size = sizeof(leaf->ptr)
 	};
+	const uint64_t offs = le64toh(leaf->ptr.offs);
+	const size_t pages = le64toh(leaf->ptr.size);
 	struct lsm_key key;
+	int rc;
 
-	ctree_node_key(node, 0, &key);
-	rc = __ctree_builder_append(builder, level + 1, &key, &val);
+	for (size_t i = 0; from->bloom_bits && i != leaf->items; ++i) {
+		if (!builder->bloom_bits)
+			break;
+		rc = ctree_builder_push_hash(builder,
+					from->hash[from->moved_hashes + i]);
+		if (rc < 0)
+			return rc;
+	}
+	if (from->bloom_bits)
+		from->moved_hashes += leaf->items;
+
+	rc = ctree_builder_ensure_level(builder, 0);
 	if (rc < 0)
 		return rc;
 
-	ctree_node_reset(node);
+	rc = ctree_builder_flush(builder, 0);
+	if (rc < 0)
+		return rc;
+
+	if (leaf->reused) {
+		builder->pages += pages;
+		builder->reused_pages += pages;
+	} else {
+		rc = ctree_builder_grow_ranges(builder);
+		if (rc < 0)
+			return rc;
+		ctree_builder_add_range(builder, pages, offs);
+	}
+
+	ctree_builder_leaf_keys(from, from->moved++, &key, NULL);
+	return __ctree_builder_append(builder, 1, &key, &val);
+}
+
+void ctree_builder_leaf_keys(const struct ctree_builder *builder,
+			size_t leaf, struct lsm_key *first,
+			struct lsm_key *last)
+{
+	const struct ctree_leaf *l = &builder->leaf[leaf];
+	char *keys = builder->leaf_keys + l->key_offs;
+
+	if (first) {
+		first->ptr = keys;
+		first->size = l->first_size;
+	}
+	if (last) {
+		last->ptr = keys + l->first_size;
+		last->size = l->last_size;
+	}
+}
+
+static int ctree_builder_write_bloom(struct ctree_builder *builder)
+{
+	struct io *io = builder->io;
+	struct aulsmfs_bloom_header *header;
+	const size_t size = bloom_size(builder->hashes, builder->bloom_bits);
+	const int hashes = bloom_hashes(builder->bloom_bits);
+	const size_t pages = io_pages(io, sizeof(*header) + size);
+	const size_t bytes = io_bytes(io, pages);
+	uint64_t offs;
+	int rc;
+
+	header = calloc(1, bytes);
+	if (!header)
+		return -ENOMEM;
+
+	header->size = htole64(size);
+	header->hashes = htole64(hashes);
+	bloom_build(header + 1, size, hashes, builder->hash, builder->hashes);
+
+	rc = ctree_builder_alloc(builder, pages, &offs);
+	if (rc < 0) {
+		free(header);
+		return rc;
+	}
+
+	rc = io_write(io, header, pages, offs);
+	if (rc < 0) {
+		free(header);
+		return rc;
+	}
+
+	builder->bloom.offs = htole64(offs);
+	builder->bloom.size = htole64(pages);
+	builder->bloom.csum = htole64(crc64_parallel(header, bytes));
+	free(header);
 	return 0;
 }
 
-static int ctree_builder_ensure_level(struct ctree_builder *builder, int level)
+int ctree_builder_finish(struct ctree_builder *builder)
 {
-	if (level < builder->nodes)
+	struct io *io = builder->io;
+	int level = 0;
+	int rc;
+
+	if (builder->leaves_only) {
+		memset(&builder->ptr, 0, sizeof(builder->ptr));
+		memset(&builder->bloom, 0, sizeof(builder->bloom));
+		memset(&builder->fence, 0, sizeof(builder->fence));
+		builder->height = 0;
+		return builder->nodes ? ctree_builder_flush(builder, 0) : 0;
+	}
+
+	while (level < builder->nodes - 1) {
+		rc = ctree_builder_flush(builder, level);
+		if (rc < 0)
+			return rc;
+		++level;
+	}
+
+	/* A tree with a single leaf is still a tree, the leaf is the root
+	 * in this case. */
+	memset(&builder->bloom, 0, sizeof(builder->bloom));
+	memset(&builder->fence, 0, sizeof(builder->fence));
+	if (!builder->nodes || !ctree_builder_node(builder, level)->entries) {
+		memset(&builder->ptr, 0, sizeof(builder->ptr));
+		builder->height = 0;
 		return 0;
+	}
 
-	if (level >= builder->max_nodes) {
-		const int max_nodes = builder->max_nodes * 2 < level + 1
-					? level + 1 : builder->max_nodes * 2;
-		struct ctree_node **node = realloc(builder->node,
-					max_nodes * sizeof(*node));
+	if (builder->bloom_bits && builder->hashes) {
+		rc = ctree_builder_write_bloom(builder);
+		if (rc < 0)
+			return rc;
+	}
 
-		if (!node)
-			return -ENOMEM;
-		builder->node = node;
-		builder->max_nodes = max_nodes;
+	/* Level 1 is flushed only if it's not the root, otherwise the root
+	 * is as good as the fence index. */
+	if (builder->fence_node && builder->fence_node->entries) {
+		rc = ctree_builder_write_fence(builder);
+		if (rc < 0)
+			return rc;
+	}
+
+	/* We have written all but last level, the node will be root of the
+	 * ctree. */
+	rc = ctree_writer_drain(builder);
+	if (rc < 0)
+		return rc;
+
+	struct ctree_node *root = ctree_builder_node(builder, level);
+	const size_t size = io_pages(io, ctree_node_size(root));
+	uint64_t offs;
+
+	rc = ctree_builder_alloc(builder, size, &offs);
+	if (rc < 0)
+		return rc;
+
+	rc = ctree_node_write(io, root, offs, level);
+	if (rc < 0)
+		return rc;
+
+	builder->ptr = root->ptr;
+	builder->height = level + 1;
+	ctree_node_reset(root);
+	return 0;
+}
+
+void ctree_builder_cancel(struct ctree_builder *builder)
+{
+	/* Pending writes must not land in the space we give back. */
+	ctree_writer_stop(builder);
+
+	/* Moved leaves belong to another builder, the space we still own
+	 * is exactly the leaves left. */
+	if (builder->moved) {
+		for (size_t i = builder->moved; i != builder->leaves; ++i) {
+			const struct ctree_leaf *leaf = &builder->leaf[i];
+
+			if (!leaf->reused)
+				ctree_builder_free(builder,
+						le64toh(leaf->ptr.size),
+						le64toh(leaf->ptr.offs));
+		}
+		return;
+	}
+
+	for (size_t i = 0; i != builder->ranges; ++i) {
+		struct range *range = &builder->reserved[i];
+		const uint64_t offs = range->begin;
+		const uint64_t size = range->end - range->begin;
+
+		ctree_builder_free(builder, size, offs);
+	}
+}
+
+int ctree_builder_commit(struct ctree_builder *builder)
+{
+	for (size_t i = 0; i != builder->ranges; ++i) {
+		struct range *range = &builder->reserved[i];
+		const uint64_t offs = range->begin;
+		const uint64_t size = range->end - range->begin;
+		const int rc = alloc_commit(builder->alloc, size, offs);
+
+		if (rc < 0)
+			return rc;
 	}
+	return 0;
+}
+
+
+void ctree_setup(struct ctree *ctree, struct io *io, ctree_cmp_t cmp)
+{
+	memset(ctree, 0, sizeof(*ctree));
+	ctree->io = io;
+	ctree->cmp = cmp;
+	ctree->schema = key_schema_of(cmp);
+	ctree->readahead = CTREE_DEFAULT_READAHEAD;
+}
+
+static void ctree_drop_interior(struct ctree *ctree)
+{
+	ctree_nodes_release(ctree->interior.root);
+	ctree->interior.root = NULL;
+	ctree->interior_bytes = 0;
+	ctree->fenced = 0;
+}
+
+/* Number of reads kept in flight while interior nodes are loaded. */
+#define CTREE_READ_QUEUE	32
+
+struct ctree_read {
+	struct io_req req;
+	struct aulsmfs_ptr ptr;
+	struct ctree_node *node;
+};
+
+/* Reads all the given nodes of a level at once, the nodes read are put
+ * into the interior tree. */
+static int ctree_load_level(struct ctree *ctree, struct ctree_read *read,
+			size_t count, int level)
+{
+	struct io_req *batch[CTREE_READ_QUEUE];
+	struct io *io = ctree->io;
+	struct io_queue queue;
+	size_t submitted = 0;
+	int rc;
+
+	rc = io_queue_setup(&queue, io, CTREE_READ_QUEUE);
+	if (rc < 0)
+		return rc;
 
-	for (int i = builder->nodes; i <= level; ++i) {
-		struct ctree_node *node = ctree_node_create();
+	while (submitted != count && rc == 0) {
+		size_t size = 0;
+
+		for (; size != CTREE_READ_QUEUE && submitted + size != count;
+					++size) {
+			struct ctree_read *r = &read[submitted + size];
+			const size_t pages = le64toh(r->ptr.size);
+
+			r->node = ctree_node_create();
+			if (!r->node) {
+				rc = -ENOMEM;
+				break;
+			}
+
+			rc = ctree_node_reserve(r->node, io_bytes(io, pages), 0);
+			if (rc < 0) {
+				ctree_node_destroy(r->node);
+				break;
+			}
+
+			io_req_read(&r->req, r->node->buf, pages,
+						le64toh(r->ptr.offs));
+			batch[size] = &r->req;
+		}
 
-		if (!node)
-			return -ENOMEM;
+		const int err = io_queue_submit(&queue, batch, size);
 
-		const int rc = ctree_node_setup(builder->io, node);
+		submitted += size;
+		if (err < 0)
+			rc = err;
+	}
+	io_queue_release(&queue);
 
+	for (size_t i = 0; i != submitted; ++i) {
+		struct ctree_read *r = &read[i];
+
+		if (rc == 0 && r->req.result < 0)
+			rc = r->req.result;
+		if (rc == 0)
+			rc = ctree_node_load(io, r->node, &r->ptr, level);
 		if (rc < 0) {
-			ctree_node_destroy(node);
-			return rc;
+			ctree_node_destroy(r->node);
+			continue;
 		}
-		builder->node[builder->nodes++] = node;
+
+		r->node->resident = 1;
+		ctree_nodes_insert(&ctree->interior, r->node);
+		ctree->interior_bytes += ctree_node_footprint(r->node);
 	}
-	return 0;
+	return rc;
 }
 
-static int ctree_builder_can_append(const struct ctree_builder *builder,
-			int level, size_t count, size_t size)
+/* Interior nodes are loaded level by level, so that the reads of a level
+ * are in flight together. */
+static int __ctree_load_interior(struct ctree *ctree,
+			const struct aulsmfs_ptr *ptr, int level)
 {
-	const struct io *io = builder->io;
-	const struct ctree_node *node = ctree_builder_node(builder,
-				level);
+	struct ctree_read *read = malloc(sizeof(*read));
+	size_t count = 1;
+	int rc;
 
-	return ctree_node_can_append(io, node, count, size);
-}
+	if (!read)
+		return -ENOMEM;
 
-static int __ctree_builder_append(struct ctree_builder *builder, int level,
-			const struct lsm_key *key, const struct lsm_val *val)
-{
-	struct io *io = builder->io;
-	const size_t size = key->size + val->size;
-	const int rc = ctree_builder_ensure_level(builder, level);
+	read[0].ptr = *ptr;
+	while (1) {
+		rc = ctree_load_level(ctree, read, count, level);
+		if (rc < 0 || level == 1)
+			break;
 
-	if (rc < 0)
-		return rc;
+		size_t children = 0;
 
-	if (!ctree_builder_can_append(builder, level, 1, size)) {
-		const int rc = ctree_builder_flush(builder, level);
+		for (size_t i = 0; i != count; ++i)
+			children += read[i].node->entries;
+
+		struct ctree_read *next = malloc(children * sizeof(*next));
 
+		if (!next) {
+			rc = -ENOMEM;
+			break;
+		}
+
+		children = 0;
+		for (size_t i = 0; i != count && rc == 0; ++i) {
+			const struct ctree_node *node = read[i].node;
+
+			for (size_t j = 0; j != node->entries; ++j) {
+				if (ctree_node_ptr(node, j,
+						&next[children++].ptr) < 0) {
+					rc = -EIO;
+					break;
+				}
+			}
+		}
+
+		free(read);
+		read = next;
+		count = children;
+		--level;
 		if (rc < 0)
-			return rc;
+			break;
 	}
+	free(read);
+	return rc;
+}
 
-	struct ctree_node *node = ctree_builder_node(builder, level);
+/* Failure to load interior nodes isn't fatal, iterators will just read them
+ * as usual and report an error if there is any. */
+static void ctree_load_interior(struct ctree *ctree)
+{
+	ctree_drop_interior(ctree);
+	if (!ctree->pin_interior || ctree->height < 2)
+		return;
+
+	if (ctree->fence.size) {
+		if (__ctree_load_interior(ctree, &ctree->fence, 1) == 0) {
+			ctree->fenced = 1;
+			return;
+		}
+		ctree_drop_interior(ctree);
+	}
 
-	return ctree_node_append(io, node, key, val);
+	if (__ctree_load_interior(ctree, &ctree->ptr, ctree->height - 1) < 0)
+		ctree_drop_interior(ctree);
 }
 
-int ctree_builder_append(struct ctree_builder *builder,
-			const struct lsm_key *key, const struct lsm_val *val)
+static void ctree_drop_bloom(struct ctree *ctree)
 {
-	return __ctree_builder_append(builder, 0, key, val);
+	free(ctree->bloom_data);
+	ctree->bloom_data = NULL;
+	ctree->bloom_size = 0;
+	ctree->bloom_hashes = 0;
 }
 
-int ctree_builder_finish(struct ctree_builder *builder)
+static int __ctree_load_bloom(struct ctree *ctree)
 {
-	struct io *io = builder->io;
-	int level = 0;
+	struct io *io = ctree->io;
+	const struct aulsmfs_bloom_header *header;
+	const size_t pages = le64toh(ctree->bloom.size);
+	const size_t bytes = io_bytes(io, pages);
+	void *buf = malloc(bytes);
 	int rc;
 
-	while (level < builder->nodes - 1) {
-		rc = ctree_builder_flush(builder, level);
-		if (rc < 0)
-			return rc;
-		++level;
-	}
-
-	if (!level) {
-		memset(&builder->ptr, 0, sizeof(builder->ptr));
-		builder->height = 0;
-		return 0;
-	}
-
-	/* We have written all but last level, the node will be root of the
-	 * ctree. */
-	struct ctree_node *root = ctree_builder_node(builder, level);
-	const size_t size = io_pages(io, root->bytes);
-	uint64_t offs;
+	if (!buf)
+		return -ENOMEM;
 
-	rc = ctree_builder_alloc(builder, size, &offs);
-	if (rc < 0)
+	rc = io_read(io, buf, pages, le64toh(ctree->bloom.offs));
+	if (rc < 0) {
+		free(buf);
 		return rc;
+	}
 
-	rc = ctree_node_write(io, root, offs, level);
-	if (rc < 0)
-		return rc;
+	header = buf;
+	if (crc64_parallel(buf, bytes) != le64toh(ctree->bloom.csum) ||
+			le64toh(header->size) > bytes - sizeof(*header)) {
+		free(buf);
+		return -EIO;
+	}
 
-	builder->ptr = root->ptr;
-	builder->height = level + 1;
-	ctree_node_reset(root);
+	ctree->bloom_size = le64toh(header->size);
+	ctree->bloom_hashes = le64toh(header->hashes);
+	ctree->bloom_data = buf;
 	return 0;
 }
 
-void ctree_builder_cancel(struct ctree_builder *builder)
+/* As with interior nodes failure to load the filter isn't fatal, the tree
+ * just behaves as if it had no filter. */
+static void ctree_load_bloom(struct ctree *ctree)
 {
-	for (size_t i = 0; i != builder->ranges; ++i) {
-		struct range *range = &builder->reserved[i];
-		const uint64_t offs = range->begin;
-		const uint64_t size = range->end - range->begin;
+	ctree_drop_bloom(ctree);
+	if (!ctree->height || !ctree->bloom.size)
+		return;
 
-		ctree_builder_free(builder, size, offs);
-	}
+	if (__ctree_load_bloom(ctree) < 0)
+		ctree_drop_bloom(ctree);
 }
 
-
-void ctree_setup(struct ctree *ctree, struct io *io, ctree_cmp_t cmp)
+int ctree_may_contain(const struct ctree *ctree, const struct lsm_key *key)
 {
-	memset(ctree, 0, sizeof(*ctree));
-	ctree->io = io;
-	ctree->cmp = cmp;
+	const struct aulsmfs_bloom_header *header = ctree->bloom_data;
+
+	if (!ctree->height)
+		return 0;
+
+	if (!header)
+		return 1;
+
+	return bloom_may_contain(header + 1, ctree->bloom_size,
+				ctree->bloom_hashes,
+				bloom_hash(key->ptr, key->size));
 }
 
 void ctree_release(struct ctree *ctree)
 {
+	ctree_drop_bloom(ctree);
+	ctree_drop_interior(ctree);
 	memset(ctree, 0, sizeof(*ctree));
 }
 
+void ctree_set_pin_interior(struct ctree *ctree, int pin)
+{
+	ctree->pin_interior = pin;
+}
+
+void ctree_set_cache(struct ctree *ctree, struct ctree_cache *cache)
+{
+	ctree->cache = cache;
+}
+
+void ctree_set_readahead(struct ctree *ctree, size_t leaves)
+{
+	ctree->readahead = leaves;
+}
+
 int ctree_reset(struct ctree *ctree, const struct aulsmfs_ptr *ptr,
-			size_t height, size_t pages)
+			const struct aulsmfs_ptr *bloom,
+			const struct aulsmfs_ptr *fence, size_t height,
+			size_t pages)
 {
 	if (!ptr) {
 		ctree->height = 0;
 		ctree->pages = pages;
 		memset(&ctree->ptr, 0, sizeof(ctree->ptr));
+		memset(&ctree->bloom, 0, sizeof(ctree->bloom));
+		memset(&ctree->fence, 0, sizeof(ctree->fence));
+		ctree_drop_interior(ctree);
+		ctree_drop_bloom(ctree);
 		return 0;
 	}
 	ctree->ptr = *ptr;
 	ctree->height = height;
 	ctree->pages = pages;
+	if (bloom)
+		ctree->bloom = *bloom;
+	else
+		memset(&ctree->bloom, 0, sizeof(ctree->bloom));
+	if (fence)
+		ctree->fence = *fence;
+	else
+		memset(&ctree->fence, 0, sizeof(ctree->fence));
+	ctree_load_interior(ctree);
+	ctree_load_bloom(ctree);
 	return 0;
 }
 
@@ -598,11 +2410,15 @@ void ctree_parse(struct ctree *ctree, const struct aulsmfs_ctree *ondisk)
 
 	/* Teoritically ondisk might be unaligned, thus this mess. */
 	memcpy(&ctree->ptr, &ondisk->ptr, sizeof(ctree->ptr));
+	memcpy(&ctree->bloom, &ondisk->bloom, sizeof(ctree->bloom));
+	memcpy(&ctree->fence, &ondisk->fence, sizeof(ctree->fence));
 	memcpy(&height, &ondisk->height, sizeof(height));
 	memcpy(&pages, &ondisk->pages, sizeof(pages));
 
 	ctree->height = le32toh(height);
 	ctree->pages = le32toh(pages);
+	ctree_load_interior(ctree);
+	ctree_load_bloom(ctree);
 }
 
 void ctree_dump(const struct ctree *ctree, struct aulsmfs_ctree *ondisk)
@@ -611,6 +2427,8 @@ void ctree_dump(const struct ctree *ctree, struct aulsmfs_ctree *ondisk)
 	const le32_t pages = htole32(ctree->pages);
 
 	memcpy(&ondisk->ptr, &ctree->ptr, sizeof(ctree->ptr));
+	memcpy(&ondisk->bloom, &ctree->bloom, sizeof(ctree->bloom));
+	memcpy(&ondisk->fence, &ctree->fence, sizeof(ctree->fence));
 	memcpy(&ondisk->height, &height, sizeof(height));
 	memcpy(&ondisk->pages, &pages, sizeof(pages));
 }
@@ -621,18 +2439,24 @@ void ctree_iter_setup(struct ctree_iter *iter, struct ctree *ctree)
 	memset(iter, 0, sizeof(*iter));
 	iter->io = ctree->io;
 	iter->cmp = ctree->cmp;
+	iter->schema = ctree->schema;
+	iter->cache = ctree->cache;
+	iter->interior = &ctree->interior;
 	iter->ptr = ctree->ptr;
 	iter->height = ctree->height;
+	iter->readahead = ctree->readahead;
+
+	if (ctree->fenced) {
+		iter->ptr = ctree->fence;
+		iter->height = 2;
+	}
 }
 
 void ctree_iter_release(struct ctree_iter *iter)
 {
 	if (iter->node) {
-		for (int i = 0; i != iter->height; ++i) {
-			if (iter->node[i])
-				ctree_node_release(iter->node[i]);
-			free(iter->node[i]);
-		}
+		for (int i = 0; i != iter->height; ++i)
+			ctree_node_put(iter->cache, iter->node[i]);
 	}
 
 	free(iter->node);
@@ -659,48 +2483,97 @@ static int ctree_iter_prepare(struct ctree_iter *iter)
 	return 0;
 }
 
-static size_t __ctree_node_lower_bound(const struct ctree_node *node,
-			const struct lsm_key *key, ctree_cmp_t cmp)
+/* Entries of a node are sorted, so both bounds are plain binary searches
+ * over the entry array, this way we need only log(entries) comparisions
+ * per level instead of looking at every entry of the node. The schema is
+ * always a constant here, so every caller gets its own comparision
+ * kernel inlined into the loop. */
+static inline size_t ctree_node_search(const struct ctree_node *node,
+			const struct lsm_key *key, size_t begin, size_t end,
+			enum key_schema schema, ctree_cmp_t cmp, int upper)
 {
-	for (size_t i = 0; i != node->entries; ++i) {
+	while (begin < end) {
+		const size_t mid = begin + (end - begin) / 2;
 		struct lsm_key node_key;
-
-		ctree_node_key(node, i, &node_key);
-
-		const int res = cmp(&node_key, key);
-
-		if (res >= 0)
-			return i;
+		int res;
+
+		ctree_node_key(node, mid, &node_key);
+		res = key_compare(schema, cmp, &node_key, key);
+		if (upper ? res <= 0 : res < 0)
+			begin = mid + 1;
+		else
+			end = mid;
 	}
-	return node->entries;
+	return begin;
 }
 
-static size_t __ctree_node_upper_bound(const struct ctree_node *node,
-			const struct lsm_key *key, ctree_cmp_t cmp)
+/* With bytewise keys only the entries that share the prefix of the key
+ * need a full comparision, the rest are sorted out by their prefixes. For
+ * KEY_SCHEMA_U64 it leaves at most one entry. */
+static size_t ctree_node_bound(const struct ctree_node *node,
+			const struct lsm_key *key, enum key_schema schema,
+			ctree_cmp_t cmp, int upper)
 {
-	for (size_t i = 0; i != node->entries; ++i) {
-		struct lsm_key node_key;
+	if (schema == KEY_SCHEMA_OPAQUE)
+		return ctree_node_search(node, key, 0, node->entries,
+					KEY_SCHEMA_OPAQUE, cmp, upper);
+
+	size_t begin = 0;
+	size_t end = node->entries;
 
-		ctree_node_key(node, i, &node_key);
+	/* Prefixes only help if they differ, e.g. all the keys of a leaf
+	 * often have the same 8 byte u64 part. */
+	if (end && node->prefix[0] != node->prefix[end - 1]) {
+		const uint64_t prefix = key_prefix(key->ptr, key->size);
 
-		const int res = cmp(&node_key, key);
+		begin = key_prefix_search(node->prefix, end, prefix, 0);
+		end = begin + key_prefix_search(node->prefix + begin,
+					end - begin, prefix, 1);
+	}
 
-		if (res > 0)
-			return i;
+	switch (schema) {
+	case KEY_SCHEMA_U64:
+		return ctree_node_search(node, key, begin, end,
+					KEY_SCHEMA_U64, cmp, upper);
+	case KEY_SCHEMA_U64_BYTES:
+		return ctree_node_search(node, key, begin, end,
+					KEY_SCHEMA_U64_BYTES, cmp, upper);
+	default:
+		return ctree_node_search(node, key, begin, end,
+					KEY_SCHEMA_BYTES, cmp, upper);
 	}
-	return node->entries;
 }
 
-static int ctree_node_ptr(const struct ctree_node *node, size_t pos,
-			struct aulsmfs_ptr *ptr)
+static size_t __ctree_node_lower_bound(const struct ctree_node *node,
+			const struct lsm_key *key, enum key_schema schema,
+			ctree_cmp_t cmp)
 {
-	struct lsm_val val;
+	return ctree_node_bound(node, key, schema, cmp, 0);
+}
 
-	ctree_node_val(node, pos, &val);
-	if (val.size != sizeof(*ptr))
-		return -ENOBUFS;
-	memcpy(ptr, val.ptr, sizeof(*ptr));
-	return 0;
+static size_t __ctree_node_upper_bound(const struct ctree_node *node,
+			const struct lsm_key *key, enum key_schema schema,
+			ctree_cmp_t cmp)
+{
+	return ctree_node_bound(node, key, schema, cmp, 1);
+}
+
+static int ctree_iter_get_node(struct ctree_iter *iter,
+			const struct aulsmfs_ptr *ptr, int level,
+			struct ctree_node **res)
+{
+	if (level && iter->interior->root) {
+		struct ctree_node *node = ctree_nodes_lookup(iter->interior,
+					ptr);
+
+		if (node) {
+			if (node->level != level)
+				return -EIO;
+			*res = node;
+			return 0;
+		}
+	}
+	return ctree_node_get(iter->io, iter->cache, ptr, level, res);
 }
 
 static int __ctree_get_node(struct ctree_iter *iter,
@@ -711,15 +2584,10 @@ static int __ctree_get_node(struct ctree_iter *iter,
 
 	if (!iter->node[level] || memcmp(&iter->node[level]->ptr, ptr,
 				sizeof(*ptr))) {
-		node = ctree_node_create();
-		if (!node)
-			return -ENOMEM;
-		rc = ctree_node_read(iter->io, node, ptr, level);
-		if (rc < 0) {
-			ctree_node_destroy(node);
+		rc = ctree_iter_get_node(iter, ptr, level, &node);
+		if (rc < 0)
 			return rc;
-		}
-		ctree_node_destroy(iter->node[level]);
+		ctree_node_put(iter->cache, iter->node[level]);
 		iter->node[level] = node;
 	}
 	return 0;
@@ -739,13 +2607,16 @@ static int __ctree_lookup(struct ctree_iter *iter, const struct lsm_key *key)
 	size_t pos;
 	struct aulsmfs_ptr ptr = iter->ptr;
 
+	iter->sequential = 0;
+
 	for (int level = iter->height - 1; level; --level) {
 		rc = __ctree_get_node(iter, &ptr, level);
 		if (rc < 0)
 			return rc;
 
 		node = iter->node[level];
-		pos = __ctree_node_upper_bound(node, key, iter->cmp);
+		pos = __ctree_node_upper_bound(node, key, iter->schema,
+					iter->cmp);
 		if (pos)
 			--pos;
 		iter->pos[level] = pos;
@@ -758,11 +2629,54 @@ static int __ctree_lookup(struct ctree_iter *iter, const struct lsm_key *key)
 		return rc;
 
 	node = iter->node[0];
-	pos = __ctree_node_lower_bound(node, key, iter->cmp);
+	pos = __ctree_node_lower_bound(node, key, iter->schema, iter->cmp);
 	iter->pos[0] = pos;
 	return 0;
 }
 
+/* Leaves written by one builder mostly follow each other on disk, so the
+ * siblings of the current leaf are read ahead in as few requests as we
+ * can. Only the siblings within the same parent are considered, the
+ * window is refilled once less than half of it is left. */
+static void ctree_iter_readahead(struct ctree_iter *iter)
+{
+	const struct ctree_node *parent = iter->node[1];
+	const size_t pos = iter->pos[1];
+	uint64_t begin = 0, end = 0;
+
+	if (memcmp(&iter->ra_parent, &parent->ptr, sizeof(parent->ptr))) {
+		iter->ra_parent = parent->ptr;
+		iter->ra_next = pos + 1;
+	}
+
+	if (iter->ra_next > pos + iter->readahead / 2)
+		return;
+
+	size_t from = iter->ra_next > pos + 1 ? iter->ra_next : pos + 1;
+	const size_t to = pos + 1 + iter->readahead < parent->entries
+				? pos + 1 + iter->readahead : parent->entries;
+
+	for (; from < to; ++from) {
+		struct aulsmfs_ptr ptr;
+
+		if (ctree_node_ptr(parent, from, &ptr) < 0)
+			break;
+
+		const uint64_t offs = le64toh(ptr.offs);
+		const uint64_t size = le64toh(ptr.size);
+
+		if (offs != end) {
+			if (end != begin)
+				io_readahead(iter->io, end - begin, begin);
+			begin = offs;
+		}
+		end = offs + size;
+	}
+	if (end != begin)
+		io_readahead(iter->io, end - begin, begin);
+	iter->ra_next = to;
+}
+
 int ctree_next(struct ctree_iter *iter)
 {
 	int level = -1;
@@ -788,7 +2702,7 @@ int ctree_next(struct ctree_iter *iter)
 	}
 
 	for (int i = 0; i != level; ++i) {
-		ctree_node_destroy(iter->node[i]);
+		ctree_node_put(iter->cache, iter->node[i]);
 		iter->node[i] = NULL;
 	}
 
@@ -805,17 +2719,15 @@ int ctree_next(struct ctree_iter *iter)
 
 		if (ctree_node_ptr(parent, pos, &ptr) < 0)
 			return -EIO;
-		child = ctree_node_create();
-		if (!child)
-			return -ENOMEM;
-		rc = ctree_node_read(iter->io, child, &ptr, i - 1);
-		if (rc < 0) {
-			ctree_node_destroy(child);
+		rc = ctree_iter_get_node(iter, &ptr, i - 1, &child);
+		if (rc < 0)
 			return rc;
-		}
 		iter->node[i - 1] = child;
 		iter->pos[i - 1] = 0;
 	}
+
+	if (level && iter->readahead && ++iter->sequential > 1)
+		ctree_iter_readahead(iter);
 	return 0;
 }
 
@@ -837,8 +2749,9 @@ int ctree_prev(struct ctree_iter *iter)
 	if (level == -1)
 		return -ENOENT;
 
+	iter->sequential = 0;
 	for (int i = 0; i != level; ++i) {
-		ctree_node_destroy(iter->node[i]);
+		ctree_node_put(iter->cache, iter->node[i]);
 		iter->node[i] = NULL;
 	}
 
@@ -855,14 +2768,9 @@ int ctree_prev(struct ctree_iter *iter)
 
 		if (ctree_node_ptr(parent, pos, &ptr) < 0)
 			return -EIO;
-		child = ctree_node_create();
-		if (!child)
-			return -ENOMEM;
-		rc = ctree_node_read(iter->io, child, &ptr, i - 1);
-		if (rc < 0) {
-			ctree_node_destroy(child);
+		rc = ctree_iter_get_node(iter, &ptr, i - 1, &child);
+		if (rc < 0)
 			return rc;
-		}
 		iter->node[i - 1] = child;
 		iter->pos[i - 1] = child->entries - 1;
 	}
@@ -906,7 +2814,7 @@ int ctree_upper_bound(struct ctree_iter *iter, const struct lsm_key *key)
 	struct lsm_key node_key;
 
 	ctree_node_key(iter->node[0], iter->pos[0], &node_key);
-	if (iter->cmp(&node_key, key) > 0)
+	if (key_compare(iter->schema, iter->cmp, &node_key, key) > 0)
 		return 0;
 
 	return ctree_next(iter);
@@ -930,7 +2838,7 @@ int ctree_lookup(struct ctree_iter *iter, const struct lsm_key *key)
 
 	ctree_node_key(iter->node[0], iter->pos[0], &node_key);
 
-	if (!iter->cmp(&node_key, key))
+	if (!key_compare(iter->schema, iter->cmp, &node_key, key))
 		return 1;
 	return 0;
 }
@@ -946,17 +2854,11 @@ int ctree_begin(struct ctree_iter *iter)
 	struct aulsmfs_ptr ptr = iter->ptr;
 
 	for (int level = iter->height - 1; level >= 0; --level) {
-		node = ctree_node_create();
-		if (!node)
-			return -ENOMEM;
-
-		rc = ctree_node_read(iter->io, node, &ptr, level);
-		if (rc < 0) {
-			ctree_node_destroy(node);
+		rc = __ctree_get_node(iter, &ptr, level);
+		if (rc < 0)
 			return rc;
-		}
 
-		iter->node[level] = node;
+		node = iter->node[level];
 		iter->pos[level] = 0;
 
 		if (level && ctree_node_ptr(node, 0, &ptr) < 0)
@@ -976,17 +2878,11 @@ int ctree_end(struct ctree_iter *iter)
 	struct aulsmfs_ptr ptr = iter->ptr;
 
 	for (int level = iter->height - 1; level >= 0; --level) {
-		node = ctree_node_create();
-		if (!node)
-			return -ENOMEM;
-
-		rc = ctree_node_read(iter->io, node, &ptr, level);
-		if (rc < 0) {
-			ctree_node_destroy(node);
+		rc = __ctree_get_node(iter, &ptr, level);
+		if (rc < 0)
 			return rc;
-		}
 
-		iter->node[level] = node;
+		node = iter->node[level];
 		iter->pos[level] = node->entries - 1;
 
 		if (level && ctree_node_ptr(node, node->entries - 1, &ptr) < 0)
@@ -1019,3 +2915,156 @@ int ctree_val(const struct ctree_iter *iter, struct lsm_val *val)
 		ctree_node_val(iter->node[0], iter->pos[0], val);
 	return 0;
 }
+
+size_t ctree_iter_leaf_items(const struct ctree_iter *iter)
+{
+	if (!iter->height || !iter->node || !iter->node[0] || iter->pos[0])
+		return 0;
+	return iter->node[0]->entries;
+}
+
+void ctree_iter_leaf_item(const struct ctree_iter *iter, size_t pos,
+			struct lsm_key *key, struct lsm_val *val)
+{
+	if (key)
+		ctree_node_key(iter->node[0], pos, key);
+	if (val)
+		ctree_node_val(iter->node[0], pos, val);
+}
+
+uint64_t ctree_iter_leaf_offs(const struct ctree_iter *iter)
+{
+	return le64toh(iter->node[0]->ptr.offs);
+}
+
+int ctree_skip_leaf(struct ctree_iter *iter)
+{
+	iter->pos[0] = iter->node[0]->entries - 1;
+	return ctree_next(iter);
+}
+
+/* Children of the root are only visited if the root alone doesn't give
+ * enough keys, so we read at most the second level of the tree. */
+int ctree_split_keys(struct ctree *ctree, size_t keys, ctree_key_fn_t fn,
+			void *arg)
+{
+	struct ctree_iter iter;
+	struct ctree_node *root;
+	struct lsm_key key;
+	int rc;
+
+	if (ctree->height < 2)
+		return 0;
+
+	/* The fence index would give a key per leaf, we want fewer. */
+	ctree_iter_setup(&iter, ctree);
+	iter.ptr = ctree->ptr;
+	iter.height = ctree->height;
+	rc = ctree_iter_prepare(&iter);
+	if (rc == 0)
+		rc = __ctree_get_node(&iter, &iter.ptr, iter.height - 1);
+	if (rc < 0)
+		goto out;
+
+	root = iter.node[iter.height - 1];
+	if (root->entries > keys || iter.height < 3) {
+		for (size_t i = 1; rc == 0 && i < root->entries; ++i) {
+			ctree_node_key(root, i, &key);
+			rc = fn(arg, &key);
+		}
+		goto out;
+	}
+
+	for (size_t i = 0; rc == 0 && i != root->entries; ++i) {
+		struct ctree_node *child;
+		struct aulsmfs_ptr ptr;
+
+		if (ctree_node_ptr(root, i, &ptr) < 0) {
+			rc = -EIO;
+			break;
+		}
+
+		rc = ctree_iter_get_node(&iter, &ptr, iter.height - 2, &child);
+		if (rc < 0)
+			break;
+
+		for (size_t j = i ? 0 : 1; rc == 0 && j < child->entries; ++j) {
+			ctree_node_key(child, j, &key);
+			rc = fn(arg, &key);
+		}
+		ctree_node_put(iter.cache, child);
+	}
+
+out:
+	ctree_iter_release(&iter);
+	return rc;
+}
+
+static int ctree_free_ptr(struct alloc *alloc, const struct aulsmfs_ptr *ptr)
+{
+	const uint64_t size = le64toh(ptr->size);
+
+	if (!size)
+		return 0;
+	return alloc_free(alloc, size, le64toh(ptr->offs));
+}
+
+static int __ctree_free(struct ctree_iter *iter, struct alloc *alloc,
+			const struct aulsmfs_ptr *ptr, int level,
+			ctree_keep_fn_t keep, void *arg)
+{
+	struct ctree_node *node;
+	int rc, err;
+
+	if (!level) {
+		if (keep && keep(arg, le64toh(ptr->offs)))
+			return 0;
+		return ctree_free_ptr(alloc, ptr);
+	}
+
+	rc = ctree_iter_get_node(iter, ptr, level, &node);
+	if (rc == 0) {
+		for (size_t i = 0; i != node->entries; ++i) {
+			struct aulsmfs_ptr child;
+
+			if (ctree_node_ptr(node, i, &child) < 0) {
+				rc = -EIO;
+				continue;
+			}
+
+			err = __ctree_free(iter, alloc, &child, level - 1,
+						keep, arg);
+			if (err < 0 && rc == 0)
+				rc = err;
+		}
+		ctree_node_put(iter->cache, node);
+	}
+
+	err = ctree_free_ptr(alloc, ptr);
+	return rc < 0 ? rc : err;
+}
+
+int ctree_free(struct ctree *ctree, struct alloc *alloc, ctree_keep_fn_t keep,
+			void *arg)
+{
+	struct ctree_iter iter;
+	int rc, err;
+
+	if (!ctree->height)
+		return 0;
+
+	/* Leaves are reached through the interior nodes, the fence index
+	 * only points to the same leaves. */
+	ctree_iter_setup(&iter, ctree);
+	rc = __ctree_free(&iter, alloc, &ctree->ptr, ctree->height - 1, keep,
+				arg);
+	ctree_iter_release(&iter);
+
+	err = ctree_free_ptr(alloc, &ctree->fence);
+	if (err < 0 && rc == 0)
+		rc = err;
+	err = ctree_free_ptr(alloc, &ctree->bloom);
+	if (err < 0 && rc == 0)
+		rc = err;
+	return rc;
+}
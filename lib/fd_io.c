@@ -0,0 +1,604 @@
+#include <fd_io.h>
+#include <file_wrappers.h>
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+static int fd_io_read(struct io *io, void *buf, size_t size, off_t offs)
+{
+	struct fd_io *fio = (struct fd_io *)io;
+
+	return file_read_at(fio->fd, buf, size, offs);
+}
+
+static int fd_io_write(struct io *io, const void *buf, size_t size,
+			off_t offs)
+{
+	struct fd_io *fio = (struct fd_io *)io;
+
+	return file_write_at(fio->fd, buf, size, offs);
+}
+
+static int fd_io_sync(struct io *io)
+{
+	struct fd_io *fio = (struct fd_io *)io;
+
+	return fdatasync(fio->fd) < 0 ? -errno : 0;
+}
+
+static int fd_io_readahead(struct io *io, size_t size, off_t offs)
+{
+	struct fd_io *fio = (struct fd_io *)io;
+
+	return file_readahead(fio->fd, size, offs);
+}
+
+/* Accounts a transfer of res bytes (or an error), returns 1 once the
+ * request is complete and 0 if the rest of it has to be submitted. */
+static int fd_req_advance(const struct io *io, struct io_req *req,
+			ssize_t res)
+{
+	const size_t size = io_bytes(io, req->size);
+
+	if (res == -EINTR || res == -EAGAIN)
+		return 0;
+
+	if (res < 0) {
+		req->result = res;
+		return 1;
+	}
+
+	req->bytes += res;
+	if (req->bytes == size || (!res && req->op == IO_REQ_READ)) {
+		req->result = req->bytes;
+		return 1;
+	}
+
+	if (!res) {
+		req->result = -EIO;
+		return 1;
+	}
+	return 0;
+}
+
+
+/* Rings are set up without liburing, so that's the part of it we need. */
+struct fd_uring {
+	int fd;
+	int fixed_file;
+	size_t buffers;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	struct io_uring_cqe *cqes;
+	unsigned cq_mask;
+
+	/* Entries queued to the ring, but not passed to the kernel yet. */
+	unsigned to_submit;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	const long rc = syscall(__NR_io_uring_setup, entries, p);
+
+	return rc < 0 ? -errno : (int)rc;
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned wait,
+			unsigned flags)
+{
+	const long rc = syscall(__NR_io_uring_enter, fd, to_submit, wait,
+				flags, NULL, 0);
+
+	return rc < 0 ? -errno : (int)rc;
+}
+
+static int sys_io_uring_register(int fd, unsigned op, const void *arg,
+			unsigned count)
+{
+	const long rc = syscall(__NR_io_uring_register, fd, op, arg, count);
+
+	return rc < 0 ? -errno : (int)rc;
+}
+
+static int fd_uring_op_supported(const struct io_uring_probe *probe,
+			unsigned op)
+{
+	return op < probe->ops_len &&
+				(probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+}
+
+/* io_uring_setup works since 5.1, but IORING_OP_READ and IORING_OP_WRITE
+ * came in 5.6 along with IORING_REGISTER_PROBE, so older kernels fail the
+ * probe and use the pool. */
+static int fd_uring_supported(void)
+{
+	const size_t size = sizeof(struct io_uring_probe) +
+				IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	struct io_uring_params params;
+	int ret = 0;
+
+	if (!probe)
+		return 0;
+
+	memset(&params, 0, sizeof(params));
+
+	const int fd = sys_io_uring_setup(1, &params);
+
+	if (fd < 0) {
+		free(probe);
+		return 0;
+	}
+
+	if (sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe,
+				IORING_OP_LAST) == 0)
+		ret = fd_uring_op_supported(probe, IORING_OP_READ) &&
+			fd_uring_op_supported(probe, IORING_OP_WRITE) &&
+			fd_uring_op_supported(probe, IORING_OP_READ_FIXED) &&
+			fd_uring_op_supported(probe, IORING_OP_WRITE_FIXED);
+	close(fd);
+	free(probe);
+	return ret;
+}
+
+static void fd_uring_destroy(struct fd_uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	free(ring);
+}
+
+static void *fd_uring_mmap(int fd, size_t size, off_t offs)
+{
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, fd, offs);
+
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static int fd_uring_queue_setup(struct io *io, struct io_queue *queue)
+{
+	struct fd_io *fio = (struct fd_io *)io;
+	struct fd_uring *ring = calloc(1, sizeof(*ring));
+	struct io_uring_params params;
+
+	if (!ring)
+		return -ENOMEM;
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = sys_io_uring_setup(queue->depth, &params);
+	if (ring->fd < 0) {
+		const int rc = ring->fd;
+
+		free(ring);
+		return rc;
+	}
+
+	ring->sq_ring_size = params.sq_off.array +
+				params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes +
+				params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->sq_ring = fd_uring_mmap(ring->fd, ring->sq_ring_size,
+					IORING_OFF_SQ_RING);
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->sq_ring = fd_uring_mmap(ring->fd, ring->sq_ring_size,
+					IORING_OFF_SQ_RING);
+		ring->cq_ring = fd_uring_mmap(ring->fd, ring->cq_ring_size,
+					IORING_OFF_CQ_RING);
+	}
+	ring->sqes = fd_uring_mmap(ring->fd, ring->sqes_size,
+				IORING_OFF_SQES);
+
+	if (!ring->sq_ring || !ring->cq_ring || !ring->sqes) {
+		fd_uring_destroy(ring);
+		return -ENOMEM;
+	}
+
+	char *sq = ring->sq_ring;
+	char *cq = ring->cq_ring;
+
+	ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+
+	/* A fixed file saves the file lookup on every request, the ring
+	 * works without it too. */
+	ring->fixed_file = sys_io_uring_register(ring->fd,
+				IORING_REGISTER_FILES, &fio->fd, 1) == 0;
+
+	queue->priv = ring;
+	return 0;
+}
+
+static void fd_uring_queue_release(struct io_queue *queue)
+{
+	fd_uring_destroy(queue->priv);
+}
+
+static int fd_uring_queue_register(struct io_queue *queue,
+			const struct iovec *iov, size_t count)
+{
+	struct fd_uring *ring = queue->priv;
+	int rc;
+
+	if (ring->buffers) {
+		sys_io_uring_register(ring->fd, IORING_UNREGISTER_BUFFERS,
+					NULL, 0);
+		ring->buffers = 0;
+	}
+
+	if (!count)
+		return 0;
+
+	rc = sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov,
+				count);
+	if (rc < 0)
+		return rc;
+	ring->buffers = count;
+	return 0;
+}
+
+/* There is always a free entry, since the queue never has more requests
+ * in flight than the ring has entries, and entries are passed to the
+ * kernel right after they are queued. */
+static void fd_uring_prep(const struct io *io, struct fd_uring *ring,
+			struct io_req *req)
+{
+	const unsigned tail = *ring->sq_tail;
+	const unsigned index = tail & ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	const int write = req->op == IO_REQ_WRITE;
+	const int fixed = req->buf_index >= 0 &&
+				(size_t)req->buf_index < ring->buffers;
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (fixed) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED
+					: IORING_OP_READ_FIXED;
+		sqe->buf_index = req->buf_index;
+	} else {
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+
+	if (ring->fixed_file) {
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fd = 0;
+	} else {
+		sqe->fd = ((const struct fd_io *)io)->fd;
+	}
+
+	sqe->addr = (uintptr_t)req->buf + req->bytes;
+	sqe->len = io_bytes(io, req->size) - req->bytes;
+	sqe->off = io_bytes(io, req->offs) + req->bytes;
+	sqe->user_data = (uintptr_t)req;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++ring->to_submit;
+}
+
+/* Passes queued entries to the kernel and waits for the given number of
+ * completions. */
+static int fd_uring_enter(struct fd_uring *ring, unsigned wait)
+{
+	const unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+
+	do {
+		const int rc = sys_io_uring_enter(ring->fd, ring->to_submit,
+					wait, flags);
+
+		if (rc == -EINTR)
+			continue;
+		if (rc < 0)
+			return rc;
+		ring->to_submit -= rc;
+	} while (ring->to_submit);
+	return 0;
+}
+
+static int fd_uring_submit(struct io_queue *queue, struct io_req **req,
+			size_t count)
+{
+	struct fd_uring *ring = queue->priv;
+
+	for (size_t i = 0; i != count; ++i)
+		fd_uring_prep(queue->io, ring, req[i]);
+	return fd_uring_enter(ring, 0);
+}
+
+static int fd_uring_reap(struct io_queue *queue, size_t min)
+{
+	struct fd_uring *ring = queue->priv;
+	size_t reaped = 0;
+
+	while (1) {
+		const unsigned tail = __atomic_load_n(ring->cq_tail,
+					__ATOMIC_ACQUIRE);
+		unsigned head = *ring->cq_head;
+
+		for (; head != tail; ++head) {
+			const struct io_uring_cqe *cqe =
+					&ring->cqes[head & ring->cq_mask];
+			struct io_req *req = (void *)(uintptr_t)cqe->user_data;
+
+			if (fd_req_advance(queue->io, req, cqe->res)) {
+				io_queue_complete(queue, req);
+				++reaped;
+			} else {
+				fd_uring_prep(queue->io, ring, req);
+			}
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		if (reaped >= min && !ring->to_submit)
+			return 0;
+
+		const int rc = fd_uring_enter(ring, reaped < min);
+
+		if (rc < 0)
+			return rc;
+	}
+}
+
+
+struct fd_pool {
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	pthread_t thread[FD_IO_POOL_THREADS];
+	int threads;
+	int stop;
+
+	struct io_req *head;
+	struct io_req *tail;
+};
+
+/* Requests served by the pool, but not passed to io_queue_complete yet. */
+struct fd_pool_queue {
+	pthread_cond_t cond;
+	struct io_req *head;
+	struct io_req *tail;
+	size_t ready;
+};
+
+static void fd_pool_serve(struct fd_io *fio, struct io_req *req)
+{
+	const size_t size = io_bytes(&fio->io, req->size);
+	ssize_t rc;
+
+	do {
+		char *buf = (char *)req->buf + req->bytes;
+		const off_t offs = io_bytes(&fio->io, req->offs) + req->bytes;
+
+		if (req->op == IO_REQ_WRITE)
+			rc = pwrite(fio->fd, buf, size - req->bytes, offs);
+		else
+			rc = pread(fio->fd, buf, size - req->bytes, offs);
+	} while (!fd_req_advance(&fio->io, req, rc < 0 ? -errno : rc));
+}
+
+static void *fd_pool_run(void *arg)
+{
+	struct fd_io *fio = arg;
+	struct fd_pool *pool = fio->pool;
+
+	pthread_mutex_lock(&pool->mtx);
+	while (1) {
+		while (!pool->head && !pool->stop)
+			pthread_cond_wait(&pool->cond, &pool->mtx);
+
+		struct io_req *req = pool->head;
+
+		if (!req)
+			break;
+
+		pool->head = req->next;
+		if (!pool->head)
+			pool->tail = NULL;
+		pthread_mutex_unlock(&pool->mtx);
+
+		fd_pool_serve(fio, req);
+
+		pthread_mutex_lock(&pool->mtx);
+		struct fd_pool_queue *pq = req->queue->priv;
+
+		req->next = NULL;
+		if (pq->tail)
+			pq->tail->next = req;
+		else
+			pq->head = req;
+		pq->tail = req;
+		++pq->ready;
+		pthread_cond_signal(&pq->cond);
+	}
+	pthread_mutex_unlock(&pool->mtx);
+	return NULL;
+}
+
+static void fd_pool_stop(struct fd_io *fio)
+{
+	struct fd_pool *pool = fio->pool;
+
+	pthread_mutex_lock(&pool->mtx);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mtx);
+
+	for (int i = 0; i != pool->threads; ++i)
+		pthread_join(pool->thread[i], NULL);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mtx);
+	free(pool);
+	fio->pool = NULL;
+}
+
+static int fd_pool_start(struct fd_io *fio)
+{
+	struct fd_pool *pool = calloc(1, sizeof(*pool));
+
+	if (!pool)
+		return -ENOMEM;
+
+	pthread_mutex_init(&pool->mtx, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	fio->pool = pool;
+
+	for (int i = 0; i != FD_IO_POOL_THREADS; ++i) {
+		const int rc = pthread_create(&pool->thread[i], NULL,
+					&fd_pool_run, fio);
+
+		if (rc) {
+			fd_pool_stop(fio);
+			return -rc;
+		}
+		++pool->threads;
+	}
+	return 0;
+}
+
+static int fd_pool_queue_setup(struct io *io, struct io_queue *queue)
+{
+	struct fd_pool_queue *pq = calloc(1, sizeof(*pq));
+
+	(void) io;
+	if (!pq)
+		return -ENOMEM;
+
+	pthread_cond_init(&pq->cond, NULL);
+	queue->priv = pq;
+	return 0;
+}
+
+static void fd_pool_queue_release(struct io_queue *queue)
+{
+	struct fd_pool_queue *pq = queue->priv;
+
+	pthread_cond_destroy(&pq->cond);
+	free(pq);
+}
+
+static int fd_pool_submit(struct io_queue *queue, struct io_req **req,
+			size_t count)
+{
+	struct fd_pool *pool = ((struct fd_io *)queue->io)->pool;
+
+	pthread_mutex_lock(&pool->mtx);
+	for (size_t i = 0; i != count; ++i) {
+		req[i]->next = NULL;
+		if (pool->tail)
+			pool->tail->next = req[i];
+		else
+			pool->head = req[i];
+		pool->tail = req[i];
+	}
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mtx);
+	return 0;
+}
+
+static int fd_pool_reap(struct io_queue *queue, size_t min)
+{
+	struct fd_pool *pool = ((struct fd_io *)queue->io)->pool;
+	struct fd_pool_queue *pq = queue->priv;
+	struct io_req *req;
+
+	pthread_mutex_lock(&pool->mtx);
+	while (pq->ready < min)
+		pthread_cond_wait(&pq->cond, &pool->mtx);
+	req = pq->head;
+	pq->head = pq->tail = NULL;
+	pq->ready = 0;
+	pthread_mutex_unlock(&pool->mtx);
+
+	while (req) {
+		struct io_req *next = req->next;
+
+		io_queue_complete(queue, req);
+		req = next;
+	}
+	return 0;
+}
+
+
+static struct io_ops fd_uring_ops = {
+	.read = &fd_io_read,
+	.write = &fd_io_write,
+	.sync = &fd_io_sync,
+	.readahead = &fd_io_readahead,
+	.queue_setup = &fd_uring_queue_setup,
+	.queue_release = &fd_uring_queue_release,
+	.queue_register = &fd_uring_queue_register,
+	.submit = &fd_uring_submit,
+	.reap = &fd_uring_reap
+};
+
+static struct io_ops fd_pool_ops = {
+	.read = &fd_io_read,
+	.write = &fd_io_write,
+	.sync = &fd_io_sync,
+	.readahead = &fd_io_readahead,
+	.queue_setup = &fd_pool_queue_setup,
+	.queue_release = &fd_pool_queue_release,
+	.submit = &fd_pool_submit,
+	.reap = &fd_pool_reap
+};
+
+int fd_io_setup(struct fd_io *fio, int fd, size_t page_size, int flags)
+{
+	memset(fio, 0, sizeof(*fio));
+	fio->fd = fd;
+	fio->io.page_size = page_size;
+
+	if (!(flags & FD_IO_POOL) && fd_uring_supported()) {
+		fio->uring = 1;
+		fio->io.ops = &fd_uring_ops;
+		return 0;
+	}
+
+	fio->io.ops = &fd_pool_ops;
+	return fd_pool_start(fio);
+}
+
+void fd_io_release(struct fd_io *fio)
+{
+	if (fio->pool)
+		fd_pool_stop(fio);
+	memset(fio, 0, sizeof(*fio));
+}
@@ -1,6 +1,7 @@
 #include <file_wrappers.h>
 
 #include <sys/types.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
@@ -52,3 +53,8 @@ int file_read_at(int fd, void *data, int size, off_t off)
 
 	return r;
 }
+
+int file_readahead(int fd, size_t size, off_t off)
+{
+	return -posix_fadvise(fd, off, size, POSIX_FADV_WILLNEED);
+}
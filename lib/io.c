@@ -0,0 +1,147 @@
+#include <io.h>
+
+#include <string.h>
+#include <errno.h>
+
+
+int io_queue_setup(struct io_queue *queue, struct io *io, size_t depth)
+{
+	struct io_ops * const ops = io->ops;
+
+	memset(queue, 0, sizeof(*queue));
+	queue->io = io;
+	queue->depth = depth ? depth : 1;
+
+	if (!ops->queue_setup)
+		return 0;
+
+	const int rc = ops->queue_setup(io, queue);
+
+	if (rc < 0)
+		memset(queue, 0, sizeof(*queue));
+	return rc;
+}
+
+void io_queue_release(struct io_queue *queue)
+{
+	struct io_ops * const ops = queue->io->ops;
+
+	while (queue->inflight) {
+		if (io_queue_reap(queue, queue->inflight) < 0)
+			break;
+	}
+
+	if (ops->queue_release)
+		ops->queue_release(queue);
+	memset(queue, 0, sizeof(*queue));
+}
+
+int io_queue_register(struct io_queue *queue, const struct iovec *iov,
+			size_t count)
+{
+	struct io_ops * const ops = queue->io->ops;
+
+	if (!ops->queue_register)
+		return 0;
+	return ops->queue_register(queue, iov, count);
+}
+
+void io_queue_complete(struct io_queue *queue, struct io_req *req)
+{
+	req->next = NULL;
+	if (queue->tail)
+		queue->tail->next = req;
+	else
+		queue->head = req;
+	queue->tail = req;
+}
+
+/* The io has no asynchronous interface, so the request is complete by the
+ * time it's submitted. */
+static void io_queue_serve(struct io_queue *queue, struct io_req *req)
+{
+	struct io * const io = queue->io;
+
+	if (req->op == IO_REQ_WRITE) {
+		const int rc = io_write(io, req->buf, req->size, req->offs);
+
+		req->result = rc < 0 ? rc : (ssize_t)io_bytes(io, req->size);
+	} else {
+		req->result = io_read(io, req->buf, req->size, req->offs);
+	}
+	io_queue_complete(queue, req);
+}
+
+int io_queue_submit(struct io_queue *queue, struct io_req **req,
+			size_t count)
+{
+	struct io_ops * const ops = queue->io->ops;
+
+	while (count) {
+		if (queue->inflight == queue->depth) {
+			const int rc = io_queue_reap(queue, 1);
+
+			if (rc < 0)
+				return rc;
+			continue;
+		}
+
+		const size_t free = queue->depth - queue->inflight;
+		const size_t batch = count < free ? count : free;
+
+		for (size_t i = 0; i != batch; ++i) {
+			req[i]->queue = queue;
+			req[i]->bytes = 0;
+		}
+
+		if (ops->submit) {
+			const int rc = ops->submit(queue, req, batch);
+
+			if (rc < 0)
+				return rc;
+		} else {
+			for (size_t i = 0; i != batch; ++i)
+				io_queue_serve(queue, req[i]);
+		}
+
+		queue->inflight += batch;
+		req += batch;
+		count -= batch;
+	}
+	return 0;
+}
+
+int io_queue_reap(struct io_queue *queue, size_t min)
+{
+	struct io_ops * const ops = queue->io->ops;
+	size_t ready = 0;
+	int reaped = 0;
+
+	if (min > queue->inflight)
+		min = queue->inflight;
+
+	for (struct io_req *req = queue->head; req; req = req->next)
+		++ready;
+
+	if (ops->reap && (ready < min || !queue->head)) {
+		const int rc = ops->reap(queue, min > ready ? min - ready : 0);
+
+		if (rc < 0)
+			return rc;
+	}
+
+	/* Callbacks may submit more requests, so the list is rechecked. */
+	while (queue->head) {
+		struct io_req *req = queue->head;
+
+		queue->head = req->next;
+		if (!queue->head)
+			queue->tail = NULL;
+		--queue->inflight;
+		++reaped;
+
+		if (req->done)
+			req->done(req);
+	}
+	return reaped;
+}
@@ -0,0 +1,574 @@
+#include <level.h>
+#include <crc64.h>
+
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+void level_setup(struct level *level, struct io *io, ctree_cmp_t cmp)
+{
+	memset(level, 0, sizeof(*level));
+	level->io = io;
+	level->cmp = cmp;
+	level->readahead = CTREE_DEFAULT_READAHEAD;
+}
+
+static void level_part_release(struct level_part *part)
+{
+	ctree_release(&part->ctree);
+	free(part->keys);
+	memset(part, 0, sizeof(*part));
+}
+
+static void level_clear_parts(struct level *level)
+{
+	level->part = NULL;
+	level->parts = 0;
+	level->max_parts = 0;
+	level->pages = 0;
+	memset(&level->ptr, 0, sizeof(level->ptr));
+}
+
+static void level_drop_parts(struct level *level)
+{
+	for (size_t i = 0; i != level->parts; ++i)
+		level_part_release(&level->part[i]);
+
+	free(level->part);
+	level_clear_parts(level);
+	level->cursor = 0;
+}
+
+void level_release(struct level *level)
+{
+	level_drop_parts(level);
+	memset(level, 0, sizeof(*level));
+}
+
+void level_set_cache(struct level *level, struct ctree_cache *cache)
+{
+	level->cache = cache;
+	for (size_t i = 0; i != level->parts; ++i)
+		ctree_set_cache(&level->part[i].ctree, cache);
+}
+
+void level_set_pin_interior(struct level *level, int pin)
+{
+	level->pin_interior = pin;
+	for (size_t i = 0; i != level->parts; ++i)
+		ctree_set_pin_interior(&level->part[i].ctree, pin);
+}
+
+void level_set_readahead(struct level *level, size_t leaves)
+{
+	level->readahead = leaves;
+	for (size_t i = 0; i != level->parts; ++i)
+		ctree_set_readahead(&level->part[i].ctree, leaves);
+}
+
+int level_is_empty(const struct level *level)
+{
+	return level->parts ? 0 : 1;
+}
+
+void level_swap(struct level *l, struct level *r)
+{
+	const struct level tmp = *l;
+
+	*l = *r;
+	*r = tmp;
+}
+
+/* Partitions don't overlap, so both their first and last keys are sorted
+ * and we can use plain binary search. */
+static size_t __level_find(const struct level *level,
+			const struct lsm_key *key, size_t begin, size_t end,
+			int upper)
+{
+	while (begin < end) {
+		const size_t mid = begin + (end - begin) / 2;
+		const int cmp = level->cmp(&level->part[mid].last, key);
+
+		if (cmp < 0 || (upper && !cmp))
+			begin = mid + 1;
+		else
+			end = mid;
+	}
+	return begin;
+}
+
+size_t level_find(const struct level *level, const struct lsm_key *key)
+{
+	return __level_find(level, key, 0, level->parts, 0);
+}
+
+int level_may_contain(const struct level *level, const struct lsm_key *key)
+{
+	const size_t part = level_find(level, key);
+
+	if (part == level->parts)
+		return 0;
+
+	if (level->cmp(&level->part[part].first, key) > 0)
+		return 0;
+
+	return ctree_may_contain(&level->part[part].ctree, key);
+}
+
+static int level_reserve(struct level *level, size_t parts)
+{
+	if (parts <= level->max_parts)
+		return 0;
+
+	const size_t max_parts = level->max_parts * 2 < parts
+				? parts : level->max_parts * 2;
+	struct level_part *part = realloc(level->part,
+				max_parts * sizeof(*part));
+
+	if (!part)
+		return -ENOMEM;
+
+	level->part = part;
+	level->max_parts = max_parts;
+	return 0;
+}
+
+static int level_part_set_keys(struct level_part *part,
+			const struct lsm_key *first, const struct lsm_key *last)
+{
+	char *keys = malloc(first->size + last->size + 1);
+
+	if (!keys)
+		return -ENOMEM;
+
+	memcpy(keys, first->ptr, first->size);
+	memcpy(keys + first->size, last->ptr, last->size);
+
+	part->keys = keys;
+	part->first.ptr = keys;
+	part->first.size = first->size;
+	part->last.ptr = keys + first->size;
+	part->last.size = last->size;
+	return 0;
+}
+
+static int level_part_load_keys(struct level_part *part)
+{
+	struct ctree_iter begin, end;
+	struct lsm_key first, last;
+	int rc;
+
+	ctree_iter_setup(&begin, &part->ctree);
+	ctree_iter_setup(&end, &part->ctree);
+
+	if ((rc = ctree_begin(&begin)) < 0 || (rc = ctree_end(&end)) < 0 ||
+				(rc = ctree_prev(&end)) < 0)
+		goto out;
+
+	if (ctree_key(&begin, &first) || ctree_key(&end, &last)) {
+		rc = -EIO;
+		goto out;
+	}
+	rc = level_part_set_keys(part, &first, &last);
+
+out:
+	ctree_iter_release(&end);
+	ctree_iter_release(&begin);
+	return rc;
+}
+
+static void level_part_setup(const struct level *level,
+			struct level_part *part)
+{
+	memset(part, 0, sizeof(*part));
+	ctree_setup(&part->ctree, level->io, level->cmp);
+	ctree_set_cache(&part->ctree, level->cache);
+	ctree_set_pin_interior(&part->ctree, level->pin_interior);
+	ctree_set_readahead(&part->ctree, level->readahead);
+}
+
+int level_append(struct level *level, const struct ctree_builder *builder,
+			const struct lsm_key *first, const struct lsm_key *last)
+{
+	if (!builder->height)
+		return 0;
+
+	int rc = level_reserve(level, level->parts + 1);
+
+	if (rc < 0)
+		return rc;
+
+	struct level_part *part = &level->part[level->parts];
+
+	level_part_setup(level, part);
+	rc = ctree_reset(&part->ctree, &builder->ptr, &builder->bloom,
+				&builder->fence, builder->height,
+				builder->pages);
+	if (rc < 0) {
+		level_part_release(part);
+		return rc;
+	}
+
+	if (first && last)
+		rc = level_part_set_keys(part, first, last);
+	else
+		rc = level_part_load_keys(part);
+
+	if (rc < 0) {
+		level_part_release(part);
+		return rc;
+	}
+
+	++level->parts;
+	level->pages += builder->pages;
+	return 0;
+}
+
+int level_share(struct level *level, const struct level *src, size_t from,
+			size_t to)
+{
+	const int rc = level_reserve(level, level->parts + to - from);
+
+	if (rc < 0)
+		return rc;
+
+	for (size_t i = from; i != to; ++i) {
+		level->part[level->parts++] = src->part[i];
+		level->pages += src->part[i].ctree.pages;
+	}
+	return 0;
+}
+
+void level_forget(struct level *level)
+{
+	free(level->part);
+	level_clear_parts(level);
+}
+
+void level_replace(struct level *level, struct level *next)
+{
+	const struct level old = *level;
+
+	level->part = next->part;
+	level->parts = next->parts;
+	level->max_parts = next->max_parts;
+	level->pages = next->pages;
+	level->ptr = next->ptr;
+	if (level->cursor >= level->parts)
+		level->cursor = 0;
+
+	next->part = old.part;
+	next->parts = old.parts;
+	next->max_parts = old.max_parts;
+	next->pages = old.pages;
+	next->ptr = old.ptr;
+}
+
+size_t level_range_pages(const struct level *level, size_t from, size_t to)
+{
+	size_t pages = 0;
+
+	for (size_t i = from; i != to; ++i)
+		pages += level->part[i].ctree.pages;
+	return pages;
+}
+
+int level_split_keys(struct level *level, size_t from, size_t to,
+			size_t keys, ctree_key_fn_t fn, void *arg)
+{
+	for (size_t i = from; i != to; ++i) {
+		int rc;
+
+		if (i != from && (rc = fn(arg, &level->part[i].first)) < 0)
+			return rc;
+
+		rc = ctree_split_keys(&level->part[i].ctree, keys, fn, arg);
+		if (rc < 0)
+			return rc;
+	}
+	return 0;
+}
+
+int level_write(struct level *level, struct alloc *alloc)
+{
+	struct io *io = level->io;
+	const size_t bytes = level->parts * sizeof(struct aulsmfs_ctree);
+	const size_t pages = io_pages(io, bytes);
+	struct aulsmfs_ctree *buf;
+	uint64_t offs;
+	int rc;
+
+	memset(&level->ptr, 0, sizeof(level->ptr));
+	if (!level->parts)
+		return 0;
+
+	buf = calloc(1, io_bytes(io, pages));
+	if (!buf)
+		return -ENOMEM;
+
+	for (size_t i = 0; i != level->parts; ++i)
+		ctree_dump(&level->part[i].ctree, &buf[i]);
+
+	rc = alloc_reserve(alloc, pages, &offs);
+	if (rc < 0) {
+		free(buf);
+		return rc;
+	}
+
+	rc = io_write(io, buf, pages, offs);
+	if (rc < 0) {
+		alloc_cancel(alloc, pages, offs);
+		free(buf);
+		return rc;
+	}
+
+	rc = alloc_commit(alloc, pages, offs);
+	if (rc < 0) {
+		alloc_cancel(alloc, pages, offs);
+		free(buf);
+		return rc;
+	}
+
+	level->ptr.offs = htole64(offs);
+	level->ptr.size = htole64(pages);
+	level->ptr.csum = htole64(crc64(buf, io_bytes(io, pages)));
+	free(buf);
+	return 0;
+}
+
+int level_free_array(struct level *level, struct alloc *alloc)
+{
+	const uint64_t pages = le64toh(level->ptr.size);
+	const uint64_t offs = le64toh(level->ptr.offs);
+
+	memset(&level->ptr, 0, sizeof(level->ptr));
+	if (!pages)
+		return 0;
+	return alloc_free(alloc, pages, offs);
+}
+
+int level_free_parts(struct level *level, struct alloc *alloc,
+			ctree_keep_fn_t keep, void *arg)
+{
+	int rc = 0;
+
+	for (size_t i = 0; i != level->parts; ++i) {
+		const int err = ctree_free(&level->part[i].ctree, alloc, keep,
+					arg);
+
+		if (err < 0 && rc == 0)
+			rc = err;
+	}
+	return rc;
+}
+
+int level_parse(struct level *level, const struct aulsmfs_level *ondisk)
+{
+	struct io *io = level->io;
+	struct aulsmfs_ctree *buf;
+	le64_t parts;
+	int rc;
+
+	level_drop_parts(level);
+
+	/* Teoritically ondisk might be unaligned, thus this mess. */
+	memcpy(&level->ptr, &ondisk->ptr, sizeof(level->ptr));
+	memcpy(&parts, &ondisk->parts, sizeof(parts));
+
+	const size_t count = le64toh(parts);
+	const size_t pages = le64toh(level->ptr.size);
+
+	if (!count)
+		return 0;
+
+	if (io_bytes(io, pages) < count * sizeof(*buf))
+		return -EIO;
+
+	buf = malloc(io_bytes(io, pages));
+	if (!buf)
+		return -ENOMEM;
+
+	rc = io_read(io, buf, pages, le64toh(level->ptr.offs));
+	if (rc < 0)
+		goto out;
+
+	if (crc64(buf, io_bytes(io, pages)) != le64toh(level->ptr.csum)) {
+		rc = -EIO;
+		goto out;
+	}
+
+	rc = level_reserve(level, count);
+	if (rc < 0)
+		goto out;
+
+	for (size_t i = 0; i != count; ++i) {
+		struct level_part *part = &level->part[i];
+
+		level_part_setup(level, part);
+		ctree_parse(&part->ctree, &buf[i]);
+		rc = level_part_load_keys(part);
+		if (rc < 0) {
+			level_part_release(part);
+			goto out;
+		}
+
+		++level->parts;
+		level->pages += part->ctree.pages;
+	}
+
+out:
+	free(buf);
+	return rc;
+}
+
+void level_dump(const struct level *level, struct aulsmfs_level *ondisk)
+{
+	const le64_t parts = htole64(level->parts);
+
+	memcpy(&ondisk->ptr, &level->ptr, sizeof(level->ptr));
+	memcpy(&ondisk->parts, &parts, sizeof(parts));
+}
+
+
+void level_iter_setup(struct level_iter *iter, struct level *level)
+{
+	memset(iter, 0, sizeof(*iter));
+	iter->level = level;
+	iter->from = 0;
+	iter->to = level->parts;
+	iter->part = iter->to;
+}
+
+void level_iter_release(struct level_iter *iter)
+{
+	ctree_iter_release(&iter->iter);
+	memset(iter, 0, sizeof(*iter));
+}
+
+void level_iter_set_range(struct level_iter *iter, size_t from, size_t to)
+{
+	ctree_iter_release(&iter->iter);
+	iter->from = from;
+	iter->to = to;
+	iter->part = to;
+}
+
+/* Partition to means that the iterator doesn't point to any partition, the
+ * ctree iterator is empty in this case. */
+static void level_iter_switch(struct level_iter *iter, size_t part)
+{
+	if (iter->part == part)
+		return;
+
+	ctree_iter_release(&iter->iter);
+	iter->part = part;
+	if (part < iter->to)
+		ctree_iter_setup(&iter->iter, &iter->level->part[part].ctree);
+}
+
+int level_begin(struct level_iter *iter)
+{
+	level_iter_switch(iter, iter->from);
+	if (iter->from == iter->to)
+		return 0;
+	return ctree_begin(&iter->iter);
+}
+
+int level_end(struct level_iter *iter)
+{
+	if (iter->from == iter->to) {
+		level_iter_switch(iter, iter->to);
+		return 0;
+	}
+
+	level_iter_switch(iter, iter->to - 1);
+	return ctree_end(&iter->iter);
+}
+
+/* Moves to the beginning of the next partition once the current one is
+ * over. */
+static int level_next_part(struct level_iter *iter, int rc)
+{
+	if (rc != -ENOENT || iter->part + 1 >= iter->to)
+		return rc;
+
+	level_iter_switch(iter, iter->part + 1);
+	return ctree_begin(&iter->iter);
+}
+
+int level_next(struct level_iter *iter)
+{
+	return level_next_part(iter, ctree_next(&iter->iter));
+}
+
+int level_skip_leaf(struct level_iter *iter)
+{
+	return level_next_part(iter, ctree_skip_leaf(&iter->iter));
+}
+
+int level_prev(struct level_iter *iter)
+{
+	int rc = ctree_prev(&iter->iter);
+
+	if (rc != -ENOENT || iter->part <= iter->from ||
+				iter->part >= iter->to)
+		return rc;
+
+	level_iter_switch(iter, iter->part - 1);
+	rc = ctree_end(&iter->iter);
+	if (rc < 0)
+		return rc;
+	return ctree_prev(&iter->iter);
+}
+
+/* The partition found contains a key not less (or greater) than the key,
+ * so the ctree bound never ends up at the end of the partition. */
+static int __level_bound(struct level_iter *iter, const struct lsm_key *key,
+			int upper)
+{
+	const size_t part = __level_find(iter->level, key, iter->from,
+				iter->to, upper);
+
+	if (part == iter->to)
+		return level_end(iter);
+
+	level_iter_switch(iter, part);
+	if (upper)
+		return ctree_upper_bound(&iter->iter, key);
+	return ctree_lower_bound(&iter->iter, key);
+}
+
+int level_lower_bound(struct level_iter *iter, const struct lsm_key *key)
+{
+	return __level_bound(iter, key, 0);
+}
+
+int level_upper_bound(struct level_iter *iter, const struct lsm_key *key)
+{
+	return __level_bound(iter, key, 1);
+}
+
+int level_lookup(struct level_iter *iter, const struct lsm_key *key)
+{
+	struct lsm_key found;
+	const int rc = level_lower_bound(iter, key);
+
+	if (rc < 0)
+		return rc;
+
+	if (level_key(iter, &found) || iter->level->cmp(&found, key))
+		return 0;
+	return 1;
+}
+
+int level_key(const struct level_iter *iter, struct lsm_key *key)
+{
+	return ctree_key(&iter->iter, key);
+}
+
+int level_val(const struct level_iter *iter, struct lsm_val *val)
+{
+	return ctree_val(&iter->iter, val);
+}
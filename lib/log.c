@@ -7,16 +7,53 @@
 
 #define TRANS_CHUNK_MAX_SIZE	(128 * 1024)
 
+/* Items are checksummed in runs of at least that many bytes, while they
+ * are still in cache. Most items are short and a CRC update shorter than
+ * 64 bytes takes the slow table path, so items aren't checksummed one by
+ * one. */
+#define TRANS_LOG_CRC_RUN	(16 * 1024)
+
 
 void trans_log_setup(struct trans_log *log, struct io *io, struct alloc *alloc)
 {
 	memset(log, 0, sizeof(*log));
 	log->io = io;
 	log->alloc = alloc;
+	crc64_ctx_setup(&log->chunk_crc);
+}
+
+/* Counts the writes complete in order and records the first error. */
+static void trans_log_advance(struct trans_log *log)
+{
+	while (log->written != log->writes) {
+		const struct trans_log_write *write = &log->write[
+					log->written % TRANS_LOG_QUEUE];
+
+		if (!write->complete)
+			break;
+		if (write->req.result < 0 && !log->rc)
+			log->rc = (int)write->req.result;
+		++log->written;
+	}
+}
+
+static int trans_log_wait(struct trans_log *log)
+{
+	int rc = 0;
+
+	if (log->queue.io)
+		rc = io_queue_drain(&log->queue);
+	trans_log_advance(log);
+	return rc;
 }
 
-void trasn_log_release(struct trans_log *log)
+void trans_log_release(struct trans_log *log)
 {
+	trans_log_wait(log);
+	if (log->queue.io)
+		io_queue_release(&log->queue);
+	for (size_t i = 0; i != TRANS_LOG_QUEUE; ++i)
+		free(log->write[i].data);
 	free(log->header);
 	free(log->chunk_data);
 	memset(log, 0, sizeof(*log));
@@ -46,31 +83,105 @@ static int trans_log_reserve_chunk(struct trans_log *log, size_t count)
 	return 0;
 }
 
-static int trans_log_write(struct trans_log *log, const void *data,
-			size_t size, struct aulsmfs_ptr *res)
+static int trans_log_alloc(struct trans_log *log, size_t size,
+			uint64_t csum, struct aulsmfs_ptr *res)
 {
-	struct alloc *alloc = log->alloc;
-	struct io *io = log->io;
-
 	struct aulsmfs_ptr ptr;
 	uint64_t offs;
-	int rc = alloc_reserve(alloc, size, &offs);
+	const int rc = alloc_reserve(log->alloc, size, &offs);
 
 	if (rc < 0)
 		return rc;
 
-	rc = io_write(io, data, size, offs);
-	if (rc < 0) {
-		assert(alloc_cancel(alloc, size, offs) == 0);
-		return rc;
-	}
 	ptr.size = htole64(size);
 	ptr.offs = htole64(offs);
-	ptr.csum = htole64(crc64(data, io_bytes(io, size)));
+	ptr.csum = htole64(csum);
 	memcpy(res, &ptr, sizeof(ptr));
 	return 0;
 }
 
+static int trans_log_write(struct trans_log *log, const void *data,
+			size_t size, uint64_t csum, struct aulsmfs_ptr *res)
+{
+	int rc = trans_log_alloc(log, size, csum, res);
+
+	if (rc < 0)
+		return rc;
+
+	const uint64_t offs = le64toh(res->offs);
+
+	rc = io_write(log->io, data, size, offs);
+	if (rc < 0) {
+		assert(alloc_cancel(log->alloc, size, offs) == 0);
+		return rc;
+	}
+	return 0;
+}
+
+static void trans_log_write_complete(struct io_req *req)
+{
+	struct trans_log_write *write = req->arg;
+
+	write->complete = 1;
+}
+
+/* Takes the buffer of the oldest write for the next chunk, the chunk is
+ * counted in log->chunk once it's submitted, so trans_log_cancel frees its
+ * space even if the write fails. */
+static int trans_log_submit(struct trans_log *log, size_t pages,
+			uint64_t csum)
+{
+	struct trans_log_write *write = &log->write[log->writes %
+				TRANS_LOG_QUEUE];
+	struct io_req *req = &write->req;
+	int rc;
+
+	if (!log->queue.io) {
+		rc = io_queue_setup(&log->queue, log->io, TRANS_LOG_QUEUE);
+		if (rc < 0)
+			return rc;
+	}
+
+	/* Newer writes may complete first, the slot is reused only once
+	 * its own write is done. */
+	while (log->writes - log->written == TRANS_LOG_QUEUE) {
+		rc = io_queue_reap(&log->queue, 1);
+		if (rc < 0)
+			return rc;
+		trans_log_advance(log);
+	}
+
+	if (log->rc)
+		return log->rc;
+
+	rc = trans_log_alloc(log, pages, csum, &log->chunk[log->chunks]);
+	if (rc < 0)
+		return rc;
+
+	void *data = write->data;
+	const size_t max_size = write->max_size;
+
+	write->data = log->chunk_data;
+	write->max_size = log->chunk_max_size;
+	log->chunk_data = data;
+	log->chunk_max_size = max_size;
+
+	io_req_write(req, write->data, pages,
+				le64toh(log->chunk[log->chunks].offs));
+	req->done = &trans_log_write_complete;
+	req->arg = write;
+	write->complete = 0;
+	log->chunks++;
+	log->writes++;
+
+	rc = io_queue_submit(&log->queue, &req, 1);
+	if (rc < 0) {
+		req->result = rc;
+		write->complete = 1;
+	}
+	return rc;
+}
+
 static int trans_log_flush(struct trans_log *log)
 {
 	assert(io_align(log->io, log->chunk_max_size) == log->chunk_max_size);
@@ -88,15 +199,23 @@ static int trans_log_flush(struct trans_log *log)
 	const size_t pages = io_pages(io, log->chunk_size);
 	const size_t bytes = io_bytes(io, pages);
 
+	crc64_ctx_update(&log->chunk_crc, (char *)log->chunk_data +
+				log->chunk_crc_size,
+				log->chunk_size - log->chunk_crc_size);
+
+	/* Zero padding only shifts the CRC, see crc64_combine. */
+	const uint64_t csum = crc64_combine(crc64_ctx_csum(&log->chunk_crc),
+				0, bytes - log->chunk_size);
+
 	memset((char *)log->chunk_data + log->chunk_size, 0,
 				bytes - log->chunk_size);
-	rc = trans_log_write(log, log->chunk_data, pages,
-				&log->chunk[log->chunks]);
+	rc = trans_log_submit(log, pages, csum);
 	if (rc < 0)
 		return rc;
 
 	log->chunk_size = 0;
-	log->chunks++;
+	log->chunk_crc_size = 0;
+	crc64_ctx_setup(&log->chunk_crc);
 	log->pages += pages;
 	return 0;
 }
@@ -147,6 +266,13 @@ int trans_log_append(struct trans_log *log, const struct log_item *item)
 	entry->size = htole16(item->size);
 	memcpy(entry + 1, item->ptr, item->size);
 	log->chunk_size += size;
+
+	if (log->chunk_size - log->chunk_crc_size >= TRANS_LOG_CRC_RUN) {
+		crc64_ctx_update(&log->chunk_crc, (char *)log->chunk_data +
+					log->chunk_crc_size,
+					log->chunk_size - log->chunk_crc_size);
+		log->chunk_crc_size = log->chunk_size;
+	}
 	return 0;
 }
 
@@ -157,6 +283,13 @@ int trans_log_finish(struct trans_log *log)
 	if (rc < 0)
 		return rc;
 
+	/* The header goes after all the chunks it points to. */
+	rc = trans_log_wait(log);
+	if (rc < 0)
+		return rc;
+	if (log->rc)
+		return log->rc;
+
 	const size_t size = sizeof(*log->header) +
 				log->chunks * sizeof(*log->chunk);
 	const size_t pages = io_pages(log->io, size);
@@ -166,11 +299,13 @@ int trans_log_finish(struct trans_log *log)
 	log->header->pages = htole32(log->pages);
 
 	memset((char *)log->header + size, 0, bytes - size);
-	return trans_log_write(log, log->header, pages, &log->ptr);
+	return trans_log_write(log, log->header, pages,
+				crc64(log->header, bytes), &log->ptr);
 }
 
 void trans_log_cancel(struct trans_log *log)
 {
+	trans_log_wait(log);
 	for (size_t i = 0; i != log->chunks; ++i) {
 		const struct aulsmfs_ptr *ptr = &log->chunk[i];
 		const uint64_t offs = le64toh(ptr->offs);
@@ -1,66 +1,758 @@
 #include <lsm.h>
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 
-void lsm_setup(struct lsm *lsm, struct io *io, struct alloc *alloc,
+static struct lsm *lsm_from_alloc(struct alloc *alloc)
+{
+	return (struct lsm *)((char *)alloc - offsetof(struct lsm,
+				merge_alloc));
+}
+
+static int lsm_alloc_reserve(struct alloc *alloc, uint64_t size,
+			uint64_t *offs)
+{
+	struct lsm *lsm = lsm_from_alloc(alloc);
+	int rc;
+
+	pthread_mutex_lock(&lsm->alloc_mtx);
+	rc = alloc_reserve(lsm->alloc, size, offs);
+	pthread_mutex_unlock(&lsm->alloc_mtx);
+	return rc;
+}
+
+static int lsm_alloc_cancel(struct alloc *alloc, uint64_t size,
+			uint64_t offs)
+{
+	struct lsm *lsm = lsm_from_alloc(alloc);
+	int rc;
+
+	pthread_mutex_lock(&lsm->alloc_mtx);
+	rc = alloc_cancel(lsm->alloc, size, offs);
+	pthread_mutex_unlock(&lsm->alloc_mtx);
+	return rc;
+}
+
+static int lsm_alloc_commit(struct alloc *alloc, uint64_t size,
+			uint64_t offs)
+{
+	struct lsm *lsm = lsm_from_alloc(alloc);
+	int rc;
+
+	pthread_mutex_lock(&lsm->alloc_mtx);
+	rc = alloc_commit(lsm->alloc, size, offs);
+	pthread_mutex_unlock(&lsm->alloc_mtx);
+	return rc;
+}
+
+static int lsm_alloc_free(struct alloc *alloc, uint64_t size, uint64_t offs)
+{
+	struct lsm *lsm = lsm_from_alloc(alloc);
+	int rc;
+
+	pthread_mutex_lock(&lsm->alloc_mtx);
+	rc = alloc_free(lsm->alloc, size, offs);
+	pthread_mutex_unlock(&lsm->alloc_mtx);
+	return rc;
+}
+
+static struct alloc_ops lsm_alloc_ops = {
+	.reserve = &lsm_alloc_reserve,
+	.cancel = &lsm_alloc_cancel,
+	.commit = &lsm_alloc_commit,
+	.free = &lsm_alloc_free,
+};
+
+static struct mtree *lsm_mtree_create(struct lsm *lsm)
+{
+	struct mtree *tree = malloc(sizeof(*tree));
+
+	if (!tree)
+		return NULL;
+
+	mtree_setup(tree, lsm->cmp);
+	mtree_set_type(tree, lsm->mtree_type);
+	return tree;
+}
+
+static void lsm_mtree_destroy(struct lsm *lsm, struct mtree *tree)
+{
+	if (tree == &lsm->empty)
+		return;
+
+	mtree_release(tree);
+	free(tree);
+}
+
+static int lsm_offs_cmp(const void *l, const void *r)
+{
+	const uint64_t loffs = *(const uint64_t *)l;
+	const uint64_t roffs = *(const uint64_t *)r;
+
+	if (loffs != roffs)
+		return loffs < roffs ? -1 : 1;
+	return 0;
+}
+
+struct lsm_leaves {
+	const uint64_t *offs;
+	size_t count;
+};
+
+static int lsm_leaf_reused(void *arg, uint64_t offs)
+{
+	const struct lsm_leaves *leaves = arg;
+
+	return bsearch(&offs, leaves->offs, leaves->count, sizeof(offs),
+				&lsm_offs_cmp) ? 1 : 0;
+}
+
+/* Releases partitions nobody can reach and frees their pages, but leaves
+ * reused by the output of the merge that dropped them. Every leaf belongs
+ * to a single live tree, so that's all we have to check. If we fail to
+ * read some nodes there is nobody to report to, the pages under those
+ * nodes just leak. */
+static void lsm_free_parts(struct lsm *lsm, struct level *level,
+			uint64_t *reused, size_t count)
+{
+	struct lsm_leaves leaves = { .offs = reused, .count = count };
+
+	qsort(reused, count, sizeof(*reused), &lsm_offs_cmp);
+	level_free_parts(level, &lsm->merge_alloc, &lsm_leaf_reused, &leaves);
+	level_release(level);
+}
+
+static void lsm_state_destroy(struct lsm *lsm, struct lsm_state *state)
+{
+	for (int i = 0; i != AULSMFS_MAX_DISK_TREES; ++i)
+		level_forget(&state->ci[i]);
+
+	lsm_free_parts(lsm, &state->drop, state->reused,
+				state->reused_leaves);
+	free(state->reused);
+	if (state->drop_mtree)
+		lsm_mtree_destroy(lsm, state->drop_mtree);
+	free(state);
+}
+
+/* Creates a state of the current trees, the caller must hold state_mtx
+ * unless nobody else uses the lsm yet. */
+static struct lsm_state *lsm_state_create(struct lsm *lsm)
+{
+	struct lsm_state *state = calloc(1, sizeof(*state));
+
+	if (!state)
+		return NULL;
+
+	state->c0 = lsm->c0;
+	state->c1 = lsm->c1;
+	state->levels = lsm->levels;
+	level_setup(&state->drop, lsm->io, lsm->cmp);
+
+	for (int i = 0; i != AULSMFS_MAX_DISK_TREES; ++i) {
+		const struct level *level = &lsm->ci[i];
+
+		level_setup(&state->ci[i], lsm->io, lsm->cmp);
+		if (level_share(&state->ci[i], level, 0, level->parts) < 0) {
+			lsm_state_destroy(lsm, state);
+			return NULL;
+		}
+	}
+	return state;
+}
+
+/* Publishes the current trees as a new state. drop_mtree and drop are what
+ * the previous state has and the new one doesn't, they go away with the
+ * previous state. If the merge that dropped partitions reused some of
+ * their leaves, policy gives them. The caller holds state_mtx, if we fail
+ * nothing changes and drop stays with the caller. */
+static int lsm_publish(struct lsm *lsm, struct mtree *drop_mtree,
+			struct level *drop, struct lsm_merge_policy *policy)
+{
+	struct lsm_state *prev = lsm->state;
+	struct lsm_state *state = lsm_state_create(lsm);
+
+	if (!state)
+		return -ENOMEM;
+
+	prev->drop_mtree = drop_mtree;
+	if (drop)
+		level_swap(&prev->drop, drop);
+	if (policy) {
+		prev->reused = policy->reused;
+		prev->reused_leaves = policy->reused_leaves;
+		policy->reused = NULL;
+		policy->reused_leaves = 0;
+		policy->max_reused = 0;
+	}
+	prev->next = state;
+	lsm->state = state;
+	return 0;
+}
+
+static struct lsm_state *lsm_state_get(struct lsm *lsm)
+{
+	struct lsm_state *state;
+
+	pthread_mutex_lock(&lsm->state_mtx);
+	state = lsm->state;
+	++state->refs;
+	pthread_mutex_unlock(&lsm->state_mtx);
+	return state;
+}
+
+/* Drops a reference to the state if given and destroys states that are
+ * neither current nor used. They go in the order they were published,
+ * since what a state drops may still be used by older states. */
+static void lsm_state_put(struct lsm *lsm, struct lsm_state *state)
+{
+	struct lsm_state *first, *last;
+
+	pthread_mutex_lock(&lsm->state_mtx);
+	if (state)
+		--state->refs;
+
+	first = lsm->oldest;
+	while (lsm->oldest != lsm->state && !lsm->oldest->refs)
+		lsm->oldest = lsm->oldest->next;
+	last = lsm->oldest;
+	pthread_mutex_unlock(&lsm->state_mtx);
+
+	while (first != last) {
+		struct lsm_state *next = first->next;
+
+		lsm_state_destroy(lsm, first);
+		first = next;
+	}
+}
+
+/* Publishes a new state after a change of disk levels that doesn't drop
+ * anything. */
+static int lsm_update_state(struct lsm *lsm)
+{
+	int rc;
+
+	pthread_mutex_lock(&lsm->state_mtx);
+	rc = lsm_publish(lsm, NULL, NULL, NULL);
+	pthread_mutex_unlock(&lsm->state_mtx);
+	lsm_state_put(lsm, NULL);
+	return rc;
+}
+
+int lsm_setup(struct lsm *lsm, struct io *io, struct alloc *alloc,
 		int (*cmp)(const struct lsm_key *, const struct lsm_key *))
 {
+	pthread_rwlockattr_t attr;
+
 	memset(lsm, 0, sizeof(*lsm));
 	lsm->io = io;
 	lsm->alloc = alloc;
 	lsm->cmp = cmp;
 
-	mtree_setup(&lsm->c0, cmp);
-	mtree_setup(&lsm->c1, cmp);
-
 	for (int i = 0; i != AULSMFS_MAX_DISK_TREES; ++i)
-		ctree_setup(&lsm->ci[i], io, cmp);
+		level_setup(&lsm->ci[i], io, cmp);
+	lsm->levels = AULSMFS_DEFAULT_DISK_TREES;
+	lsm->level_ratio = 10;
+	lsm->merge_threads = 1;
+	lsm->merge_alloc.ops = &lsm_alloc_ops;
+
+	mtree_setup(&lsm->empty, cmp);
+	lsm->mtree_type = MTREE_RBTREE;
+	lsm->c1 = &lsm->empty;
+	lsm->c0 = lsm_mtree_create(lsm);
+	if (!lsm->c0) {
+		mtree_release(&lsm->empty);
+		return -ENOMEM;
+	}
+
+	lsm->state = lsm_state_create(lsm);
+	if (!lsm->state) {
+		lsm_mtree_destroy(lsm, lsm->c0);
+		mtree_release(&lsm->empty);
+		return -ENOMEM;
+	}
+	lsm->oldest = lsm->state;
+
+	pthread_mutex_init(&lsm->alloc_mtx, NULL);
+	pthread_mutex_init(&lsm->state_mtx, NULL);
+
+	/* Adds and iterator steps come and go all the time, the c0 swap
+	 * waiting for the lock must not starve behind them. */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+				PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&lsm->add_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	pthread_mutex_init(&lsm->merge_mtx, NULL);
+	pthread_mutex_init(&lsm->mtx, NULL);
+	pthread_cond_init(&lsm->cond, NULL);
+	return 0;
 }
 
 void lsm_release(struct lsm *lsm)
 {
-	for (int i = 0; i != AULSMFS_MAX_DISK_TREES; ++i)
-		ctree_release(&lsm->ci[i]);
+	lsm_stop_merger(lsm);
+
+	while (lsm->oldest) {
+		struct lsm_state *next = lsm->oldest->next;
 
-	mtree_release(&lsm->c1);
-	mtree_release(&lsm->c0);
+		assert(!lsm->oldest->refs);
+		lsm_state_destroy(lsm, lsm->oldest);
+		lsm->oldest = next;
+	}
+
+	for (int i = 0; i != AULSMFS_MAX_DISK_TREES; ++i)
+		level_release(&lsm->ci[i]);
+
+	lsm_mtree_destroy(lsm, lsm->c1);
+	lsm_mtree_destroy(lsm, lsm->c0);
+	mtree_release(&lsm->empty);
+
+	pthread_cond_destroy(&lsm->cond);
+	pthread_mutex_destroy(&lsm->mtx);
+	pthread_mutex_destroy(&lsm->merge_mtx);
+	pthread_rwlock_destroy(&lsm->add_lock);
+	pthread_mutex_destroy(&lsm->state_mtx);
+	pthread_mutex_destroy(&lsm->alloc_mtx);
 	memset(lsm, 0, sizeof(*lsm));
 }
 
-void lsm_parse(struct lsm *lsm, const struct aulsmfs_tree *ondisk)
+void lsm_set_cache(struct lsm *lsm, struct ctree_cache *cache)
+{
+	for (int i = 0; i != AULSMFS_MAX_DISK_TREES; ++i)
+		level_set_cache(&lsm->ci[i], cache);
+}
+
+void lsm_set_pin_interior(struct lsm *lsm, int pin)
 {
 	for (int i = 0; i != AULSMFS_MAX_DISK_TREES; ++i)
-		ctree_parse(&lsm->ci[i], &ondisk->ci[i]);
+		level_set_pin_interior(&lsm->ci[i], pin);
+}
+
+void lsm_set_readahead(struct lsm *lsm, size_t leaves)
+{
+	for (int i = 0; i != AULSMFS_MAX_DISK_TREES; ++i)
+		level_set_readahead(&lsm->ci[i], leaves);
+}
+
+void lsm_set_bloom_bits(struct lsm *lsm, size_t bits_per_key)
+{
+	lsm->bloom_bits = bits_per_key;
+}
+
+int lsm_set_mtree_type(struct lsm *lsm, enum mtree_type type)
+{
+	if (!mtree_is_empty(lsm->c0) || !mtree_is_empty(lsm->c1))
+		return -EBUSY;
+
+	mtree_set_type(lsm->c0, type);
+	mtree_set_type(&lsm->empty, type);
+	lsm->mtree_type = type;
+	return 0;
+}
+
+int lsm_set_levels(struct lsm *lsm, int levels)
+{
+	if (levels < 1 || levels > AULSMFS_MAX_DISK_TREES)
+		return -EINVAL;
+
+	const int old = lsm->levels;
+
+	for (int i = levels; i < lsm->levels; ++i) {
+		if (!level_is_empty(&lsm->ci[i]))
+			return -EBUSY;
+	}
+
+	lsm->levels = levels;
+	const int rc = lsm_update_state(lsm);
+
+	if (rc < 0)
+		lsm->levels = old;
+	return rc;
+}
+
+void lsm_set_compaction(struct lsm *lsm, size_t part_pages,
+			size_t level_pages, size_t level_ratio)
+{
+	lsm->part_pages = part_pages;
+	lsm->level_pages = level_pages;
+	lsm->level_ratio = level_ratio;
+}
+
+void lsm_set_merge_threads(struct lsm *lsm, int threads)
+{
+	lsm->merge_threads = threads > 0 ? threads : 1;
+}
+
+void lsm_set_write_queue(struct lsm *lsm, size_t nodes)
+{
+	lsm->write_queue = nodes;
+}
+
+void lsm_set_compression(struct lsm *lsm, size_t leaf_pages)
+{
+	lsm->compress_pages = leaf_pages;
+}
+
+void lsm_set_fence_index(struct lsm *lsm, int fence)
+{
+	lsm->fence_index = fence;
+}
+
+int lsm_parse(struct lsm *lsm, const struct aulsmfs_tree *ondisk)
+{
+	for (int i = 0; i != AULSMFS_MAX_DISK_TREES; ++i) {
+		const int rc = level_parse(&lsm->ci[i], &ondisk->ci[i]);
+
+		if (rc < 0)
+			return rc;
+	}
+	return lsm_update_state(lsm);
 }
 
 void lsm_dump(const struct lsm *lsm, struct aulsmfs_tree *ondisk)
 {
 	for (int i = 0; i != AULSMFS_MAX_DISK_TREES; ++i)
-		ctree_dump(&lsm->ci[i], &ondisk->ci[i]);
+		level_dump(&lsm->ci[i], &ondisk->ci[i]);
+}
+
+static size_t lsm_c0_bytes(struct lsm *lsm)
+{
+	return __atomic_load_n(&lsm->c0_bytes, __ATOMIC_RELAXED);
+}
+
+/* Moves c0 into c1 and publishes a new state with an empty c0, the caller
+ * must have claimed c1. If the last merge failed c1 isn't empty, then we
+ * keep c0 and merge c1 again. */
+static int lsm_swap_c0(struct lsm *lsm)
+{
+	struct mtree *c1 = lsm->c1;
+	struct mtree *c0;
+	int rc;
+
+	if (!mtree_is_empty(lsm->c1))
+		return 0;
+
+	c0 = lsm_mtree_create(lsm);
+	if (!c0)
+		return -ENOMEM;
+
+	pthread_rwlock_wrlock(&lsm->add_lock);
+	pthread_mutex_lock(&lsm->state_mtx);
+	lsm->c1 = lsm->c0;
+	lsm->c0 = c0;
+	rc = lsm_publish(lsm, c1, NULL, NULL);
+	if (rc < 0) {
+		lsm->c0 = lsm->c1;
+		lsm->c1 = c1;
+	} else {
+		__atomic_store_n(&lsm->c0_bytes, 0, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&lsm->state_mtx);
+	pthread_rwlock_unlock(&lsm->add_lock);
+
+	if (rc < 0)
+		lsm_mtree_destroy(lsm, c0);
+	else
+		lsm_state_put(lsm, NULL);
+	return rc;
+}
+
+/* Hands c0 over to the merger once it takes threshold bytes. Until c0
+ * takes twice that we don't wait: if c1 is still being merged we will try
+ * again with the next lsm_add. Past that the writer waits for the merge,
+ * so c0 stays bounded. The merge never waits for iterators, so the writer
+ * may hold any of them. */
+static int lsm_kick_merger(struct lsm *lsm)
+{
+	const size_t limit = 2 * lsm->merge_threshold;
+	int rc = 0;
+
+	pthread_mutex_lock(&lsm->mtx);
+	while (lsm->merging && lsm_c0_bytes(lsm) >= limit)
+		pthread_cond_wait(&lsm->cond, &lsm->mtx);
+
+	if (lsm->merge_rc) {
+		rc = lsm->merge_rc;
+		lsm->merge_rc = 0;
+	}
+
+	if (lsm->merging || lsm_c0_bytes(lsm) < lsm->merge_threshold) {
+		pthread_mutex_unlock(&lsm->mtx);
+		return rc;
+	}
+
+	/* Claim c1, so that we don't hold mtx while we wait for add_lock. */
+	lsm->merging = 1;
+	pthread_mutex_unlock(&lsm->mtx);
+
+	const int err = lsm_swap_c0(lsm);
+
+	pthread_mutex_lock(&lsm->mtx);
+	if (err == 0)
+		lsm->merge_pending = 1;
+	else
+		lsm->merging = 0;
+	pthread_cond_broadcast(&lsm->cond);
+	pthread_mutex_unlock(&lsm->mtx);
+	return err < 0 ? err : rc;
 }
 
 int lsm_add(struct lsm *lsm, const struct lsm_key *key,
 			const struct lsm_val *val)
 {
-	return mtree_add(&lsm->c0, key, val);
+	int rc;
+
+	if (lsm->merger_running && lsm_c0_bytes(lsm) >= lsm->merge_threshold) {
+		rc = lsm_kick_merger(lsm);
+		if (rc < 0)
+			return rc;
+	}
+
+	/* Only skiplist c0 takes concurrent inserts. */
+	if (lsm->mtree_type == MTREE_SKIPLIST)
+		pthread_rwlock_rdlock(&lsm->add_lock);
+	else
+		pthread_rwlock_wrlock(&lsm->add_lock);
+
+	rc = mtree_add(lsm->c0, key, val);
+
+	/* c0 grows by whole slabs, so the copy rarely changes. */
+	const size_t bytes = __atomic_load_n(&lsm->c0->bytes,
+				__ATOMIC_RELAXED);
+
+	if (bytes != lsm_c0_bytes(lsm))
+		__atomic_store_n(&lsm->c0_bytes, bytes, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&lsm->add_lock);
+	return rc;
+}
+
+static int lsm_copy_key(struct lsm_key *copy, size_t *cap,
+			const struct lsm_key *key)
+{
+	if (key->size > *cap) {
+		void *ptr = realloc(copy->ptr, key->size);
+
+		if (!ptr)
+			return -ENOMEM;
+		copy->ptr = ptr;
+		*cap = key->size;
+	}
+
+	memcpy(copy->ptr, key->ptr, key->size);
+	copy->size = key->size;
+	return 0;
+}
+
+static void lsm_merge_builder_setup(struct lsm_merge_policy *policy)
+{
+	struct lsm *lsm = policy->lsm;
+
+	ctree_builder_setup(&policy->builder, lsm->io, &lsm->merge_alloc);
+	policy->builder.bloom_bits = lsm->bloom_bits;
+	policy->builder.write_queue = lsm->write_queue;
+	policy->builder.fence_index = lsm->fence_index;
+	if (lsm->compress_pages) {
+		policy->builder.leaf_pages = lsm->compress_pages;
+		policy->builder.compress = 1;
+	}
+	policy->appended = 0;
+}
+
+/* Finishes the current partition and adds it to the output. Build
+ * functions that don't use lsm_merge_append get a single partition and
+ * its first and last keys are read back from the disk. */
+static int lsm_merge_cut(struct lsm_merge_policy *policy)
+{
+	struct ctree_builder *builder = &policy->builder;
+	const int keys = policy->appended ? 1 : 0;
+	int rc = ctree_builder_finish(builder);
+
+	if (rc < 0)
+		return rc;
+
+	rc = ctree_builder_commit(builder);
+	if (rc < 0)
+		return rc;
+
+	rc = level_append(&policy->out, builder, keys ? &policy->first : NULL,
+				keys ? &policy->last : NULL);
+	if (rc < 0)
+		return rc;
+
+	__atomic_fetch_add(&policy->lsm->merge_pages,
+				builder->pages - builder->reused_pages,
+				__ATOMIC_RELAXED);
+	ctree_builder_release(builder);
+	lsm_merge_builder_setup(policy);
+	return 0;
+}
+
+/* Range builders of parallel merges only write leaves and are never cut,
+ * the output is cut when their leaves are stitched together. */
+static int lsm_merge_full(const struct lsm_merge_policy *policy)
+{
+	const struct lsm *lsm = policy->lsm;
+
+	return lsm->part_pages && !policy->builder.leaves_only &&
+				policy->builder.pages >= lsm->part_pages;
+}
+
+int lsm_merge_append(struct lsm_merge_policy *policy,
+			const struct lsm_key *key, const struct lsm_val *val)
+{
+	int rc;
+
+	if (!policy->appended) {
+		rc = lsm_copy_key(&policy->first, &policy->first_cap, key);
+		if (rc < 0)
+			return rc;
+	}
+
+	rc = ctree_builder_append(&policy->builder, key, val);
+	if (rc < 0)
+		return rc;
+
+	rc = lsm_copy_key(&policy->last, &policy->last_cap, key);
+	if (rc < 0)
+		return rc;
+	++policy->appended;
+
+	if (lsm_merge_full(policy))
+		return lsm_merge_cut(policy);
+	return 0;
+}
+
+static int lsm_skip_leaf(struct lsm_iter *iter);
+
+/* Makes room for count more reused leaves. */
+static int lsm_merge_add_reused(struct lsm_merge_policy *policy,
+			size_t count)
+{
+	const size_t need = policy->reused_leaves + count;
+
+	if (need <= policy->max_reused)
+		return 0;
+
+	const size_t max = policy->max_reused * 2 < need
+				? need : policy->max_reused * 2;
+	uint64_t *reused = realloc(policy->reused, max * sizeof(*reused));
+
+	if (!reused)
+		return -ENOMEM;
+
+	policy->reused = reused;
+	policy->max_reused = max;
+	return 0;
+}
+
+static int lsm_merge_append_leaf(struct lsm_merge_policy *policy,
+			const struct ctree_iter *leaf, size_t items)
+{
+	struct lsm_key key;
+	int rc;
+
+	if (!policy->appended) {
+		ctree_iter_leaf_item(leaf, 0, &key, NULL);
+		rc = lsm_copy_key(&policy->first, &policy->first_cap, &key);
+		if (rc < 0)
+			return rc;
+	}
+
+	rc = lsm_merge_add_reused(policy, 1);
+	if (rc < 0)
+		return rc;
+
+	rc = ctree_builder_append_leaf(&policy->builder, leaf);
+	if (rc < 0)
+		return rc;
+	policy->reused[policy->reused_leaves++] = ctree_iter_leaf_offs(leaf);
+
+	ctree_iter_leaf_item(leaf, items - 1, &key, NULL);
+	rc = lsm_copy_key(&policy->last, &policy->last_cap, &key);
+	if (rc < 0)
+		return rc;
+	policy->appended += items;
+
+	if (lsm_merge_full(policy))
+		return lsm_merge_cut(policy);
+	return 0;
+}
+
+/* If the current item starts a leaf of a disk tree and no other source has
+ * keys up to the end of the leaf, the merge output would contain exactly
+ * the same leaf, so we reuse it instead of rewriting. Returns 1 if the
+ * leaf was reused and the iterator moved past it. */
+static int lsm_merge_reuse_leaf(struct lsm_merge_policy *policy)
+{
+	struct lsm *lsm = policy->lsm;
+	struct lsm_iter *iter = &policy->iter;
+	const int cur = iter->cur;
+
+	if (cur < 2 || !iter->heap_valid || iter->heap[0] != cur)
+		return 0;
+
+	const struct ctree_iter *leaf = &iter->iti[cur - 2].iter;
+	const size_t items = ctree_iter_leaf_items(leaf);
+	struct lsm_key key;
+	struct lsm_val val;
+
+	if (!items)
+		return 0;
+
+	/* The smallest key among other sources is in a child of the top. */
+	ctree_iter_leaf_item(leaf, items - 1, &key, NULL);
+	if (policy->end && lsm->cmp(&key, policy->end) >= 0)
+		return 0;
+
+	for (int i = 1; i <= 2 && i < iter->heap_size; ++i) {
+		if (lsm->cmp(&iter->keyi[iter->heap[i]], &key) <= 0)
+			return 0;
+	}
+
+	for (size_t i = 0; policy->drop_deleted && i != items; ++i) {
+		ctree_iter_leaf_item(leaf, i, &key, &val);
+		if (policy->deleted(policy, &key, &val))
+			return 0;
+	}
+
+	int rc = lsm_merge_append_leaf(policy, leaf, items);
+
+	if (rc < 0)
+		return rc;
+
+	rc = lsm_skip_leaf(iter);
+	if (rc < 0)
+		return rc;
+	return 1;
 }
 
 static int lsm_build_default(struct lsm_merge_policy *policy)
 {
 	const int drop = policy->drop_deleted;
 
+	struct lsm *lsm = policy->lsm;
 	struct lsm_iter *iter = &policy->iter;
-	struct ctree_builder *builder = &policy->builder;
 
 	while (lsm_has_item(iter)) {
+		if (policy->end && lsm->cmp(&iter->key, policy->end) >= 0)
+			break;
+
+		int rc = lsm_merge_reuse_leaf(policy);
+
+		if (rc < 0)
+			return rc;
+		if (rc)
+			continue;
+
 		const struct lsm_key key = iter->key;
 		const struct lsm_val val = iter->val;
-		int rc;
 
 		if (!drop || !policy->deleted(policy, &key, &val)) {
-			rc = ctree_builder_append(builder, &key, &val);
+			rc = lsm_merge_append(policy, &key, &val);
 			if (rc < 0)
 				return rc;
 		}
@@ -74,9 +766,13 @@ static int lsm_build_default(struct lsm_merge_policy *policy)
 
 static int lsm_call_build(struct lsm_merge_policy *policy)
 {
-	struct ctree_builder *builder = &policy->builder;
 	struct lsm_iter *iter = &policy->iter;
-	int rc = lsm_begin(iter);
+	int rc;
+
+	if (policy->begin)
+		rc = lsm_lower_bound(iter, policy->begin);
+	else
+		rc = lsm_begin(iter);
 
 	if (rc < 0)
 		return rc;
@@ -85,78 +781,631 @@ static int lsm_call_build(struct lsm_merge_policy *policy)
 	if (rc < 0)
 		return rc;
 
-	return ctree_builder_finish(builder);
+	if (policy->builder.leaves_only)
+		return ctree_builder_finish(&policy->builder);
+	return lsm_merge_cut(policy);
 }
 
 static int lsm_drop_deleted(struct lsm_merge_policy *policy)
 {
 	struct lsm *lsm = policy->lsm;
 	const int from = policy->tree + 2;
-	const int to = AULSMFS_MAX_DISK_TREES + 2;
+	const int to = lsm->levels + 2;
 
 	for (int i = from; i < to; ++i) {
-		if (!ctree_is_empty(&lsm->ci[i - 2]))
+		if (!level_is_empty(&lsm->ci[i - 2]))
 			return 0;
 	}
 	return 1;
 }
 
-static int __lsm_merge(struct lsm_merge_policy *policy)
+/* Finds the key range of the merge source, returns 0 if the source is
+ * empty. */
+static int lsm_merge_source(struct lsm_merge_policy *policy,
+			struct lsm_key *lo, struct lsm_key *hi)
+{
+	struct lsm *lsm = policy->lsm;
+
+	if (policy->tree == 1) {
+		struct mtree_iter iter;
+		int rc = 1;
+
+		mtree_iter_setup(&iter, lsm->c1);
+		mtree_begin(&iter);
+		if (mtree_key(&iter, lo))
+			rc = 0;
+		mtree_end(&iter);
+		if (rc && (mtree_prev(&iter) || mtree_key(&iter, hi)))
+			rc = 0;
+		mtree_iter_release(&iter);
+		return rc;
+	}
+
+	const struct level *src = &lsm->ci[policy->tree - 2];
+
+	if (policy->part_from == policy->part_to)
+		return 0;
+
+	*lo = src->part[policy->part_from].first;
+	*hi = src->part[policy->part_to - 1].last;
+	return 1;
+}
+
+/* Prepares new states of the source and destination levels and writes
+ * their partition arrays, then installs them and publishes a new state.
+ * Partitions [pb, pe) of the destination were rewritten into the output.
+ * If moved is set the source partitions were moved into the output as
+ * is. Replaced partitions and the merged c1 are released once iterators
+ * that may use them are gone. */
+static int lsm_merge_publish(struct lsm_merge_policy *policy, size_t pb,
+			size_t pe, int moved)
+{
+	struct lsm *lsm = policy->lsm;
+	struct level *dst = &lsm->ci[policy->tree - 1];
+	struct level *src = policy->tree >= 2
+				? &lsm->ci[policy->tree - 2] : NULL;
+	struct level next_dst, next_src, drop;
+	/* Only tree 1 merges use it, and they own c1. */
+	struct mtree *c1 = lsm->c1;
+	int rc, err;
+
+	level_setup(&next_dst, lsm->io, lsm->cmp);
+	level_setup(&next_src, lsm->io, lsm->cmp);
+	level_setup(&drop, lsm->io, lsm->cmp);
+
+	if ((rc = level_share(&next_dst, dst, 0, pb)) < 0 ||
+		(rc = level_share(&next_dst, &policy->out, 0,
+					policy->out.parts)) < 0 ||
+		(rc = level_share(&next_dst, dst, pe, dst->parts)) < 0 ||
+		(rc = level_share(&drop, dst, pb, pe)) < 0 ||
+		(rc = level_write(&next_dst, &lsm->merge_alloc)) < 0)
+		goto out;
+
+	if (src) {
+		if ((rc = level_share(&next_src, src, 0,
+					policy->part_from)) < 0 ||
+			(rc = level_share(&next_src, src, policy->part_to,
+					src->parts)) < 0 ||
+			(!moved && (rc = level_share(&drop, src,
+					policy->part_from,
+					policy->part_to)) < 0) ||
+			(rc = level_write(&next_src, &lsm->merge_alloc)) < 0)
+			goto out;
+	}
+
+	pthread_mutex_lock(&lsm->state_mtx);
+	level_replace(dst, &next_dst);
+	if (src)
+		level_replace(src, &next_src);
+	else
+		lsm->c1 = &lsm->empty;
+
+	rc = lsm_publish(lsm, src ? NULL : c1, &drop, policy);
+	if (rc < 0) {
+		if (src)
+			level_replace(src, &next_src);
+		else
+			lsm->c1 = c1;
+		level_replace(dst, &next_dst);
+	} else {
+		/* Partitions next to the merged ones go down next time. */
+		if (src)
+			src->cursor = policy->part_from;
+		level_forget(&policy->out);
+	}
+	pthread_mutex_unlock(&lsm->state_mtx);
+	lsm_state_put(lsm, NULL);
+
+out:
+	/* Old arrays once installed, new ones if we failed. */
+	err = level_free_array(&next_src, &lsm->merge_alloc);
+	if (err < 0 && rc == 0)
+		rc = err;
+	err = level_free_array(&next_dst, &lsm->merge_alloc);
+	if (err < 0 && rc == 0)
+		rc = err;
+	level_forget(&next_src);
+	level_forget(&next_dst);
+	level_forget(&drop);
+	return rc;
+}
+
+/* Builds the merge output bounded by policy->begin and policy->end into
+ * policy->out, only partitions [pb, pe) of the destination take part. If
+ * leaves_only is set only leaves are written and they stay in the builder
+ * of the policy, see lsm_merge_stitch. */
+static int lsm_merge_build(struct lsm_merge_policy *policy, size_t pb,
+			size_t pe, int leaves_only)
 {
 	struct lsm *lsm = policy->lsm;
 	struct lsm_iter *iter = &policy->iter;
-	struct ctree_builder *builder = &policy->builder;
 
 	const int from = policy->tree;
 	const int to = policy->tree + 1;
 	int rc;
 
-	policy->drop_deleted = lsm_drop_deleted(policy);
-	ctree_builder_setup(builder, lsm->io, lsm->alloc);
+	lsm_merge_builder_setup(policy);
+	policy->builder.leaves_only = leaves_only;
 	lsm_iter_setup(iter, lsm);
 	iter->from = from;
 	iter->to = to;
+	iter->zero_copy = 1;
+	level_iter_set_range(&iter->iti[to - 2], pb, pe);
+	if (from >= 2)
+		level_iter_set_range(&iter->iti[from - 2], policy->part_from,
+					policy->part_to);
 
 	rc = lsm_call_build(policy);
 	lsm_iter_release(iter);
-	if (rc < 0) {
-		ctree_builder_cancel(builder);
-		ctree_builder_release(builder);
+	if (rc < 0)
+		ctree_builder_cancel(&policy->builder);
+	if (rc < 0 || !leaves_only)
+		ctree_builder_release(&policy->builder);
+	return rc;
+}
+
+struct lsm_split {
+	struct lsm_key *key;
+	size_t keys;
+	size_t max_keys;
+};
+
+static int lsm_split_add(void *arg, const struct lsm_key *key)
+{
+	struct lsm_split *split = arg;
+	size_t cap = 0;
+
+	if (split->keys == split->max_keys) {
+		const size_t keys = split->max_keys
+					? split->max_keys * 2 : 64;
+		struct lsm_key *new = realloc(split->key,
+					keys * sizeof(*new));
+
+		if (!new)
+			return -ENOMEM;
+		split->key = new;
+		split->max_keys = keys;
+	}
+
+	struct lsm_key *copy = &split->key[split->keys];
+
+	memset(copy, 0, sizeof(*copy));
+	const int rc = lsm_copy_key(copy, &cap, key);
+
+	if (rc < 0)
 		return rc;
+	++split->keys;
+	return 0;
+}
+
+static void lsm_split_release(struct lsm_split *split)
+{
+	for (size_t i = 0; i != split->keys; ++i)
+		free(split->key[i].ptr);
+	free(split->key);
+	memset(split, 0, sizeof(*split));
+}
+
+struct lsm_merge_range {
+	struct lsm_merge_policy policy;
+	size_t pb;
+	size_t pe;
+	pthread_t thread;
+	int running;
+	int rc;
+};
+
+static void *lsm_merge_range_build(void *arg)
+{
+	struct lsm_merge_range *range = arg;
+
+	range->rc = lsm_merge_build(&range->policy, range->pb, range->pe, 1);
+	return NULL;
+}
+
+/* Moves the leaves written for a range into the merge output, cutting it
+ * into partitions like lsm_merge_append does. */
+static int lsm_merge_stitch(struct lsm_merge_policy *policy,
+			struct ctree_builder *from)
+{
+	while (from->moved != from->leaves) {
+		const size_t items = from->leaf[from->moved].items;
+		struct lsm_key first, last;
+		int rc;
+
+		ctree_builder_leaf_keys(from, from->moved, &first, &last);
+		if (!policy->appended) {
+			rc = lsm_copy_key(&policy->first, &policy->first_cap,
+						&first);
+			if (rc < 0)
+				return rc;
+		}
+
+		rc = ctree_builder_move_leaf(&policy->builder, from);
+		if (rc < 0)
+			return rc;
+
+		rc = lsm_copy_key(&policy->last, &policy->last_cap, &last);
+		if (rc < 0)
+			return rc;
+		policy->appended += items;
+
+		if (lsm_merge_full(policy)) {
+			rc = lsm_merge_cut(policy);
+			if (rc < 0)
+				return rc;
+		}
 	}
+	return 0;
+}
+
+/* Splits the key range of the merge using separators from interior nodes
+ * of the largest disk source and writes leaves of every range in its own
+ * thread. Then leaves of all the ranges are stitched in key order into one
+ * output, so interior nodes, Bloom filters and partition cuts are built
+ * once as if a single thread did the merge. Custom build functions always
+ * run in a single thread. */
+static int lsm_merge_build_parallel(struct lsm_merge_policy *policy,
+			size_t pb, size_t pe)
+{
+	struct lsm *lsm = policy->lsm;
+	struct level *dst = &lsm->ci[policy->tree - 1];
+	struct level *src = policy->tree >= 2
+				? &lsm->ci[policy->tree - 2] : NULL;
+	struct lsm_merge_range *range;
+	struct lsm_split split;
+	size_t ranges = lsm->merge_threads;
+	int rc;
+
+	if (ranges < 2 || policy->build != &lsm_build_default)
+		return lsm_merge_build(policy, pb, pe, 0);
+
+	memset(&split, 0, sizeof(split));
+	if (src && level_range_pages(src, policy->part_from,
+				policy->part_to) > level_range_pages(dst, pb, pe))
+		rc = level_split_keys(src, policy->part_from,
+					policy->part_to, ranges,
+					&lsm_split_add, &split);
+	else
+		rc = level_split_keys(dst, pb, pe, ranges, &lsm_split_add,
+					&split);
+
+	if (rc < 0)
+		goto out;
+
+	if (ranges > split.keys + 1)
+		ranges = split.keys + 1;
+
+	if (ranges < 2) {
+		rc = lsm_merge_build(policy, pb, pe, 0);
+		goto out;
+	}
+
+	range = calloc(ranges, sizeof(*range));
+	if (!range) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	for (size_t i = 0; i != ranges; ++i) {
+		struct lsm_merge_policy *part = &range[i].policy;
+
+		lsm_merge_policy_setup(part);
+		part->lsm = lsm;
+		part->tree = policy->tree;
+		part->drop_deleted = policy->drop_deleted;
+		part->deleted = policy->deleted;
+		part->part_from = policy->part_from;
+		part->part_to = policy->part_to;
+		if (i)
+			part->begin = &split.key[split.keys * i / ranges];
+		if (i + 1 != ranges)
+			part->end = &split.key[split.keys * (i + 1) / ranges];
+		range[i].pb = pb;
+		range[i].pe = pe;
+	}
+
+	/* If we can't start a thread the range is built by this one. */
+	for (size_t i = 1; i != ranges; ++i) {
+		range[i].running = !pthread_create(&range[i].thread, NULL,
+					&lsm_merge_range_build, &range[i]);
+	}
+
+	for (size_t i = 0; i != ranges; ++i) {
+		if (!range[i].running)
+			lsm_merge_range_build(&range[i]);
+	}
+
+	for (size_t i = 0; i != ranges; ++i) {
+		if (range[i].running)
+			pthread_join(range[i].thread, NULL);
+		if (range[i].rc < 0 && rc == 0)
+			rc = range[i].rc;
+	}
+
+	/* Reused leaves are known before any of them is moved, so if we fail
+	 * the output is freed without them. */
+	for (size_t i = 0; rc == 0 && i != ranges; ++i) {
+		struct lsm_merge_policy *part = &range[i].policy;
+
+		rc = lsm_merge_add_reused(policy, part->reused_leaves);
+		if (rc < 0)
+			break;
+
+		memcpy(policy->reused + policy->reused_leaves, part->reused,
+					part->reused_leaves * sizeof(*part->reused));
+		policy->reused_leaves += part->reused_leaves;
+	}
+
+	if (rc == 0) {
+		lsm_merge_builder_setup(policy);
+		for (size_t i = 0; rc == 0 && i != ranges; ++i)
+			rc = lsm_merge_stitch(policy, &range[i].policy.builder);
+		if (rc == 0)
+			rc = lsm_merge_cut(policy);
+		if (rc < 0)
+			ctree_builder_cancel(&policy->builder);
+		ctree_builder_release(&policy->builder);
+	}
+
+	for (size_t i = 0; i != ranges; ++i) {
+		struct lsm_merge_policy *part = &range[i].policy;
+
+		if (rc < 0)
+			ctree_builder_cancel(&part->builder);
+		ctree_builder_release(&part->builder);
+		lsm_merge_policy_release(part);
+	}
+	free(range);
+
+out:
+	lsm_split_release(&split);
+	return rc;
+}
+
+/* Merges c1 (tree 1) or partitions [part_from, part_to) of a disk level
+ * into the next level. Only partitions of the next level that overlap
+ * with the source key range are rewritten, if there are none the source
+ * partitions are moved down without rewriting them. */
+static int __lsm_merge(struct lsm_merge_policy *policy)
+{
+	struct lsm *lsm = policy->lsm;
+	struct level *dst = &lsm->ci[policy->tree - 1];
+	struct level *src = policy->tree >= 2
+				? &lsm->ci[policy->tree - 2] : NULL;
+
+	struct lsm_key lo, hi;
+	size_t pb, pe;
+	int moved;
+	int rc;
+
+	policy->reused_leaves = 0;
+	if (!lsm_merge_source(policy, &lo, &hi))
+		return 0;
+
+	pb = level_find(dst, &lo);
+	for (pe = pb; pe != dst->parts; ++pe) {
+		if (lsm->cmp(&dst->part[pe].first, &hi) > 0)
+			break;
+	}
+
+	level_setup(&policy->out, lsm->io, lsm->cmp);
+	level_set_cache(&policy->out, dst->cache);
+	level_set_pin_interior(&policy->out, dst->pin_interior);
+	level_set_readahead(&policy->out, dst->readahead);
+
+	moved = src && pb == pe;
+	if (moved) {
+		rc = level_share(&policy->out, src, policy->part_from,
+					policy->part_to);
+	} else {
+		policy->drop_deleted = lsm_drop_deleted(policy);
+		rc = lsm_merge_build_parallel(policy, pb, pe);
+	}
+
+	if (rc == 0)
+		rc = lsm_merge_publish(policy, pb, pe, moved);
 
-	rc = ctree_reset(&lsm->ci[to - 2], &builder->ptr, builder->height,
-				builder->pages);
 	if (rc < 0) {
-		ctree_builder_cancel(builder);
-		ctree_builder_release(builder);
-		return rc;
+		if (moved)
+			level_forget(&policy->out);
+		else
+			lsm_free_parts(lsm, &policy->out, policy->reused,
+						policy->reused_leaves);
 	}
-	ctree_builder_release(builder);
+	return rc;
+}
 
-	for (int i = to - 1; i >= from; --i) {
-		assert(i > 0);
+static int lsm_merge_c1(struct lsm_merge_policy *policy)
+{
+	struct lsm *lsm = policy->lsm;
+	int rc;
 
-		if (i == 1) {
-			mtree_reset(&lsm->c1);
-			continue;
+	policy->tree = 1;
+	pthread_mutex_lock(&lsm->merge_mtx);
+	rc = __lsm_merge(policy);
+	pthread_mutex_unlock(&lsm->merge_mtx);
+
+	pthread_mutex_lock(&lsm->mtx);
+	lsm->merging = 0;
+	pthread_cond_broadcast(&lsm->cond);
+	pthread_mutex_unlock(&lsm->mtx);
+	return rc;
+}
+
+/* Merges down one partition of the first level that exceeds its target
+ * size, returns 1 if it did, 0 if all the levels fit. The caller must hold
+ * merge_mtx. */
+static int lsm_compact_step(struct lsm *lsm, struct lsm_merge_policy *policy)
+{
+	size_t target = lsm->level_pages;
+
+	if (!target)
+		return 0;
+
+	for (int i = 0; i + 1 < lsm->levels; ++i) {
+		struct level *level = &lsm->ci[i];
+
+		if (level->pages > target) {
+			if (level->cursor >= level->parts)
+				level->cursor = 0;
+
+			policy->lsm = lsm;
+			policy->tree = i + 2;
+			policy->part_from = level->cursor;
+			policy->part_to = level->cursor + 1;
+
+			const int rc = __lsm_merge(policy);
+
+			return rc < 0 ? rc : 1;
 		}
-		ctree_reset(&lsm->ci[i - 2], NULL, 0, 0);
+		target *= lsm->level_ratio;
 	}
 	return 0;
 }
 
+int lsm_compact(struct lsm *lsm, struct lsm_merge_policy *policy)
+{
+	int rc;
+
+	do {
+		pthread_mutex_lock(&lsm->merge_mtx);
+		rc = lsm_compact_step(lsm, policy);
+		pthread_mutex_unlock(&lsm->merge_mtx);
+	} while (rc > 0);
+	return rc;
+}
+
+/* Compaction yields to c1 merges, since writers may wait for them. */
+static int lsm_merger_compact(struct lsm *lsm, struct lsm_merge_policy *policy)
+{
+	int rc;
+
+	do {
+		pthread_mutex_lock(&lsm->mtx);
+		const int busy = lsm->merging || lsm->merger_stop;
+		pthread_mutex_unlock(&lsm->mtx);
+
+		if (busy)
+			return 0;
+
+		pthread_mutex_lock(&lsm->merge_mtx);
+		rc = lsm_compact_step(lsm, policy);
+		pthread_mutex_unlock(&lsm->merge_mtx);
+	} while (rc > 0);
+	return rc;
+}
+
+static void *lsm_merger(void *arg)
+{
+	struct lsm *lsm = arg;
+
+	pthread_mutex_lock(&lsm->mtx);
+	while (1) {
+		while (!lsm->merge_pending && !lsm->merger_stop)
+			pthread_cond_wait(&lsm->cond, &lsm->mtx);
+
+		/* Finish the pending merge before we stop. */
+		if (!lsm->merge_pending)
+			break;
+		lsm->merge_pending = 0;
+		pthread_mutex_unlock(&lsm->mtx);
+
+		struct lsm_merge_policy *policy = lsm->merger_policy;
+
+		lsm_merge_policy_setup(policy);
+		policy->lsm = lsm;
+
+		int rc = lsm_merge_c1(policy);
+
+		if (rc == 0)
+			rc = lsm_merger_compact(lsm, policy);
+		lsm_merge_policy_release(policy);
+
+		pthread_mutex_lock(&lsm->mtx);
+		if (rc < 0)
+			lsm->merge_rc = rc;
+	}
+	pthread_mutex_unlock(&lsm->mtx);
+	return NULL;
+}
+
+int lsm_start_merger(struct lsm *lsm, size_t threshold)
+{
+	if (lsm->merger_running)
+		return -EBUSY;
+
+	lsm->merger_policy = malloc(sizeof(*lsm->merger_policy));
+	if (!lsm->merger_policy)
+		return -ENOMEM;
+
+	lsm->merge_threshold = threshold;
+	lsm->merger_stop = 0;
+
+	const int rc = pthread_create(&lsm->merger, NULL, &lsm_merger, lsm);
+
+	if (rc) {
+		free(lsm->merger_policy);
+		lsm->merger_policy = NULL;
+		return -rc;
+	}
+	lsm->merger_running = 1;
+	return 0;
+}
+
+void lsm_stop_merger(struct lsm *lsm)
+{
+	if (!lsm->merger_running)
+		return;
+
+	pthread_mutex_lock(&lsm->mtx);
+	lsm->merger_stop = 1;
+	pthread_cond_broadcast(&lsm->cond);
+	pthread_mutex_unlock(&lsm->mtx);
+
+	pthread_join(lsm->merger, NULL);
+	free(lsm->merger_policy);
+	lsm->merger_policy = NULL;
+	lsm->merger_running = 0;
+}
+
+int lsm_wait_merger(struct lsm *lsm)
+{
+	int rc;
+
+	pthread_mutex_lock(&lsm->mtx);
+	while (lsm->merging)
+		pthread_cond_wait(&lsm->cond, &lsm->mtx);
+	rc = lsm->merge_rc;
+	lsm->merge_rc = 0;
+	pthread_mutex_unlock(&lsm->mtx);
+	return rc;
+}
+
 int lsm_merge(struct lsm *lsm, int tree, struct lsm_merge_policy *policy)
 {
 	policy->lsm = lsm;
 	policy->tree = tree;
 
 	if (!policy->tree) {
-		assert(mtree_is_empty(&lsm->c1));
-		mtree_swap(&lsm->c0, &lsm->c1);
-		policy->tree = 1;
+		/* Take c1 over from the background merger. */
+		pthread_mutex_lock(&lsm->mtx);
+		while (lsm->merging)
+			pthread_cond_wait(&lsm->cond, &lsm->mtx);
+		lsm->merging = 1;
+		pthread_mutex_unlock(&lsm->mtx);
+
+		int rc = lsm_swap_c0(lsm);
+
+		if (rc < 0) {
+			pthread_mutex_lock(&lsm->mtx);
+			lsm->merging = 0;
+			pthread_cond_broadcast(&lsm->cond);
+			pthread_mutex_unlock(&lsm->mtx);
+			return rc;
+		}
 
-		const int rc = __lsm_merge(policy);
+		rc = lsm_merge_c1(policy);
 
 		/* I don't know what can we do here if __lsm_merge failed,
 		 * we can't just drop the c1, and we can't return it back
@@ -167,13 +1416,28 @@ int lsm_merge(struct lsm *lsm, int tree, struct lsm_merge_policy *policy)
 		return rc;
 	}
 
+	if (tree < 2 || tree > lsm->levels)
+		return -EINVAL;
+
+	int rc = 0;
+
+	pthread_mutex_lock(&lsm->merge_mtx);
 	/* The next tree is empty, we can just swap these threes. */
-	if (ctree_is_empty(&lsm->ci[tree - 1])) {
-		ctree_swap(&lsm->ci[tree - 1], &lsm->ci[tree - 2]);
-		return 0;
+	if (level_is_empty(&lsm->ci[tree - 1])) {
+		pthread_mutex_lock(&lsm->state_mtx);
+		level_swap(&lsm->ci[tree - 1], &lsm->ci[tree - 2]);
+		rc = lsm_publish(lsm, NULL, NULL, NULL);
+		if (rc < 0)
+			level_swap(&lsm->ci[tree - 1], &lsm->ci[tree - 2]);
+		pthread_mutex_unlock(&lsm->state_mtx);
+		lsm_state_put(lsm, NULL);
+	} else {
+		policy->part_from = 0;
+		policy->part_to = lsm->ci[tree - 2].parts;
+		rc = __lsm_merge(policy);
 	}
-
-	return __lsm_merge(policy);
+	pthread_mutex_unlock(&lsm->merge_mtx);
+	return rc;
 }
 
 static int lsm_no_delete(struct lsm_merge_policy *policy,
@@ -194,40 +1458,71 @@ void lsm_merge_policy_setup(struct lsm_merge_policy *policy)
 
 void lsm_merge_policy_release(struct lsm_merge_policy *policy)
 {
+	free(policy->first.ptr);
+	free(policy->last.ptr);
+	free(policy->reused);
 	memset(policy, 0, sizeof(*policy));
 }
 
-
+/* The iterator pins the current state, so the trees it works with stay
+ * around until it's released, whatever merges do meanwhile. */
 void lsm_iter_setup(struct lsm_iter *iter, struct lsm *lsm)
 {
+	struct lsm_state *state = lsm_state_get(lsm);
+
 	memset(iter, 0, sizeof(*iter));
 	iter->lsm = lsm;
+	iter->state = state;
 	iter->from = 0;
-	iter->to = AULSMFS_MAX_DISK_TREES + 1;
+	iter->to = state->levels + 1;
+	iter->cur = -1;
 
-	mtree_iter_setup(&iter->it0, &lsm->c0);
-	mtree_iter_setup(&iter->it1, &lsm->c1);
+	mtree_iter_setup(&iter->it0, state->c0);
+	mtree_iter_setup(&iter->it1, state->c1);
 
 	for (int i = 0; i != AULSMFS_MAX_DISK_TREES; ++i)
-		ctree_iter_setup(&iter->iti[i], &lsm->ci[i]);
+		level_iter_setup(&iter->iti[i], &state->ci[i]);
 }
 
 void lsm_iter_release(struct lsm_iter *iter)
 {
+	struct lsm *lsm = iter->lsm;
+	struct lsm_state *state = iter->state;
+
 	for (int i = 0; i != AULSMFS_MAX_DISK_TREES; ++i)
-		ctree_iter_release(&iter->iti[i]);
+		level_iter_release(&iter->iti[i]);
 
 	mtree_iter_release(&iter->it1);
 	mtree_iter_release(&iter->it0);
 	free(iter->buf);
 	memset(iter, 0, sizeof(*iter));
+
+	if (state)
+		lsm_state_put(lsm, state);
+}
+
+/* lsm_add may rebalance rb tree c0 and replace values in it, so iterators
+ * walk it under add_lock. Skiplist c0 can be walked concurrently with
+ * lsm_add and c1 isn't modified at all. */
+static void lsm_lock_c0(const struct lsm_iter *iter)
+{
+	if (iter->state->c0->type == MTREE_RBTREE)
+		pthread_rwlock_rdlock(&iter->lsm->add_lock);
+}
+
+static void lsm_unlock_c0(const struct lsm_iter *iter)
+{
+	if (iter->state->c0->type == MTREE_RBTREE)
+		pthread_rwlock_unlock(&iter->lsm->add_lock);
 }
 
 static void lsm_set_items(struct lsm_iter *iter)
 {
 	if (!iter->from) {
+		lsm_lock_c0(iter);
 		mtree_key(&iter->it0, &iter->keyi[0]);
 		mtree_val(&iter->it0, &iter->vali[0]);
+		lsm_unlock_c0(iter);
 	}
 
 	if (iter->from <= 1 && iter->to >= 1) {
@@ -239,62 +1534,152 @@ static void lsm_set_items(struct lsm_iter *iter)
 	const int to = iter->to < 2 ? 0 : iter->to - 1;
 
 	for (int i = from; i < to; ++i) {
-		ctree_key(&iter->iti[i], &iter->keyi[i + 2]);
-		ctree_val(&iter->iti[i], &iter->vali[i + 2]);
+		level_key(&iter->iti[i], &iter->keyi[i + 2]);
+		level_val(&iter->iti[i], &iter->vali[i + 2]);
 	}
 }
 
-static int lsm_set_the_smallest(struct lsm_iter *iter)
+static int lsm_copy_current(struct lsm_iter *iter, const struct lsm_key *key,
+			const struct lsm_val *val)
 {
-	const struct lsm *const lsm = iter->lsm;
+	const size_t size = key->size + val->size;
 
-	struct lsm_key key = { NULL, 0 };
-	struct lsm_val val = { NULL, 0 };
+	if (size > iter->buf_size) {
+		void *buf = realloc(iter->buf, size);
 
-	memset(&iter->val, 0, sizeof(iter->val));
-	memset(&iter->key, 0, sizeof(iter->key));
+		if (!buf)
+			return -ENOMEM;
+		iter->buf = buf;
+		iter->buf_size = size;
+	}
 
-	for (int i = iter->from; i <= iter->to; ++i) {
-		if (!iter->keyi[i].ptr)
-			continue;
+	char *key_ptr = iter->buf;
+	char *val_ptr = key_ptr + key->size;
 
-		if (!key.ptr) {
-			key = iter->keyi[i];
-			val = iter->vali[i];
-			continue;
-		}
+	memcpy(key_ptr, key->ptr, key->size);
+	memcpy(val_ptr, val->ptr, val->size);
 
-		if (lsm->cmp(&key, &iter->keyi[i]) > 0) {
-			key = iter->keyi[i];
-			val = iter->vali[i];
-		}
+	iter->key.ptr = key_ptr;
+	iter->key.size = key->size;
+
+	iter->val.ptr = val_ptr;
+	iter->val.size = val->size;
+	return 0;
+}
+
+static int lsm_set_current(struct lsm_iter *iter, int cur)
+{
+	iter->cur = cur;
+	if (!iter->zero_copy)
+		return lsm_copy_current(iter, &iter->keyi[cur], &iter->vali[cur]);
+
+	iter->key = iter->keyi[cur];
+	iter->val = iter->vali[cur];
+	return 0;
+}
+
+/* Sources that have an item are kept in a binary min heap ordered by their
+ * current keys, so that moving forward costs O(log(sources)) comparisions
+ * instead of comparing all the sources every time. Among equal keys the
+ * newer source (the one with smaller index) goes first. */
+static int lsm_heap_less(const struct lsm_iter *iter, int l, int r)
+{
+	const int cmp = iter->lsm->cmp(&iter->keyi[l], &iter->keyi[r]);
+
+	if (cmp)
+		return cmp < 0;
+	return l < r;
+}
+
+static void lsm_heap_sift_down(struct lsm_iter *iter, int pos)
+{
+	int *heap = iter->heap;
+	const int size = iter->heap_size;
+	const int src = heap[pos];
+
+	while (1) {
+		const int l = 2 * pos + 1;
+		const int r = l + 1;
+		int child = l;
+
+		if (l >= size)
+			break;
+
+		if (r < size && lsm_heap_less(iter, heap[r], heap[l]))
+			child = r;
+
+		if (!lsm_heap_less(iter, heap[child], src))
+			break;
+
+		heap[pos] = heap[child];
+		pos = child;
 	}
+	heap[pos] = src;
+}
 
-	if (key.ptr) {
-		const size_t size = key.size + val.size;
+static void lsm_heap_build(struct lsm_iter *iter)
+{
+	iter->heap_size = 0;
+	for (int i = iter->from; i <= iter->to; ++i) {
+		if (iter->keyi[i].ptr)
+			iter->heap[iter->heap_size++] = i;
+	}
 
-		if (size > iter->buf_size) {
-			void *buf = realloc(iter->buf, size);
+	for (int i = iter->heap_size / 2 - 1; i >= 0; --i)
+		lsm_heap_sift_down(iter, i);
+	iter->heap_valid = 1;
+}
 
-			if (!buf)
-				return -ENOMEM;
-			iter->buf = buf;
-			iter->buf_size = size;
-		}
+static void lsm_heap_sift_up(struct lsm_iter *iter, int pos)
+{
+	int *heap = iter->heap;
+	const int src = heap[pos];
 
-		char *key_ptr = iter->buf;
-		char *val_ptr = key_ptr + key.size;
+	while (pos) {
+		const int parent = (pos - 1) / 2;
 
-		memcpy(key_ptr, key.ptr, key.size);
-		memcpy(val_ptr, val.ptr, val.size);
+		if (!lsm_heap_less(iter, src, heap[parent]))
+			break;
+
+		heap[pos] = heap[parent];
+		pos = parent;
+	}
+	heap[pos] = src;
+}
 
-		iter->key.ptr = key_ptr;
-		iter->key.size = key.size;
+static void lsm_heap_push(struct lsm_iter *iter, int src)
+{
+	iter->heap[iter->heap_size++] = src;
+	lsm_heap_sift_up(iter, iter->heap_size - 1);
+}
+
+static void lsm_heap_pop(struct lsm_iter *iter)
+{
+	iter->heap[0] = iter->heap[--iter->heap_size];
+	if (iter->heap_size)
+		lsm_heap_sift_down(iter, 0);
+}
 
-		iter->val.ptr = val_ptr;
-		iter->val.size = val.size;
+/* Call after the current key of the top source has changed. */
+static void lsm_heap_update_top(struct lsm_iter *iter)
+{
+	if (!iter->keyi[iter->heap[0]].ptr) {
+		lsm_heap_pop(iter);
+		return;
 	}
-	return 0;
+	lsm_heap_sift_down(iter, 0);
+}
+
+static int lsm_set_the_smallest(struct lsm_iter *iter)
+{
+	memset(&iter->val, 0, sizeof(iter->val));
+	memset(&iter->key, 0, sizeof(iter->key));
+	iter->cur = -1;
+
+	lsm_heap_build(iter);
+	if (!iter->heap_size)
+		return 0;
+	return lsm_set_current(iter, iter->heap[0]);
 }
 
 int lsm_set_prev(struct lsm_iter *iter)
@@ -302,11 +1687,11 @@ int lsm_set_prev(struct lsm_iter *iter)
 	const struct lsm *const lsm = iter->lsm;
 	const struct lsm_key last = iter->key;
 
-	struct lsm_key key = { NULL, 0 };
-	struct lsm_val val = { NULL, 0 };
+	int cur = -1;
 
 	memset(&iter->val, 0, sizeof(iter->val));
 	memset(&iter->key, 0, sizeof(iter->key));
+	iter->cur = -1;
 
 	for (int i = iter->from; i <= iter->to; ++i) {
 		if (!iter->keyi[i].ptr)
@@ -318,49 +1703,23 @@ int lsm_set_prev(struct lsm_iter *iter)
 		if (last.ptr && lsm->cmp(&last, &iter->keyi[i]) <= 0)
 			continue;
 
-		if (!key.ptr) {
-			key = iter->keyi[i];
-			val = iter->vali[i];
-			continue;
-		}
-
-		if (lsm->cmp(&key, &iter->keyi[i]) < 0) {
-			key = iter->keyi[i];
-			val = iter->vali[i];
-		}
+		if (cur == -1 || lsm->cmp(&iter->keyi[cur], &iter->keyi[i]) < 0)
+			cur = i;
 	}
 
-	if (key.ptr) {
-		const size_t size = key.size + val.size;
-
-		if (size > iter->buf_size) {
-			void *buf = realloc(iter->buf, size);
-
-			if (!buf)
-				return -ENOMEM;
-			iter->buf = buf;
-			iter->buf_size = size;
-		}
-
-		char *key_ptr = iter->buf;
-		char *val_ptr = key_ptr + key.size;
-
-		memcpy(key_ptr, key.ptr, key.size);
-		memcpy(val_ptr, val.ptr, val.size);
-
-		iter->key.ptr = key_ptr;
-		iter->key.size = key.size;
-
-		iter->val.ptr = val_ptr;
-		iter->val.size = val.size;
-	}
+	if (cur != -1)
+		return lsm_set_current(iter, cur);
 	return 0;
 }
 
 int lsm_begin(struct lsm_iter *iter)
 {
-	if (!iter->from)
+	memset(iter->pending, 0, sizeof(iter->pending));
+	if (!iter->from) {
+		lsm_lock_c0(iter);
 		mtree_begin(&iter->it0);
+		lsm_unlock_c0(iter);
+	}
 
 	if (iter->from <= 1 && iter->to >= 1)
 		mtree_begin(&iter->it1);
@@ -369,7 +1728,7 @@ int lsm_begin(struct lsm_iter *iter)
 	const int to = iter->to < 2 ? 0 : iter->to - 1;
 
 	for (int i = from; i < to; ++i) {
-		const int rc = ctree_begin(&iter->iti[i]);
+		const int rc = level_begin(&iter->iti[i]);
 
 		if (rc < 0)
 			return rc;
@@ -380,6 +1739,8 @@ int lsm_begin(struct lsm_iter *iter)
 
 int lsm_end(struct lsm_iter *iter)
 {
+	memset(iter->pending, 0, sizeof(iter->pending));
+	iter->heap_valid = 0;
 	if (!iter->from)
 		mtree_end(&iter->it0);
 
@@ -390,7 +1751,7 @@ int lsm_end(struct lsm_iter *iter)
 	const int to = iter->to < 2 ? 0 : iter->to - 1;
 
 	for (int i = from; i < to; ++i) {
-		const int rc = ctree_end(&iter->iti[i]);
+		const int rc = level_end(&iter->iti[i]);
 
 		if (rc < 0)
 			return rc;
@@ -399,81 +1760,184 @@ int lsm_end(struct lsm_iter *iter)
 	return 0;
 }
 
-int lsm_next(struct lsm_iter *iter)
+static int lsm_source_lower_bound(struct lsm_iter *iter, int i,
+			const struct lsm_key *key)
 {
-	const struct lsm *const lsm = iter->lsm;
-	struct lsm_key *key = &iter->key;
-	struct lsm_val *val = &iter->val;
+	if (i == 0) {
+		lsm_lock_c0(iter);
+		mtree_lower_bound(&iter->it0, key);
+		mtree_key(&iter->it0, &iter->keyi[0]);
+		mtree_val(&iter->it0, &iter->vali[0]);
+		lsm_unlock_c0(iter);
+		return 0;
+	}
 
-	if (!key->ptr)
-		return -ENOENT;
+	if (i == 1) {
+		mtree_lower_bound(&iter->it1, key);
+		mtree_key(&iter->it1, &iter->keyi[1]);
+		mtree_val(&iter->it1, &iter->vali[1]);
+		return 0;
+	}
 
-	/* We don't really need a loop here since iter->from isn't going
-	 * to be changed, but using loop we can use break and continue, to
-	 * avoid ugly branches. */
-	while (!iter->from) {
-		if (!iter->keyi[0].ptr)
-			break;
+	const int rc = level_lower_bound(&iter->iti[i - 2], key);
 
-		if (lsm->cmp(&iter->keyi[0], key) > 0)
-			break;
+	if (rc < 0)
+		return rc;
+	level_key(&iter->iti[i - 2], &iter->keyi[i]);
+	level_val(&iter->iti[i - 2], &iter->vali[i]);
+	return 0;
+}
+
+/* Positions sources skipped by lsm_lookup or lsm_get at the current key. */
+static int lsm_resolve_pending(struct lsm_iter *iter)
+{
+	for (int i = iter->from; i <= iter->to; ++i) {
+		if (!iter->pending[i])
+			continue;
+
+		const int rc = lsm_source_lower_bound(iter, i, &iter->key);
+
+		if (rc < 0)
+			return rc;
+
+		iter->pending[i] = 0;
+		iter->heap_valid = 0;
+	}
+	return 0;
+}
 
+static int lsm_source_next(struct lsm_iter *iter, int i)
+{
+	if (i == 0) {
+		lsm_lock_c0(iter);
 		mtree_next(&iter->it0);
 		mtree_key(&iter->it0, &iter->keyi[0]);
 		mtree_val(&iter->it0, &iter->vali[0]);
+		lsm_unlock_c0(iter);
+		return 0;
 	}
 
-	while (iter->from <= 1 && iter->to >= 1) {
-		if (!iter->keyi[1].ptr)
-			break;
-
-		if (lsm->cmp(&iter->keyi[1], key) > 0)
-			break;
-
+	if (i == 1) {
 		mtree_next(&iter->it1);
 		mtree_key(&iter->it1, &iter->keyi[1]);
 		mtree_val(&iter->it1, &iter->vali[1]);
+		return 0;
 	}
 
-	const int from = iter->from < 2 ? 0 : iter->from - 2;
-	const int to = iter->to < 2 ? 0 : iter->to - 1;
+	const int rc = level_next(&iter->iti[i - 2]);
 
-	for (int i = from; i < to; ++i) {
-		struct lsm_key *const keyi = &iter->keyi[i + 2];
-		struct lsm_val *const vali = &iter->vali[i + 2];
+	if (rc < 0 && rc != -ENOENT)
+		return rc;
+	level_key(&iter->iti[i - 2], &iter->keyi[i]);
+	level_val(&iter->iti[i - 2], &iter->vali[i]);
+	return 0;
+}
 
-		while (1) {
-			if (!keyi->ptr)
-				break;
+int lsm_next(struct lsm_iter *iter)
+{
+	const struct lsm *const lsm = iter->lsm;
+	struct lsm_key *key = &iter->key;
+	struct lsm_val *val = &iter->val;
 
-			if (lsm->cmp(keyi, key) > 0)
-				break;
+	if (!key->ptr)
+		return -ENOENT;
 
-			const int rc = ctree_next(&iter->iti[i]);
+	const int rc = lsm_resolve_pending(iter);
 
-			if (rc < 0 && rc != -ENOENT)
-				return rc;
-			ctree_key(&iter->iti[i], keyi);
-			ctree_val(&iter->iti[i], vali);
+	if (rc < 0)
+		return rc;
+
+	if (!iter->heap_valid)
+		lsm_heap_build(iter);
+
+	/* Skip the current key in all the sources, usually only the current
+	 * source contains it. The current source is moved last, since in
+	 * zero copy mode the key points into its memory. */
+	const int cur = iter->cur;
+	int cur_popped = 0;
+
+	while (iter->heap_size) {
+		const int i = iter->heap[0];
+
+		if (i == cur) {
+			lsm_heap_pop(iter);
+			cur_popped = 1;
+			continue;
 		}
+
+		if (lsm->cmp(&iter->keyi[i], key) > 0)
+			break;
+
+		const int rc = lsm_source_next(iter, i);
+
+		if (rc < 0)
+			return rc;
+		lsm_heap_update_top(iter);
 	}
 
-	for (int i = iter->from; i <= iter->to; ++i) {
-		if (!iter->keyi[i].ptr)
-			continue;
-		return lsm_set_the_smallest(iter);
+	if (cur_popped) {
+		const int rc = lsm_source_next(iter, cur);
+
+		if (rc < 0)
+			return rc;
+		if (iter->keyi[cur].ptr)
+			lsm_heap_push(iter, cur);
 	}
+
+	if (iter->heap_size)
+		return lsm_set_current(iter, iter->heap[0]);
+
 	memset(key, 0, sizeof(*key));
 	memset(val, 0, sizeof(*val));
+	iter->cur = -1;
 	return -ENOENT;
 }
 
+/* Moves the current source past the rest of its current leaf, other
+ * sources must not have keys in this range. */
+static int lsm_skip_leaf(struct lsm_iter *iter)
+{
+	const int cur = iter->cur;
+	const int rc = level_skip_leaf(&iter->iti[cur - 2]);
+
+	if (rc < 0 && rc != -ENOENT)
+		return rc;
+
+	level_key(&iter->iti[cur - 2], &iter->keyi[cur]);
+	level_val(&iter->iti[cur - 2], &iter->vali[cur]);
+	lsm_heap_update_top(iter);
+
+	if (iter->heap_size)
+		return lsm_set_current(iter, iter->heap[0]);
+
+	memset(&iter->key, 0, sizeof(iter->key));
+	memset(&iter->val, 0, sizeof(iter->val));
+	iter->cur = -1;
+	return 0;
+}
+
 int lsm_prev(struct lsm_iter *iter)
 {
 	const struct lsm *const lsm = iter->lsm;
 	struct lsm_key *key = &iter->key;
 	int moved = 0;
 
+	int rc = lsm_resolve_pending(iter);
+
+	if (rc < 0)
+		return rc;
+
+	/* Moving sources back might release memory the current item points
+	 * to in zero copy mode, so we have to copy it. */
+	if (iter->zero_copy && key->ptr) {
+		rc = lsm_copy_current(iter, &iter->key, &iter->val);
+		if (rc < 0)
+			return rc;
+	}
+
+	if (!iter->from)
+		lsm_lock_c0(iter);
+
 	while (!iter->from) {
 		if (iter->keyi[0].ptr && !key->ptr) {
 			moved = 1;
@@ -493,6 +1957,9 @@ int lsm_prev(struct lsm_iter *iter)
 			break;
 	}
 
+	if (!iter->from)
+		lsm_unlock_c0(iter);
+
 	while (iter->from <= 1 && iter->to >= 1) {
 		if (iter->keyi[1].ptr && !key->ptr) {
 			moved = 1;
@@ -530,17 +1997,19 @@ int lsm_prev(struct lsm_iter *iter)
 				break;
 			}
 
-			const int rc = ctree_prev(&iter->iti[i]);
+			const int rc = level_prev(&iter->iti[i]);
 
 			if (rc == -ENOENT)
 				break;
 			if (rc < 0)
 				return rc;
-			ctree_key(&iter->iti[i], keyi);
-			ctree_val(&iter->iti[i], vali);
+			level_key(&iter->iti[i], keyi);
+			level_val(&iter->iti[i], vali);
 		}
 	}
 
+	/* lsm_set_prev doesn't maintain the heap. */
+	iter->heap_valid = 0;
 	if (!moved)
 		return -ENOENT;
 	return lsm_set_prev(iter);
@@ -553,39 +2022,25 @@ int lsm_has_item(const struct lsm_iter *iter)
 
 int lsm_lower_bound(struct lsm_iter *iter, const struct lsm_key *key)
 {
-	if (!iter->from) {
-		mtree_lower_bound(&iter->it0, key);
-		mtree_key(&iter->it0, &iter->keyi[0]);
-		mtree_val(&iter->it0, &iter->vali[0]);
-	}
-
-	if (iter->from <= 1 && iter->to >= 1) {
-		mtree_lower_bound(&iter->it1, key);
-		mtree_key(&iter->it1, &iter->keyi[1]);
-		mtree_val(&iter->it1, &iter->vali[1]);
-	}
-
-	const int from = iter->from < 2 ? 0 : iter->from - 2;
-	const int to = iter->to < 2 ? 0 : iter->to - 1;
-
-	for (int i = from; i < to; ++i) {
-		const int rc = ctree_lower_bound(&iter->iti[i], key);
+	memset(iter->pending, 0, sizeof(iter->pending));
+	for (int i = iter->from; i <= iter->to; ++i) {
+		const int rc = lsm_source_lower_bound(iter, i, key);
 
 		if (rc < 0)
 			return rc;
-
-		ctree_key(&iter->iti[i], &iter->keyi[i + 2]);
-		ctree_val(&iter->iti[i], &iter->vali[i + 2]);
 	}
 	return lsm_set_the_smallest(iter);
 }
 
 int lsm_upper_bound(struct lsm_iter *iter, const struct lsm_key *key)
 {
+	memset(iter->pending, 0, sizeof(iter->pending));
 	if (!iter->from) {
+		lsm_lock_c0(iter);
 		mtree_upper_bound(&iter->it0, key);
 		mtree_key(&iter->it0, &iter->keyi[0]);
 		mtree_val(&iter->it0, &iter->vali[0]);
+		lsm_unlock_c0(iter);
 	}
 
 	if (iter->from <= 1 && iter->to >= 1) {
@@ -598,28 +2053,128 @@ int lsm_upper_bound(struct lsm_iter *iter, const struct lsm_key *key)
 	const int to = iter->to < 2 ? 0 : iter->to - 1;
 
 	for (int i = from; i < to; ++i) {
-		const int rc = ctree_upper_bound(&iter->iti[i], key);
+		const int rc = level_upper_bound(&iter->iti[i], key);
 
 		if (rc < 0)
 			return rc;
 
-		ctree_key(&iter->iti[i], &iter->keyi[i + 2]);
-		ctree_val(&iter->iti[i], &iter->vali[i + 2]);
+		level_key(&iter->iti[i], &iter->keyi[i + 2]);
+		level_val(&iter->iti[i], &iter->vali[i + 2]);
 	}
 	return lsm_set_the_smallest(iter);
 }
 
+static void lsm_source_skip(struct lsm_iter *iter, int i)
+{
+	memset(&iter->keyi[i], 0, sizeof(iter->keyi[i]));
+	memset(&iter->vali[i], 0, sizeof(iter->vali[i]));
+	iter->pending[i] = 1;
+}
+
 int lsm_lookup(struct lsm_iter *iter, const struct lsm_key *key)
 {
-	const int rc = lsm_lower_bound(iter, key);
+	const struct lsm *const lsm = iter->lsm;
+	const struct lsm_state *const state = iter->state;
+
+	memset(iter->pending, 0, sizeof(iter->pending));
+	for (int i = iter->from; i <= iter->to; ++i) {
+		if (i >= 2 && !level_may_contain(&state->ci[i - 2], key)) {
+			lsm_source_skip(iter, i);
+			continue;
+		}
+
+		const int rc = lsm_source_lower_bound(iter, i, key);
+
+		if (rc < 0)
+			return rc;
+	}
+
+	const int rc = lsm_set_the_smallest(iter);
 
 	if (rc < 0)
 		return rc;
 
-	if (!iter->key.ptr)
+	if (iter->key.ptr && !lsm->cmp(&iter->key, key))
+		return 1;
+
+	memset(&iter->key, 0, sizeof(iter->key));
+	memset(&iter->val, 0, sizeof(iter->val));
+	memset(iter->pending, 0, sizeof(iter->pending));
+	iter->cur = -1;
+	return 0;
+}
+
+/* Returns positive value if the source contains the key, sources that
+ * weren't positioned are marked as pending. */
+static int lsm_source_get(struct lsm_iter *iter, int i,
+			const struct lsm_key *key)
+{
+	if (i < 2) {
+		struct mtree_iter *it = i ? &iter->it1 : &iter->it0;
+		int found;
+
+		if (!i)
+			lsm_lock_c0(iter);
+		found = mtree_lookup(it, key);
+		mtree_key(it, &iter->keyi[i]);
+		mtree_val(it, &iter->vali[i]);
+		if (!i)
+			lsm_unlock_c0(iter);
+
+		if (!found) {
+			lsm_source_skip(iter, i);
+			return 0;
+		}
+		return 1;
+	}
+
+	if (!level_may_contain(&iter->state->ci[i - 2], key)) {
+		lsm_source_skip(iter, i);
 		return 0;
+	}
+
+	const int rc = level_lookup(&iter->iti[i - 2], key);
+
+	if (rc < 0)
+		return rc;
+
+	level_key(&iter->iti[i - 2], &iter->keyi[i]);
+	level_val(&iter->iti[i - 2], &iter->vali[i]);
+	return rc;
+}
+
+int lsm_get(struct lsm_iter *iter, const struct lsm_key *key)
+{
+	int found = -1;
 
-	if (iter->lsm->cmp(&iter->key, key))
+	memset(&iter->key, 0, sizeof(iter->key));
+	memset(&iter->val, 0, sizeof(iter->val));
+	memset(iter->pending, 0, sizeof(iter->pending));
+	iter->heap_valid = 0;
+	iter->cur = -1;
+
+	/* Sources are ordered from the newest to the oldest, so the first
+	 * one that contains the key has the actual value. */
+	for (int i = iter->from; i <= iter->to; ++i) {
+		if (found != -1) {
+			lsm_source_skip(iter, i);
+			continue;
+		}
+
+		const int rc = lsm_source_get(iter, i, key);
+
+		if (rc < 0)
+			return rc;
+		if (rc)
+			found = i;
+	}
+
+	if (found == -1) {
+		memset(iter->pending, 0, sizeof(iter->pending));
 		return 0;
-	return 1;
+	}
+
+	const int rc = lsm_set_current(iter, found);
+
+	return rc < 0 ? rc : 1;
 }
@@ -1,3 +1,4 @@
+#include <key_schema.h>
 #include <mtree.h>
 #include <lsm_fwd.h>
 
@@ -5,6 +6,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <errno.h>
 
 
@@ -14,11 +16,139 @@ struct mtree_node {
 	struct lsm_val val;
 };
 
-static struct mtree_node *mtree_node_create(const struct lsm_key *key,
-			const struct lsm_val *val)
+/* Skiplist nodes are immutable once linked except for the value pointer
+ * and the links, all of them are accessed atomically. Updating a key
+ * replaces the value pointer, so readers never need any locks. */
+struct mtree_snode {
+	struct lsm_key key;
+	struct lsm_val *val;
+	int height;
+	struct mtree_snode *next[];
+};
+
+struct mtree_slab {
+	struct mtree_slab *next;
+	size_t size;
+	size_t used;
+};
+
+static const size_t MTREE_SLAB_SIZE = 64 * 1024;
+static const size_t MTREE_ALIGN = sizeof(void *);
+
+static int mtree_cmp(const struct mtree *tree, const struct lsm_key *l,
+			const struct lsm_key *r)
+{
+	return key_compare(tree->schema, tree->cmp, l, r);
+}
+
+static struct mtree_slab *mtree_slab_create(size_t size)
+{
+	struct mtree_slab *slab = malloc(sizeof(*slab) + size);
+
+	if (!slab)
+		return NULL;
+
+	slab->next = NULL;
+	slab->size = size;
+	slab->used = 0;
+	return slab;
+}
+
+/* Large nodes get a slab of their own, we put such slab after the current
+ * one, so that it doesn't take the place of the current slab and its free
+ * space isn't wasted. */
+static void *mtree_alloc_large(struct mtree *tree, size_t size)
+{
+	struct mtree_slab *new = mtree_slab_create(size);
+
+	if (!new)
+		return NULL;
+
+	new->used = size;
+	__atomic_fetch_add(&tree->bytes, sizeof(*new) + new->size,
+				__ATOMIC_RELAXED);
+
+	struct mtree_slab *slab = __atomic_load_n(&tree->slab,
+				__ATOMIC_ACQUIRE);
+
+	while (1) {
+		if (!slab) {
+			new->next = NULL;
+			if (__atomic_compare_exchange_n(&tree->slab, &slab,
+						new, 0, __ATOMIC_RELEASE,
+						__ATOMIC_ACQUIRE))
+				return new + 1;
+			continue;
+		}
+
+		struct mtree_slab *next = __atomic_load_n(&slab->next,
+					__ATOMIC_RELAXED);
+
+		do {
+			new->next = next;
+		} while (!__atomic_compare_exchange_n(&slab->next, &next, new,
+					0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		return new + 1;
+	}
+}
+
+/* The allocator is lock-free, so that concurrent skiplist inserts could use
+ * it: space is reserved in the current slab with an atomic add and when the
+ * slab is exhausted a new one is published with CAS. */
+static void *mtree_alloc(struct mtree *tree, size_t size)
+{
+	size = (size + MTREE_ALIGN - 1) & ~(MTREE_ALIGN - 1);
+
+	if (size > MTREE_SLAB_SIZE / 4)
+		return mtree_alloc_large(tree, size);
+
+	while (1) {
+		struct mtree_slab *slab = __atomic_load_n(&tree->slab,
+					__ATOMIC_ACQUIRE);
+
+		if (slab) {
+			const size_t offs = __atomic_fetch_add(&slab->used,
+						size, __ATOMIC_RELAXED);
+
+			if (offs + size <= slab->size)
+				return (char *)(slab + 1) + offs;
+		}
+
+		struct mtree_slab *new = mtree_slab_create(MTREE_SLAB_SIZE);
+
+		if (!new)
+			return NULL;
+
+		new->used = size;
+		new->next = slab;
+		__atomic_fetch_add(&tree->bytes, sizeof(*new) + new->size,
+					__ATOMIC_RELAXED);
+
+		if (__atomic_compare_exchange_n(&tree->slab, &slab, new, 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return new + 1;
+
+		__atomic_fetch_sub(&tree->bytes, sizeof(*new) + new->size,
+					__ATOMIC_RELAXED);
+		free(new);
+	}
+}
+
+static void mtree_free_slabs(struct mtree_slab *slab)
+{
+	while (slab) {
+		struct mtree_slab *next = slab->next;
+
+		free(slab);
+		slab = next;
+	}
+}
+
+static struct mtree_node *mtree_node_create(struct mtree *tree,
+			const struct lsm_key *key, const struct lsm_val *val)
 {
 	const size_t size = key->size + val->size + sizeof(struct mtree_node);
-	struct mtree_node * const new = malloc(size);
+	struct mtree_node * const new = mtree_alloc(tree, size);
 
 	if (!new)
 		return NULL;
@@ -44,47 +174,47 @@ static struct mtree_node *mtree_node_create(const struct lsm_key *key,
 	return new;
 }
 
-static void mtree_node_destroy(struct mtree_node *node)
-{
-	free(node);
-}
-
 void mtree_setup(struct mtree *tree, mtree_cmp_t cmp)
 {
+	memset(tree, 0, sizeof(*tree));
 	tree->cmp = cmp;
-	tree->bytes = 0;
-	tree->tree.root = NULL;
+	tree->schema = key_schema_of(cmp);
+	tree->type = MTREE_RBTREE;
 }
 
-static void __mtree_release(struct rb_node *node)
+void mtree_set_type(struct mtree *tree, enum mtree_type type)
 {
-	while (node) {
-		struct rb_node *to_free = node;
-
-		__mtree_release(node->right);
-		node = node->left;
-		mtree_node_destroy((struct mtree_node *)to_free);
-	}
+	assert(mtree_is_empty(tree));
+	tree->type = type;
 }
 
 void mtree_release(struct mtree *tree)
 {
-	__mtree_release(tree->tree.root);
+	mtree_free_slabs(tree->slab);
+	tree->slab = NULL;
 	tree->tree.root = NULL;
+	memset(tree->head, 0, sizeof(tree->head));
+	tree->height = 0;
 	tree->bytes = 0;
 }
 
 void mtree_reset(struct mtree *tree)
 {
-	struct rb_node *root = tree->tree.root;
+	struct mtree_slab *slab = tree->slab;
 
 	tree->tree.root = NULL;
+	memset(tree->head, 0, sizeof(tree->head));
+	tree->height = 0;
+	tree->slab = NULL;
 	tree->bytes = 0;
-	__mtree_release(root);
+	mtree_free_slabs(slab);
 }
 
 int mtree_is_empty(const struct mtree *tree)
 {
+	if (tree->type == MTREE_SKIPLIST)
+		return __atomic_load_n(&tree->head[0], __ATOMIC_ACQUIRE)
+					? 0 : 1;
 	return tree->tree.root ? 0 : 1;
 }
 
@@ -96,20 +226,262 @@ void mtree_swap(struct mtree *l, struct mtree *r)
 	*r = tmp;
 }
 
-static void __mtree_insert(struct mtree *tree, struct mtree_node *new)
+
+static struct mtree_snode *mskip_next(const struct mtree *tree,
+			const struct mtree_snode *node, int level)
+{
+	struct mtree_snode *const *link = node
+				? &node->next[level] : &tree->head[level];
+
+	return __atomic_load_n(link, __ATOMIC_ACQUIRE);
+}
+
+static int mskip_link(struct mtree *tree, struct mtree_snode *pred, int level,
+			struct mtree_snode *succ, struct mtree_snode *node)
+{
+	struct mtree_snode **link = pred ? &pred->next[level]
+				: &tree->head[level];
+
+	return __atomic_compare_exchange_n(link, &succ, node, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+/* Finds the last node with key less than the given key (NULL means head)
+ * and its successor on the given level starting from pred. The successor
+ * found on the level above is known to be not less than the key, so we
+ * don't compare it again, it saves a lot of cache misses. */
+static void mskip_find_level(const struct mtree *tree,
+			const struct lsm_key *key, int level,
+			struct mtree_snode **pred, struct mtree_snode **succ)
+{
+	const struct mtree_snode *const above = *succ;
+	struct mtree_snode *x = *pred;
+	struct mtree_snode *next = mskip_next(tree, x, level);
+
+	while (next && next != above &&
+				mtree_cmp(tree, &next->key, key) < 0) {
+		x = next;
+		next = mskip_next(tree, x, level);
+	}
+	*pred = x;
+	*succ = next;
+}
+
+static int mskip_height(const struct mtree *tree)
+{
+	return __atomic_load_n(&tree->height, __ATOMIC_RELAXED);
+}
+
+static void mskip_find(const struct mtree *tree, const struct lsm_key *key,
+			struct mtree_snode **preds, struct mtree_snode **succs)
+{
+	struct mtree_snode *x = NULL;
+	struct mtree_snode *next = NULL;
+
+	for (int level = MTREE_MAX_HEIGHT - 1; level >= 0; --level) {
+		if (level < mskip_height(tree))
+			mskip_find_level(tree, key, level, &x, &next);
+		preds[level] = x;
+		succs[level] = next;
+	}
+}
+
+static int mskip_random_height(void)
+{
+	static _Thread_local uint64_t seed;
+	int height = 1;
+
+	if (!seed)
+		seed = (uintptr_t)&seed | 1;
+
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+
+	for (uint64_t x = seed; height < MTREE_MAX_HEIGHT && !(x & 3); x >>= 2)
+		++height;
+	return height;
+}
+
+static struct lsm_val *mskip_val_create(struct mtree *tree,
+			const struct lsm_val *val)
+{
+	struct lsm_val *new = mtree_alloc(tree, sizeof(*new) + val->size);
+
+	if (!new)
+		return NULL;
+
+	new->ptr = new + 1;
+	new->size = val->size;
+	if (val->size) {
+		assert(val->ptr);
+		memcpy(new->ptr, val->ptr, val->size);
+	}
+	return new;
+}
+
+static struct mtree_snode *mskip_node_create(struct mtree *tree,
+			const struct lsm_key *key, struct lsm_val *val)
+{
+	const int height = mskip_random_height();
+	const size_t links = height * sizeof(struct mtree_snode *);
+	struct mtree_snode *new = mtree_alloc(tree,
+				sizeof(*new) + links + key->size);
+
+	if (!new)
+		return NULL;
+
+	new->key.ptr = (char *)new->next + links;
+	new->key.size = key->size;
+	if (key->size) {
+		assert(key->ptr);
+		memcpy(new->key.ptr, key->ptr, key->size);
+	}
+	new->val = val;
+	new->height = height;
+	return new;
+}
+
+static void mskip_update(struct mtree_snode *node, struct lsm_val *val)
+{
+	__atomic_store_n(&node->val, val, __ATOMIC_RELEASE);
+}
+
+static int mskip_add(struct mtree *tree, const struct lsm_key *key,
+			const struct lsm_val *val)
+{
+	struct mtree_snode *preds[MTREE_MAX_HEIGHT];
+	struct mtree_snode *succs[MTREE_MAX_HEIGHT];
+	struct lsm_val *new_val = mskip_val_create(tree, val);
+
+	if (!new_val)
+		return -ENOMEM;
+
+	mskip_find(tree, key, preds, succs);
+	if (succs[0] && !mtree_cmp(tree, &succs[0]->key, key)) {
+		mskip_update(succs[0], new_val);
+		return 0;
+	}
+
+	struct mtree_snode *new = mskip_node_create(tree, key, new_val);
+
+	if (!new)
+		return -ENOMEM;
+
+	int height = mskip_height(tree);
+
+	while (height < new->height &&
+			!__atomic_compare_exchange_n(&tree->height, &height,
+					new->height, 0, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+		;
+
+	/* Once the node is linked on the level 0 it's in the list, upper
+	 * levels only speed up the search. If CAS fails somebody inserted
+	 * a node right where we wanted, so we search the level again from
+	 * the last known predecessor, since nodes are never removed it's
+	 * still in the list. */
+	for (int level = 0; level != new->height; ++level) {
+		while (1) {
+			__atomic_store_n(&new->next[level], succs[level],
+						__ATOMIC_RELAXED);
+			if (mskip_link(tree, preds[level], level, succs[level],
+						new))
+				break;
+
+			succs[level] = NULL;
+			mskip_find_level(tree, key, level, &preds[level],
+						&succs[level]);
+
+			/* The same key has been inserted concurrently, the
+			 * new node isn't visible yet, so just drop it. */
+			if (!level && succs[0] &&
+					!mtree_cmp(tree, &succs[0]->key, key)) {
+				mskip_update(succs[0], new_val);
+				return 0;
+			}
+		}
+	}
+	return 0;
+}
+
+static struct mtree_snode *mskip_lower_bound(const struct mtree *tree,
+			const struct lsm_key *key)
+{
+	struct mtree_snode *x = NULL;
+	struct mtree_snode *next = NULL;
+
+	for (int level = mskip_height(tree) - 1; level >= 0; --level)
+		mskip_find_level(tree, key, level, &x, &next);
+	return next;
+}
+
+/* Returns the last node with key less than the given one or the last node
+ * in the list if key is NULL. */
+static struct mtree_snode *mskip_less(const struct mtree *tree,
+			const struct lsm_key *key)
+{
+	struct mtree_snode *x = NULL;
+
+	for (int level = mskip_height(tree) - 1; level >= 0; --level) {
+		struct mtree_snode *next = mskip_next(tree, x, level);
+
+		while (next && (!key ||
+					mtree_cmp(tree, &next->key, key) < 0)) {
+			x = next;
+			next = mskip_next(tree, x, level);
+		}
+	}
+	return x;
+}
+
+static struct mtree_snode *mskip_upper_bound(const struct mtree *tree,
+			const struct lsm_key *key)
+{
+	struct mtree_snode *next = mskip_lower_bound(tree, key);
+
+	while (next && !mtree_cmp(tree, &next->key, key))
+		next = mskip_next(tree, next, 0);
+	return next;
+}
+
+
+/* Updated node stays in the tree, so iterators that point to it don't lose
+ * their place, only the value is replaced. Memory of the old value is
+ * released with the slabs. */
+static int mtree_update(struct mtree *tree, struct mtree_node *node,
+			const struct lsm_val *val)
+{
+	void *ptr = mtree_alloc(tree, val->size);
+
+	if (!ptr)
+		return -ENOMEM;
+
+	if (val->size) {
+		assert(val->ptr);
+		memcpy(ptr, val->ptr, val->size);
+	}
+
+	node->val.ptr = ptr;
+	node->val.size = val->size;
+	return 0;
+}
+
+int mtree_add(struct mtree *tree, const struct lsm_key *key,
+			const struct lsm_val *val)
 {
+	if (tree->type == MTREE_SKIPLIST)
+		return mskip_add(tree, key, val);
+
 	struct rb_node **plink = &tree->tree.root;
 	struct rb_node *parent = NULL;
 
 	while (*plink) {
 		struct mtree_node * const old = (struct mtree_node *)(*plink);
-		const int cmp = tree->cmp(&old->key, &new->key);
+		const int cmp = mtree_cmp(tree, &old->key, key);
 
-		if (!cmp) {
-			rb_swap_nodes(&tree->tree, &old->rb, &new->rb);
-			mtree_node_destroy(old);
-			return;
-		}
+		if (!cmp)
+			return mtree_update(tree, old, val);
 
 		parent = *plink;
 		if (cmp < 0)
@@ -118,27 +490,19 @@ static void __mtree_insert(struct mtree *tree, struct mtree_node *new)
 			plink = &parent->left;
 	}
 
-	rb_link(&new->rb, parent, plink);
-	rb_insert(&new->rb, &tree->tree);
-}
-
-int mtree_add(struct mtree *tree, const struct lsm_key *key,
-			const struct lsm_val *val)
-{
-	struct mtree_node *new = mtree_node_create(key, val);
+	struct mtree_node *new = mtree_node_create(tree, key, val);
 
 	if (!new)
 		return -ENOMEM;
 
-	__mtree_insert(tree, new);
-	tree->bytes += key->size + val->size;
+	rb_link(&new->rb, parent, plink);
+	rb_insert(&new->rb, &tree->tree);
 	return 0;
 }
 
 void mtree_iter_setup(struct mtree_iter *iter, struct mtree *tree)
 {
-	iter->cmp = tree->cmp;
-	iter->tree = &tree->tree;
+	iter->tree = tree;
 	iter->node = NULL;
 }
 
@@ -148,14 +512,24 @@ void mtree_iter_release(struct mtree_iter *iter)
 	iter->node = NULL;
 }
 
+static int mtree_iter_skiplist(const struct mtree_iter *iter)
+{
+	return iter->tree->type == MTREE_SKIPLIST;
+}
+
 void mtree_lower_bound(struct mtree_iter *iter, const struct lsm_key *key)
 {
-	struct rb_node *p = iter->tree->root;
+	if (mtree_iter_skiplist(iter)) {
+		iter->node = mskip_lower_bound(iter->tree, key);
+		return;
+	}
+
+	struct rb_node *p = iter->tree->tree.root;
 	struct mtree_node *lower = NULL;
 
 	while (p) {
 		struct mtree_node * const node = (struct mtree_node *)p;
-		const int cmp = iter->cmp(&node->key, key);
+		const int cmp = mtree_cmp(iter->tree, &node->key, key);
 
 		if (cmp >= 0) {
 			p = p->left;
@@ -169,18 +543,23 @@ void mtree_lower_bound(struct mtree_iter *iter, const struct lsm_key *key)
 
 void mtree_upper_bound(struct mtree_iter *iter, const struct lsm_key *key)
 {
-	struct rb_node *p = iter->tree->root;
+	if (mtree_iter_skiplist(iter)) {
+		iter->node = mskip_upper_bound(iter->tree, key);
+		return;
+	}
+
+	struct rb_node *p = iter->tree->tree.root;
 	struct mtree_node *upper = NULL;
 
 	while (p) {
 		struct mtree_node * const node = (struct mtree_node *)p;
-		const int cmp = iter->cmp(&node->key, key);
+		const int cmp = mtree_cmp(iter->tree, &node->key, key);
 
-		if (cmp <= 0) {
-			p = p->right;
+		if (cmp > 0) {
+			p = p->left;
 			upper = node;
 		} else {
-			p = p->left;
+			p = p->right;
 		}
 	}
 	iter->node = upper;
@@ -188,7 +567,10 @@ void mtree_upper_bound(struct mtree_iter *iter, const struct lsm_key *key)
 
 void mtree_begin(struct mtree_iter *iter)
 {
-	iter->node = (struct mtree_node *)rb_leftmost(iter->tree);
+	if (mtree_iter_skiplist(iter))
+		iter->node = mskip_next(iter->tree, NULL, 0);
+	else
+		iter->node = rb_leftmost(&iter->tree->tree);
 }
 
 void mtree_end(struct mtree_iter *iter)
@@ -196,10 +578,17 @@ void mtree_end(struct mtree_iter *iter)
 	iter->node = NULL;
 }
 
+static const struct lsm_key *mtree_iter_key(const struct mtree_iter *iter)
+{
+	if (mtree_iter_skiplist(iter))
+		return &((const struct mtree_snode *)iter->node)->key;
+	return &((const struct mtree_node *)iter->node)->key;
+}
+
 int mtree_lookup(struct mtree_iter *iter, const struct lsm_key *key)
 {
 	mtree_lower_bound(iter, key);
-	if (iter->node && iter->cmp(&iter->node->key, key))
+	if (iter->node && mtree_cmp(iter->tree, mtree_iter_key(iter), key))
 		iter->node = NULL;
 	return iter->node ? 1 : 0;
 }
@@ -209,19 +598,39 @@ int mtree_next(struct mtree_iter *iter)
 	if (!iter->node)
 		return -ENOENT;
 
-	iter->node = (struct mtree_node *)rb_next(&iter->node->rb);
+	if (mtree_iter_skiplist(iter))
+		iter->node = mskip_next(iter->tree, iter->node, 0);
+	else
+		iter->node = rb_next(iter->node);
+	return 0;
+}
+
+static int mskip_prev(struct mtree_iter *iter)
+{
+	struct mtree_snode *prev = mskip_less(iter->tree,
+				iter->node ? mtree_iter_key(iter) : NULL);
+
+	if (!prev)
+		return -ENOENT;
+
+	iter->node = prev;
 	return 0;
 }
 
 int mtree_prev(struct mtree_iter *iter)
 {
-	if (iter->node == (const struct mtree_node *)rb_leftmost(iter->tree))
+	if (mtree_iter_skiplist(iter))
+		return mskip_prev(iter);
+
+	struct rb_tree *tree = &iter->tree->tree;
+
+	if (iter->node == (const void *)rb_leftmost(tree))
 		return -ENOENT;
 
 	if (!iter->node)
-		iter->node = (struct mtree_node *)rb_rightmost(iter->tree);
+		iter->node = rb_rightmost(tree);
 	else
-		iter->node = (struct mtree_node *)rb_prev(&iter->node->rb);
+		iter->node = rb_prev(iter->node);
 	return 0;
 }
 
@@ -232,7 +641,7 @@ int mtree_key(const struct mtree_iter *iter, struct lsm_key *key)
 	if (!iter->node)
 		return -ENOENT;
 	if (key)
-		*key = iter->node->key;
+		*key = *mtree_iter_key(iter);
 	return 0;
 }
 
@@ -242,7 +651,15 @@ int mtree_val(const struct mtree_iter *iter, struct lsm_val *val)
 		memset(val, 0, sizeof(*val));
 	if (!iter->node)
 		return -ENOENT;
-	if (val)
-		*val = iter->node->val;
+	if (!val)
+		return 0;
+
+	if (mtree_iter_skiplist(iter)) {
+		const struct mtree_snode *node = iter->node;
+
+		*val = *__atomic_load_n(&node->val, __ATOMIC_ACQUIRE);
+	} else {
+		*val = ((const struct mtree_node *)iter->node)->val;
+	}
 	return 0;
 }
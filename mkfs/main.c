@@ -18,6 +18,7 @@ struct aulsmfs_config {
 	uint64_t bytes;
 	uint64_t pages;
 	uint64_t page_size;
+	uint64_t levels;
 	const char *path;
 	int fd;
 };
@@ -31,6 +32,7 @@ static int aulsmfs_mkfs(const struct aulsmfs_config *config)
 	super.version = htole64(AULSMFS_VERSION);
 	super.page_size = htole64(config->page_size);
 	super.pages = htole64(config->pages);
+	super.levels = htole64(config->levels);
 	super.csum = htole64(crc64(&super, sizeof(super)));
 
 	return file_write_at(config->fd, &super, sizeof(super), 0);
@@ -40,6 +42,7 @@ static void aulsmfs_config_default(struct aulsmfs_config *config)
 {
 	config->bytes = config->pages = 0;
 	config->page_size = 4096;
+	config->levels = AULSMFS_DEFAULT_DISK_TREES;
 	config->path = NULL;
 	config->fd = -1;
 }
@@ -94,11 +97,12 @@ static void aulsmfs_config_release(struct aulsmfs_config *config)
 		close(config->fd);
 }
 
-static const char *aulsmfs_short_opts = "s:p:P:h";
+static const char *aulsmfs_short_opts = "s:p:P:l:h";
 static const struct option aulsmfs_long_opts[] = {
 	{"size", required_argument, NULL, 's'},
 	{"pages", required_argument, NULL, 'p'},
 	{"page_size", required_argument, NULL, 'P'},
+	{"levels", required_argument, NULL, 'l'},
 	{"help", no_argument, NULL, 'h'},
 	{NULL, 0, NULL, 0}
 };
@@ -110,6 +114,7 @@ static void usage(const char *name)
 	printf("\t--size      -s <bytes>    number of bytes for filesystem\n");
 	printf("\t--pages     -p <pages>    number of pages for filesystem\n");
 	printf("\t--page_size -P <bytes>    page size in bytes\n");
+	printf("\t--levels    -l <levels>   number of disk levels of trees\n");
 	printf("\t--help      -h            show this message\n");
 }
 
@@ -150,6 +155,19 @@ int main(int argc, char **argv)
 				exit(1);
 			}
 			break;
+		case 'l':
+			config.levels = strtoull(optarg, &endptr, 0);
+			if (*endptr) {
+				printf("Wrong number of levels: %s\n", optarg);
+				exit(1);
+			}
+			if (!config.levels ||
+				config.levels > AULSMFS_MAX_DISK_TREES) {
+				printf("Number of levels must be between 1 "
+					"and %d\n", AULSMFS_MAX_DISK_TREES);
+				exit(1);
+			}
+			break;
 		case 'h':
 			usage(argv[0]);
 			break;
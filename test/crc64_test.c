@@ -0,0 +1,298 @@
+#include <crc64.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdio.h>
+
+
+/* Reversed "Jones" polynomial, see gen_crc64_table.py. */
+static const uint64_t POLY = 0x95ac9329ac4bc9b5ull;
+
+static const size_t BENCH_SIZE = 64 * 1024 * 1024;
+
+static double test_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t crc64_bitwise(uint64_t crc, const unsigned char *data,
+			size_t size)
+{
+	while (size--) {
+		crc ^= *data++;
+		for (int i = 0; i != 8; ++i)
+			crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+	}
+	return crc;
+}
+
+/* All the sizes around the 16 and 64 byte steps of the folding code, at
+ * every alignment within a word and with a non zero initial value. */
+static int check_crc64(const unsigned char *data)
+{
+	for (size_t size = 0; size != 1024; ++size) {
+		for (size_t offs = 0; offs != 8; ++offs) {
+			const uint64_t init = size * 0x9e3779b97f4a7c15ull;
+			const uint64_t expected = crc64_bitwise(init,
+						data + offs, size);
+
+			if (__crc64_table(init, data + offs, size) != expected) {
+				printf("__crc64_table mismatch, size %zu\n",
+							size);
+				return -1;
+			}
+			if (__crc64(init, data + offs, size) != expected) {
+				printf("__crc64 mismatch, size %zu\n", size);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* CRC of a buffer split at any point must be the combination of the CRCs
+ * of both parts, parallel slices must give the same CRC as one pass. */
+static int check_combine(const unsigned char *data)
+{
+	const size_t size = 4096 + 7;
+	const uint64_t init = 0x9e3779b97f4a7c15ull;
+	const uint64_t whole = __crc64(init, data, size);
+
+	for (size_t split = 0; split <= size; ++split) {
+		const uint64_t crc_a = __crc64(init, data, split);
+		const uint64_t crc_b = crc64(data + split, size - split);
+
+		if (crc64_combine(crc_a, crc_b, size - split) != whole) {
+			printf("crc64_combine mismatch, split %zu\n", split);
+			return -1;
+		}
+	}
+
+	for (int threads = 1; threads <= 8; ++threads) {
+		if (__crc64_parallel(init, data, BENCH_SIZE - 3, threads) !=
+					__crc64(init, data, BENCH_SIZE - 3)) {
+			printf("__crc64_parallel mismatch, %d threads\n",
+						threads);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* memcpy_crc64 must copy exactly size bytes to any alignment and give the
+ * same CRC as __crc64. */
+static int check_memcpy(const unsigned char *data, unsigned char *buf)
+{
+	for (size_t size = 0; size != 1024; ++size) {
+		for (size_t offs = 0; offs != 8; ++offs) {
+			struct crc64_ctx ctx = { .crc = size };
+
+			memset(buf, 0xaa, size + 16);
+			memcpy_crc64(buf + offs, data + 8 - offs, size, &ctx);
+			if (crc64_ctx_csum(&ctx) !=
+					__crc64(size, data + 8 - offs, size) ||
+					memcmp(buf + offs, data + 8 - offs,
+						size) ||
+					buf[offs + size] != 0xaa) {
+				printf("memcpy_crc64 mismatch, size %zu\n",
+							size);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* How log chunks get their CRC: one pass over the chunk when it's full,
+ * every item checksummed while it's copied, or a pass over every run of at
+ * least run bytes copied since the last one, as trans_log does. */
+enum bench_log_mode {
+	BENCH_LOG_CHUNK,
+	BENCH_LOG_FUSED,
+	BENCH_LOG_RUNS,
+};
+
+static const size_t BENCH_CHUNK = 128 * 1024;
+
+/* Copies items of 1 to 256 bytes, each after a 2 byte header, into 128KB
+ * chunks the way trans_log_append does. Items come from the first 64KB of
+ * data, so that they are cache hot as log items usually are. The CRCs of
+ * all the chunks are xored into crc, so that the modes can be checked
+ * against each other. */
+static double bench_log(unsigned char *chunk, const unsigned char *data,
+			enum bench_log_mode mode, size_t run, uint64_t *crc)
+{
+	const double start = test_now();
+	struct crc64_ctx ctx;
+	size_t size = 0, done = 0, item = 0;
+	size_t total = 0;
+
+	*crc = 0;
+	crc64_ctx_setup(&ctx);
+	for (; total < BENCH_SIZE; ++item) {
+		const size_t len = item * 37 % 256 + 1;
+		const unsigned char *src = data + total % (64 * 1024);
+		const uint16_t header = len;
+
+		if (size + len + sizeof(header) > BENCH_CHUNK) {
+			if (mode == BENCH_LOG_CHUNK)
+				crc64_ctx_update(&ctx, chunk, size);
+			else if (mode == BENCH_LOG_RUNS)
+				crc64_ctx_update(&ctx, chunk + done,
+							size - done);
+			*crc ^= crc64_ctx_csum(&ctx);
+			crc64_ctx_setup(&ctx);
+			size = done = 0;
+		}
+
+		if (mode == BENCH_LOG_FUSED) {
+			memcpy_crc64(chunk + size, &header, sizeof(header),
+						&ctx);
+			memcpy_crc64(chunk + size + sizeof(header),
+						src, len, &ctx);
+		} else {
+			memcpy(chunk + size, &header, sizeof(header));
+			memcpy(chunk + size + sizeof(header), src, len);
+		}
+		size += len + sizeof(header);
+		total += len;
+
+		if (mode == BENCH_LOG_RUNS && size - done >= run) {
+			crc64_ctx_update(&ctx, chunk + done, size - done);
+			done = size;
+		}
+	}
+	return BENCH_SIZE / (test_now() - start) / 1e9;
+}
+
+/* Checksums cache hot 4KB nodes of 16 to 64 byte entries either entry by
+ * entry, as a running CRC kept by ctree_node_append would, or in one pass
+ * over the sealed node, as ctree_node_prepare does. */
+static double bench_node(const unsigned char *data, int per_entry,
+			uint64_t *crc)
+{
+	const double start = test_now();
+	const size_t size = 4096;
+
+	*crc = 0;
+	for (size_t offs = 0; offs + size <= BENCH_SIZE; offs += size) {
+		const unsigned char *node = data + offs % (64 * 1024);
+		struct crc64_ctx ctx;
+
+		if (!per_entry) {
+			*crc ^= crc64(node, size);
+			continue;
+		}
+
+		crc64_ctx_setup(&ctx);
+		for (size_t pos = 0, i = 0; pos != size; ++i) {
+			size_t len = 16 + i * 37 % 49;
+
+			if (len > size - pos)
+				len = size - pos;
+			crc64_ctx_update(&ctx, node + pos, len);
+			pos += len;
+		}
+		*crc ^= crc64_ctx_csum(&ctx);
+	}
+	return BENCH_SIZE / (test_now() - start) / 1e9;
+}
+
+static double bench_crc64(uint64_t (*fn)(uint64_t, const void *, size_t),
+			const unsigned char *data, size_t size, uint64_t *crc)
+{
+	const double start = test_now();
+
+	*crc = 0;
+	for (size_t offs = 0; offs + size <= BENCH_SIZE; offs += size)
+		*crc ^= fn(CRC64_INIT, data + offs, size);
+	return BENCH_SIZE / (test_now() - start) / 1e9;
+}
+
+int main()
+{
+	unsigned char *data = malloc(BENCH_SIZE);
+	unsigned char *copy = malloc(BENCH_SIZE);
+	int ret = -1;
+
+	if (!data || !copy) {
+		puts("allocation failed");
+		goto out;
+	}
+
+	srand(42);
+	for (size_t i = 0; i != BENCH_SIZE; ++i)
+		data[i] = rand();
+	memset(copy, 0, BENCH_SIZE);
+
+	if (check_crc64(data) || check_combine(data) || check_memcpy(data, copy))
+		goto out;
+
+	/* Node sized and log chunk sized buffers. */
+	const size_t sizes[] = { 4096, 32768, 1024 * 1024 };
+
+	for (size_t i = 0; i != sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		uint64_t table, crc;
+		const double table_speed = bench_crc64(&__crc64_table, data,
+					sizes[i], &table);
+		const double speed = bench_crc64(&__crc64, data, sizes[i],
+					&crc);
+
+		if (table != crc) {
+			puts("__crc64 and __crc64_table disagree");
+			goto out;
+		}
+		printf("crc64 of %zu byte buffers: %.2f GB/s with tables, "
+					"%.2f GB/s with __crc64\n", sizes[i],
+					table_speed, speed);
+	}
+
+	/* Log items are copied into the chunk and checksummed, trans_log
+	 * uses 16KB runs. */
+	uint64_t chunk_crc, fused_crc, run_crc;
+	const double chunk_speed = bench_log(copy, data, BENCH_LOG_CHUNK, 0,
+				&chunk_crc);
+	const double fused_speed = bench_log(copy, data, BENCH_LOG_FUSED, 0,
+				&fused_crc);
+	const double run_speed = bench_log(copy, data, BENCH_LOG_RUNS,
+				16 * 1024, &run_crc);
+
+	if (fused_crc != chunk_crc || run_crc != chunk_crc) {
+		puts("log chunk CRCs disagree");
+		goto out;
+	}
+	printf("log items into 128KB chunks: %.2f GB/s with crc64 per chunk, "
+				"%.2f GB/s with memcpy_crc64 per item, "
+				"%.2f GB/s with crc64 per 16KB run\n",
+				chunk_speed, fused_speed, run_speed);
+
+	uint64_t node_crc, entry_crc;
+	const double node_speed = bench_node(data, 0, &node_crc);
+	const double entry_speed = bench_node(data, 1, &entry_crc);
+
+	if (node_crc != entry_crc) {
+		puts("node CRCs disagree");
+		goto out;
+	}
+	printf("4KB nodes of 16 to 64 byte entries: %.2f GB/s with crc64 "
+				"per node, %.2f GB/s with crc64 per entry\n",
+				node_speed, entry_speed);
+
+	const double start = test_now();
+	const uint64_t crc = crc64_parallel(data, BENCH_SIZE);
+	const double elapsed = test_now() - start;
+
+	printf("crc64_parallel of %zu bytes: %.2f GB/s, crc %016llx\n",
+				BENCH_SIZE, BENCH_SIZE / elapsed / 1e9,
+				(unsigned long long)crc);
+	ret = 0;
+out:
+	free(copy);
+	free(data);
+	return ret;
+}
@@ -6,7 +6,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 
+#include <endian.h>
 #include <string.h>
+#include <time.h>
 #include <stdint.h>
 #include <errno.h>
 #include <stdio.h>
@@ -69,6 +71,16 @@ static int test_write(struct io *io, const void *buf, size_t size, off_t offs)
 	return file_write_at(file->fd, buf, size, offs);
 }
 
+static size_t readahead_bytes;
+
+static int test_readahead(struct io *io, size_t size, off_t offs)
+{
+	struct file_io *file = (struct file_io *)io;
+
+	readahead_bytes += size;
+	return file_readahead(file->fd, size, offs);
+}
+
 static int test_sync(struct io *io)
 {
 	(void) io;
@@ -91,12 +103,27 @@ static int test_cmp(const struct lsm_key *l, const struct lsm_key *r)
 
 static const size_t KEYS = 10000000;
 
-static int create_ctree(struct ctree *ctree, struct io *io, struct alloc *alloc)
+static double test_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int create_ctree(struct ctree *ctree, struct io *io,
+			struct alloc *alloc, size_t write_queue, int leaf_format,
+			int fence_index)
 {
 	struct ctree_builder builder;
+	const double start = test_now();
 	int rc;
 
 	ctree_builder_setup(&builder, io, alloc);
+	builder.bloom_bits = 10;
+	builder.write_queue = write_queue;
+	builder.leaf_format = leaf_format;
+	builder.fence_index = fence_index;
 	for (size_t i = 0; i != KEYS; ++i) {
 		struct test_key data = { .value = 2 * i };
 		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
@@ -114,9 +141,12 @@ static int create_ctree(struct ctree *ctree, struct io *io, struct alloc *alloc)
 		ctree_builder_release(&builder);
 		return -1;
 	}
-	ctree->ptr = builder.ptr;
-	ctree->height = builder.height;
+	ctree_reset(ctree, &builder.ptr, &builder.bloom, &builder.fence,
+				builder.height, builder.pages);
 	ctree_builder_release(&builder);
+	printf("create_ctree with write queue of %zu nodes: %.3f s, "
+				"%zu pages\n", write_queue, test_now() - start,
+				ctree->pages);
 	return 0;
 }
 
@@ -407,10 +437,294 @@ out:
 	return rc;
 }
 
+static int bloom_ctree(struct ctree *ctree)
+{
+	size_t false_positives = 0;
+
+	for (size_t i = 0; i != KEYS; ++i) {
+		struct test_key data = { .value = 2 * (long long)i };
+		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
+
+		if (!ctree_may_contain(ctree, &key)) {
+			puts("bloom filter false negative");
+			return -1;
+		}
+
+		data.value = 2 * (long long)i + 1;
+		if (ctree_may_contain(ctree, &key))
+			++false_positives;
+	}
+
+	printf("bloom filter: %zu false positives out of %zu\n",
+				false_positives, KEYS);
+	return 0;
+}
+
+/* A scan without a cache reads every node on its own, all of them but the
+ * first few must come from the node pool. */
+static int pool_ctree(struct ctree *ctree)
+{
+	struct ctree_cache *cache = ctree->cache;
+	struct ctree_pool_stats before, after;
+	double start;
+	int ret;
+
+	ctree_set_cache(ctree, NULL);
+	ctree_pool_stats(&before);
+	start = test_now();
+	ret = iterate_ctree_forward(ctree);
+	ctree_pool_stats(&after);
+	ctree_set_cache(ctree, cache);
+
+	if (ret)
+		return ret;
+
+	printf("uncached scan: %.3f s, %llu nodes allocated, %llu reused\n",
+				test_now() - start,
+				after.allocs - before.allocs,
+				after.reuses - before.reuses);
+
+	if (after.allocs - before.allocs > ctree->height + 1) {
+		puts("scan doesn't reuse nodes");
+		return -1;
+	}
+	return 0;
+}
+
+/* Keys that look like namemap keys: big endian parent id followed by a
+ * name, so that neighbours share long prefixes. */
+struct name_key {
+	uint64_t parent;
+	char name[24];
+};
+
+static size_t name_key(size_t i, struct name_key *key)
+{
+	const uint64_t parent = i / 64;
+
+	key->parent = htobe64(parent);
+	return sizeof(key->parent) + snprintf(key->name, sizeof(key->name),
+				"file-%016zu", i);
+}
+
+static int name_cmp(const struct lsm_key *l, const struct lsm_key *r)
+{
+	const size_t size = l->size < r->size ? l->size : r->size;
+	const int cmp = memcmp(l->ptr, r->ptr, size);
+
+	if (cmp)
+		return cmp;
+	return l->size < r->size ? -1 : l->size > r->size;
+}
+
+static int __prefix_ctree(struct io *io, struct alloc *alloc, int leaf_format,
+			size_t compress_pages, size_t *pages)
+{
+	const size_t keys = KEYS / 10;
+	struct ctree_builder builder;
+	struct ctree_iter iter;
+	struct ctree ctree;
+	struct name_key data;
+	struct lsm_key key = { .ptr = &data };
+	struct lsm_val val = { .ptr = &data.parent, .size = 8 };
+	size_t count = 0;
+	int ret = -1;
+
+	ctree_builder_setup(&builder, io, alloc);
+	builder.leaf_format = leaf_format;
+	if (compress_pages) {
+		builder.leaf_pages = compress_pages;
+		builder.compress = 1;
+	}
+	for (size_t i = 0; i != keys; ++i) {
+		key.size = name_key(i, &data);
+		if (ctree_builder_append(&builder, &key, &val) < 0) {
+			ctree_builder_release(&builder);
+			return -1;
+		}
+	}
+	if (ctree_builder_finish(&builder) < 0) {
+		ctree_builder_release(&builder);
+		return -1;
+	}
+
+	ctree_setup(&ctree, io, &name_cmp);
+	ctree_reset(&ctree, &builder.ptr, &builder.bloom, &builder.fence,
+				builder.height, builder.pages);
+	ctree_builder_release(&builder);
+	*pages = ctree.pages;
+
+	ctree_iter_setup(&iter, &ctree);
+	if (ctree_begin(&iter) < 0)
+		goto out;
+
+	do {
+		struct lsm_key found;
+
+		key.size = name_key(count, &data);
+		if (ctree_key(&iter, &found) < 0 || name_cmp(&key, &found))
+			goto out;
+		++count;
+	} while (ctree_next(&iter) == 0);
+
+	if (count != keys)
+		goto out;
+
+	for (size_t i = 0; i < keys; i += 997) {
+		struct lsm_key found;
+
+		key.size = name_key(i, &data);
+		if (ctree_lookup(&iter, &key) < 0 ||
+				ctree_key(&iter, &found) < 0 ||
+				name_cmp(&key, &found))
+			goto out;
+	}
+	ret = 0;
+out:
+	ctree_iter_release(&iter);
+	ctree_release(&ctree);
+	return ret;
+}
+
+static int prefix_ctree(struct io *io, struct alloc *alloc)
+{
+	size_t plain, prefix, lz_plain, lz_prefix;
+
+	if (__prefix_ctree(io, alloc, AULSMFS_NODE_PLAIN, 0, &plain) ||
+			__prefix_ctree(io, alloc, AULSMFS_NODE_PREFIX, 0,
+				&prefix) ||
+			__prefix_ctree(io, alloc, AULSMFS_NODE_PLAIN, 8,
+				&lz_plain) ||
+			__prefix_ctree(io, alloc, AULSMFS_NODE_PREFIX, 8,
+				&lz_prefix))
+		return -1;
+
+	printf("name keys take %zu pages in plain leaves, %zu in prefix "
+				"compressed\n", plain, prefix);
+	printf("with lz compressed 8 page leaves: %zu and %zu pages\n",
+				lz_plain, lz_prefix);
+	if (prefix >= plain || lz_plain >= plain) {
+		puts("compression doesn't save space");
+		return -1;
+	}
+	return 0;
+}
+
+static int __search_ctree(struct io *io, struct ctree_cache *cache,
+			const struct ctree_builder *builder, ctree_cmp_t cmp,
+			double *elapsed)
+{
+	const size_t keys = KEYS / 10;
+	struct ctree_iter iter;
+	struct ctree ctree;
+	struct name_key data;
+	struct lsm_key key = { .ptr = &data };
+	double best = 0;
+	int ret = -1;
+
+	ctree_setup(&ctree, io, cmp);
+	ctree_set_cache(&ctree, cache);
+	ctree_set_pin_interior(&ctree, 1);
+	ctree_reset(&ctree, &builder->ptr, &builder->bloom, &builder->fence,
+				builder->height, builder->pages);
+	ctree_iter_setup(&iter, &ctree);
+
+	/* The first pass only warms up the cache, then the best of the rest
+	 * is taken, so that noise doesn't decide between comparators. */
+	for (int pass = 0; pass != 4; ++pass) {
+		const double start = test_now();
+
+		for (size_t i = 0; i != keys; ++i) {
+			struct lsm_key found;
+
+			key.size = name_key(i, &data);
+			if (ctree_lookup(&iter, &key) <= 0 ||
+					ctree_key(&iter, &found) < 0 ||
+					name_cmp(&key, &found))
+				goto out;
+		}
+		const double time = test_now() - start;
+
+		if (pass == 1 || (pass && time < best))
+			best = time;
+	}
+	*elapsed = best;
+	ret = 0;
+out:
+	ctree_iter_release(&iter);
+	ctree_release(&ctree);
+	return ret;
+}
+
+/* Name keys are bytewise ordered, so lookups with key schema comparators
+ * must find the same keys as with an opaque comparator. */
+static int search_ctree(struct io *io, struct alloc *alloc,
+			struct ctree_cache *cache)
+{
+	const size_t keys = KEYS / 10;
+	struct ctree_builder builder;
+	struct name_key data;
+	struct lsm_key key = { .ptr = &data };
+	struct lsm_val val = { .ptr = &data.parent, .size = 8 };
+	double opaque, bytes, u64_bytes;
+	int ret = -1;
+
+	ctree_builder_setup(&builder, io, alloc);
+	for (size_t i = 0; i != keys; ++i) {
+		key.size = name_key(i, &data);
+		if (ctree_builder_append(&builder, &key, &val) < 0)
+			goto out;
+	}
+	if (ctree_builder_finish(&builder) < 0)
+		goto out;
+
+	if (__search_ctree(io, cache, &builder, &name_cmp, &opaque) ||
+			__search_ctree(io, cache, &builder, &key_bytes_cmp,
+				&bytes) ||
+			__search_ctree(io, cache, &builder, &key_u64_bytes_cmp,
+				&u64_bytes))
+		goto out;
+
+	printf("name key lookups: %.3f s with an opaque comparator, "
+				"%.3f s as bytes, %.3f s as u64 and bytes\n",
+				opaque, bytes, u64_bytes);
+	ret = 0;
+out:
+	ctree_builder_release(&builder);
+	return ret;
+}
+
+/* Every leaf but the first few of each parent must be read ahead by a
+ * forward scan. */
+static int readahead_ctree(struct ctree *ctree)
+{
+	struct ctree_cache *cache = ctree->cache;
+	const size_t before = readahead_bytes;
+	size_t pages;
+	int ret;
+
+	ctree_set_cache(ctree, NULL);
+	ret = iterate_ctree_forward(ctree);
+	ctree_set_cache(ctree, cache);
+
+	if (ret)
+		return ret;
+
+	pages = (readahead_bytes - before) / 4096;
+	printf("forward scan read ahead %zu pages out of %zu\n", pages,
+				ctree->pages);
+	if (ctree->height > 1 && pages < ctree->pages / 2) {
+		puts("scan doesn't read ahead");
+		return -1;
+	}
+	return 0;
+}
+
 static struct io_ops test_io_ops = {
 	.read = &test_read,
 	.write = &test_write,
-	.sync = &test_sync
+	.sync = &test_sync,
+	.readahead = &test_readahead
 };
 
 static struct alloc_ops test_alloc_ops = {
@@ -445,15 +759,49 @@ int main()
 		.offs = 0
 	};
 
+	struct ctree_cache_stats stats;
+	struct ctree_cache cache;
 	struct ctree ctree;
+	size_t interior_bytes;
 	int ret = -1;
 
+	ctree_cache_setup(&cache, 64 * 1024 * 1024);
 	ctree_setup(&ctree, &test_io.io, &test_cmp);
-
-	if (create_ctree(&ctree, &test_io.io, &test_alloc.alloc)) {
+	ctree_set_cache(&ctree, &cache);
+	ctree_set_pin_interior(&ctree, 1);
+
+	/* The first tree is only built to compare with the pipelined
+	 * builder and to check that plain leaves are still read, tests below
+	 * use the second one, its pinned fence index replaces the interior
+	 * nodes. */
+	if (create_ctree(&ctree, &test_io.io, &test_alloc.alloc, 0,
+				AULSMFS_NODE_PLAIN, 0)) {
 		puts("create_ctree failed");
 		goto out;
 	}
+	if (iterate_ctree_forward(&ctree)) {
+		puts("iterate_ctree_forward over plain leaves failed");
+		goto out;
+	}
+	interior_bytes = ctree.interior_bytes;
+	ctree_release(&ctree);
+	ctree_setup(&ctree, &test_io.io, &test_cmp);
+	ctree_set_cache(&ctree, &cache);
+	ctree_set_pin_interior(&ctree, 1);
+
+	if (create_ctree(&ctree, &test_io.io, &test_alloc.alloc, 4,
+				AULSMFS_NODE_PREFIX, 1)) {
+		puts("create_ctree with write queue failed");
+		goto out;
+	}
+	if (ctree.height > 2 && !ctree.fenced) {
+		puts("fence index wasn't loaded");
+		goto out;
+	}
+	if (bloom_ctree(&ctree)) {
+		puts("bloom_ctree failed");
+		goto out;
+	}
 	if (iterate_ctree_forward(&ctree)) {
 		puts("iterate_ctree_forward failed");
 		goto out;
@@ -462,14 +810,47 @@ int main()
 		puts("iterate_ctree_backward failed");
 		goto out;
 	}
+	if (pool_ctree(&ctree)) {
+		puts("pool_ctree failed");
+		goto out;
+	}
+	if (readahead_ctree(&ctree)) {
+		puts("readahead_ctree failed");
+		goto out;
+	}
+	if (prefix_ctree(&test_io.io, &test_alloc.alloc)) {
+		puts("prefix_ctree failed");
+		goto out;
+	}
+	if (search_ctree(&test_io.io, &test_alloc.alloc, &cache)) {
+		puts("search_ctree failed");
+		goto out;
+	}
+
+	const double start = test_now();
+
 	if (lookup_ctree(&ctree)) {
 		puts("lookup_ctree failed");
 		goto out;
 	}
+
+	const double elapsed = test_now() - start;
+
+	/* lookup_ctree does three searches (lookup, lower and upper bound)
+	 * per key. */
+	printf("lookup_ctree: %.3f s, %.0f lookups/s\n", elapsed,
+				3 * KEYS / elapsed);
+
+	ctree_cache_stats(&cache, &stats);
+	printf("node cache: %llu hits, %llu misses, %llu evictions\n",
+				stats.hits, stats.misses, stats.evictions);
+	printf("pinned interior nodes: %zu bytes, fence index: %zu bytes\n",
+				interior_bytes, ctree.interior_bytes);
 	ret = 0;
 
 out:
 	ctree_release(&ctree);
+	ctree_cache_release(&cache);
 	close(fd);
 
 	return ret;
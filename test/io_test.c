@@ -0,0 +1,510 @@
+#include <file_wrappers.h>
+#include <ctree.h>
+#include <fd_io.h>
+#include <crc64.h>
+#include <log.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+
+
+struct io_test_alloc {
+	struct alloc alloc;
+	uint64_t offs;
+};
+
+static int test_reserve(struct alloc *a, uint64_t size, uint64_t *offs)
+{
+	struct io_test_alloc *alloc = (struct io_test_alloc *)a;
+
+	*offs = alloc->offs;
+	alloc->offs += size;
+	return 0;
+}
+
+static int test_nop(struct alloc *a, uint64_t size, uint64_t offs)
+{
+	(void) a;
+	(void) offs;
+	(void) size;
+	return 0;
+}
+
+static struct alloc_ops test_alloc_ops = {
+	.reserve = &test_reserve,
+	.commit = &test_nop,
+	.cancel = &test_nop,
+	.free = &test_nop
+};
+
+/* An io without the asynchronous interface, its queues serve requests
+ * right at submission. */
+struct sync_io {
+	struct io io;
+	int fd;
+};
+
+static int test_read(struct io *io, void *buf, size_t size, off_t offs)
+{
+	struct sync_io *file = (struct sync_io *)io;
+
+	return file_read_at(file->fd, buf, size, offs);
+}
+
+static int test_write(struct io *io, const void *buf, size_t size, off_t offs)
+{
+	struct sync_io *file = (struct sync_io *)io;
+
+	return file_write_at(file->fd, buf, size, offs);
+}
+
+static int test_sync(struct io *io)
+{
+	(void) io;
+	return 0;
+}
+
+static struct io_ops test_io_ops = {
+	.read = &test_read,
+	.write = &test_write,
+	.sync = &test_sync
+};
+
+/* Same as sync_io, but requests are served by reap, the newest first, so
+ * they complete in the reverse order of submission. */
+static int lifo_submit(struct io_queue *queue, struct io_req **req,
+			size_t count)
+{
+	for (size_t i = 0; i != count; ++i) {
+		req[i]->next = queue->priv;
+		queue->priv = req[i];
+	}
+	return 0;
+}
+
+static int lifo_reap(struct io_queue *queue, size_t min)
+{
+	struct io *io = queue->io;
+
+	for (size_t i = 0; i != (min ? min : 1) && queue->priv; ++i) {
+		struct io_req *req = queue->priv;
+
+		queue->priv = req->next;
+		if (req->op == IO_REQ_WRITE) {
+			const int rc = io_write(io, req->buf, req->size,
+						req->offs);
+
+			req->result = rc < 0 ? rc
+						: (ssize_t)io_bytes(io, req->size);
+		} else {
+			req->result = io_read(io, req->buf, req->size,
+						req->offs);
+		}
+		io_queue_complete(queue, req);
+	}
+	return 0;
+}
+
+static struct io_ops test_lifo_ops = {
+	.read = &test_read,
+	.write = &test_write,
+	.sync = &test_sync,
+	.submit = &lifo_submit,
+	.reap = &lifo_reap
+};
+
+struct test_key {
+	long long value;
+};
+
+static int test_cmp(const struct lsm_key *l, const struct lsm_key *r)
+{
+	struct test_key left, right;
+
+	/* Keys in nodes aren't aligned. */
+	memcpy(&left, l->ptr, sizeof(left));
+	memcpy(&right, r->ptr, sizeof(right));
+	if (left.value != right.value)
+		return left.value < right.value ? -1 : 1;
+	return 0;
+}
+
+static const size_t PAGE_SIZE = 4096;
+static const size_t PAGES = 1024;
+static const size_t KEYS = 200000;
+static const size_t ITEMS = 10000;
+
+static double test_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void count_complete(struct io_req *req)
+{
+	size_t *count = req->arg;
+
+	++*count;
+}
+
+/* Submits requests for all the pages in a scattered order, every request
+ * is one page of buf at the same offset in the file. */
+static int transfer_pages(struct io *io, struct io_req *req, char *buf,
+			size_t depth, int write, int fixed)
+{
+	struct io_queue queue;
+	size_t complete = 0;
+	int rc;
+
+	rc = io_queue_setup(&queue, io, depth);
+	if (rc < 0) {
+		puts("io_queue_setup failed");
+		return -1;
+	}
+
+	const struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = PAGES * PAGE_SIZE
+	};
+
+	if (fixed && io_queue_register(&queue, &iov, 1) < 0)
+		puts("io_queue_register failed, buffers aren't fixed");
+
+	for (size_t i = 0; i != PAGES && rc == 0; ++i) {
+		const size_t page = i * 7919 % PAGES;
+		struct io_req *r = &req[i];
+
+		if (write)
+			io_req_write(r, buf + page * PAGE_SIZE, 1, page);
+		else
+			io_req_read(r, buf + page * PAGE_SIZE, 1, page);
+		r->buf_index = fixed ? 0 : -1;
+		r->done = &count_complete;
+		r->arg = &complete;
+		rc = io_queue_submit(&queue, &r, 1);
+	}
+
+	if (rc == 0)
+		rc = io_queue_drain(&queue);
+	io_queue_release(&queue);
+
+	if (rc < 0) {
+		puts("io_queue_submit failed");
+		return -1;
+	}
+
+	if (complete != PAGES) {
+		puts("wrong number of completions");
+		return -1;
+	}
+
+	for (size_t i = 0; i != PAGES; ++i) {
+		if (req[i].result != (ssize_t)PAGE_SIZE) {
+			printf("request failed: %zd\n", req[i].result);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int check_requests(struct io *io, int fixed)
+{
+	const size_t size = PAGES * PAGE_SIZE;
+	struct io_req *req = calloc(PAGES, sizeof(*req));
+	char *data = malloc(size);
+	char *buf = malloc(size);
+	int ret = -1;
+
+	if (!req || !data || !buf) {
+		puts("allocation failed");
+		goto out;
+	}
+
+	for (size_t i = 0; i != size; ++i)
+		data[i] = rand();
+
+	if (transfer_pages(io, req, data, 16, 1, fixed))
+		goto out;
+
+	const double start = test_now();
+
+	if (transfer_pages(io, req, buf, 1, 0, fixed))
+		goto out;
+
+	const double qd1 = test_now() - start;
+
+	if (memcmp(data, buf, size)) {
+		puts("wrong data read");
+		goto out;
+	}
+
+	memset(buf, 0, size);
+	const double restart = test_now();
+
+	if (transfer_pages(io, req, buf, 16, 0, fixed))
+		goto out;
+
+	const double qd16 = test_now() - restart;
+
+	if (memcmp(data, buf, size)) {
+		puts("wrong data read");
+		goto out;
+	}
+
+	/* Reads stop at the end of file. */
+	struct io_queue queue;
+	struct io_req *r = &req[0];
+
+	if (io_queue_setup(&queue, io, 1) < 0) {
+		puts("io_queue_setup failed");
+		goto out;
+	}
+
+	io_req_read(r, buf, 2, PAGES - 1);
+	if (io_queue_submit(&queue, &r, 1) < 0 || io_queue_drain(&queue) < 0) {
+		io_queue_release(&queue);
+		puts("io_queue_submit failed");
+		goto out;
+	}
+	io_queue_release(&queue);
+
+	if (r->result != (ssize_t)PAGE_SIZE) {
+		printf("read past the end of file returned %zd\n", r->result);
+		goto out;
+	}
+
+	printf("%zu page reads: %.3f ms at depth 1, %.3f ms at depth 16\n",
+				PAGES, qd1 * 1e3, qd16 * 1e3);
+	ret = 0;
+out:
+	free(buf);
+	free(data);
+	free(req);
+	return ret;
+}
+
+static int check_ctree(struct io *io, struct alloc *alloc)
+{
+	struct ctree_builder builder;
+	struct ctree_iter iter;
+	struct ctree ctree;
+	const double start = test_now();
+	int ret = -1;
+
+	ctree_builder_setup(&builder, io, alloc);
+	builder.write_queue = 8;
+	for (size_t i = 0; i != KEYS; ++i) {
+		struct test_key data = { .value = 2 * i };
+		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
+		struct lsm_val val = { .ptr = &data, .size = sizeof(data) };
+
+		if (ctree_builder_append(&builder, &key, &val) < 0) {
+			ctree_builder_release(&builder);
+			puts("ctree_builder_append failed");
+			return -1;
+		}
+	}
+
+	if (ctree_builder_finish(&builder) < 0) {
+		ctree_builder_release(&builder);
+		puts("ctree_builder_finish failed");
+		return -1;
+	}
+
+	const double built = test_now();
+
+	ctree_setup(&ctree, io, &test_cmp);
+	ctree_set_pin_interior(&ctree, 1);
+	ctree_reset(&ctree, &builder.ptr, &builder.bloom, &builder.fence,
+				builder.height, builder.pages);
+	ctree_builder_release(&builder);
+
+	if (ctree.height > 1 && !ctree.interior_bytes) {
+		puts("interior nodes aren't loaded");
+		goto out;
+	}
+
+	ctree_iter_setup(&iter, &ctree);
+	for (size_t i = 0; i != KEYS; ++i) {
+		struct test_key data = { .value = 2 * i };
+		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
+		struct lsm_val val;
+
+		if (ctree_lookup(&iter, &key) < 0 ||
+					ctree_val(&iter, &val) < 0 ||
+					val.size != sizeof(data) ||
+					memcmp(val.ptr, &data, sizeof(data))) {
+			ctree_iter_release(&iter);
+			puts("ctree_lookup failed");
+			goto out;
+		}
+	}
+	ctree_iter_release(&iter);
+
+	printf("ctree of %zu keys: %.3f s to build, %.3f s to load and "
+				"look up\n", KEYS, built - start,
+				test_now() - built);
+	ret = 0;
+out:
+	ctree_release(&ctree);
+	return ret;
+}
+
+static int check_chunk(struct io *io, const struct aulsmfs_ptr *ptr)
+{
+	const size_t size = io_bytes(io, le64toh(ptr->size));
+	void *buf = malloc(size);
+	int ret = -1;
+
+	if (!buf) {
+		puts("allocation failed");
+		return -1;
+	}
+
+	if (io_read(io, buf, le64toh(ptr->size), le64toh(ptr->offs)) < 0)
+		puts("io_read failed");
+	else if (crc64(buf, size) != le64toh(ptr->csum))
+		puts("wrong log chunk checksum");
+	else
+		ret = 0;
+	free(buf);
+	return ret;
+}
+
+static int check_log(struct io *io, struct alloc *alloc)
+{
+	struct trans_log log;
+	char item[256];
+	int ret = -1;
+
+	trans_log_setup(&log, io, alloc);
+	for (size_t i = 0; i != ITEMS; ++i) {
+		const struct log_item it = {
+			.ptr = item,
+			.size = 1 + rand() % sizeof(item)
+		};
+
+		memset(item, (int)i, sizeof(item));
+		if (trans_log_append(&log, &it) < 0) {
+			puts("trans_log_append failed");
+			goto out;
+		}
+	}
+
+	if (trans_log_finish(&log) < 0) {
+		puts("trans_log_finish failed");
+		goto out;
+	}
+
+	if (log.chunks < 2) {
+		puts("log fits into one chunk");
+		goto out;
+	}
+
+	for (size_t i = 0; i != log.chunks; ++i) {
+		if (check_chunk(io, &log.chunk[i]))
+			goto out;
+	}
+	if (check_chunk(io, &log.ptr))
+		goto out;
+	ret = 0;
+out:
+	trans_log_release(&log);
+	return ret;
+}
+
+static int check_io(struct io *io, int fd, const char *name, int fixed)
+{
+	struct io_test_alloc alloc = {
+		.alloc = {
+			.ops = &test_alloc_ops
+		},
+		.offs = PAGES
+	};
+
+	printf("%s:\n", name);
+	if (ftruncate(fd, PAGES * PAGE_SIZE) < 0) {
+		perror("ftruncate failed");
+		return -1;
+	}
+
+	if (check_requests(io, fixed) ||
+				check_ctree(io, &alloc.alloc) ||
+				check_log(io, &alloc.alloc)) {
+		printf("%s failed\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+int main()
+{
+	const int fd = open("io", O_RDWR | O_CREAT | O_TRUNC,
+				S_IRUSR | S_IWUSR);
+	int ret = -1;
+
+	if (fd < 0) {
+		perror("open failed");
+		return -1;
+	}
+
+	struct sync_io sync_io = {
+		.io = {
+			.ops = &test_io_ops,
+			.page_size = PAGE_SIZE
+		},
+		.fd = fd
+	};
+	struct sync_io lifo_io = {
+		.io = {
+			.ops = &test_lifo_ops,
+			.page_size = PAGE_SIZE
+		},
+		.fd = fd
+	};
+	struct fd_io fio;
+
+	srand(42);
+	if (check_io(&sync_io.io, fd, "synchronous io", 0))
+		goto out;
+
+	if (check_io(&lifo_io.io, fd, "reversed completions", 0))
+		goto out;
+
+	if (fd_io_setup(&fio, fd, PAGE_SIZE, FD_IO_POOL) < 0) {
+		puts("fd_io_setup failed");
+		goto out;
+	}
+	ret = check_io(&fio.io, fd, "thread pool", 0);
+	fd_io_release(&fio);
+	if (ret)
+		goto out;
+
+	ret = -1;
+	if (fd_io_setup(&fio, fd, PAGE_SIZE, 0) < 0) {
+		puts("fd_io_setup failed");
+		goto out;
+	}
+
+	if (fio.uring) {
+		ret = check_io(&fio.io, fd, "io_uring", 1);
+	} else {
+		puts("io_uring isn't supported, skipped");
+		ret = 0;
+	}
+	fd_io_release(&fio);
+out:
+	close(fd);
+	return ret;
+}
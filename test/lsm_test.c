@@ -6,8 +6,10 @@
 #include <unistd.h>
 #include <fcntl.h>
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
 #include <errno.h>
 #include <stdio.h>
 
@@ -15,6 +17,7 @@
 struct ctree_test_alloc {
 	struct alloc alloc;
 	uint64_t offs;
+	uint64_t freed;
 };
 
 static int test_reserve(struct alloc *a, uint64_t size, uint64_t *offs)
@@ -44,9 +47,10 @@ static int test_cancel(struct alloc *a, uint64_t size, uint64_t offs)
 
 static int test_free(struct alloc *a, uint64_t size, uint64_t offs)
 {
-	(void) a;
+	struct ctree_test_alloc *alloc = (struct ctree_test_alloc *)a;
+
 	(void) offs;
-	(void) size;
+	alloc->freed += size;
 	return 0;
 }
 
@@ -69,6 +73,13 @@ static int test_write(struct io *io, const void *buf, size_t size, off_t offs)
 	return file_write_at(file->fd, buf, size, offs);
 }
 
+static int test_readahead(struct io *io, size_t size, off_t offs)
+{
+	struct file_io *file = (struct file_io *)io;
+
+	return file_readahead(file->fd, size, offs);
+}
+
 static int test_sync(struct io *io)
 {
 	(void) io;
@@ -91,15 +102,65 @@ static int test_cmp(const struct lsm_key *l, const struct lsm_key *r)
 
 static const size_t KEYS = 10000000;
 
-static int create_lsm(struct lsm *lsm)
+static double test_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double merge_time;
+
+static int merge_lsm(struct lsm *lsm, int tree)
+{
+	static struct lsm_merge_policy policy;
+	const double start = test_now();
+	int rc;
+
+	lsm_merge_policy_setup(&policy);
+	rc = lsm_merge(lsm, tree, &policy);
+	lsm_merge_policy_release(&policy);
+	merge_time += test_now() - start;
+	return rc;
+}
+
+static float *latency;
+
+static int latency_cmp(const void *l, const void *r)
+{
+	const float left = *(const float *)l;
+	const float right = *(const float *)r;
+
+	if (left != right)
+		return left < right ? -1 : 1;
+	return 0;
+}
+
+static void print_latency(const char *name)
+{
+	static const double pct[] = { 50.0, 99.0, 99.9, 99.99, 99.999 };
+
+	qsort(latency, KEYS, sizeof(*latency), &latency_cmp);
+	printf("%s lsm_add latency:", name);
+	for (size_t i = 0; i != sizeof(pct) / sizeof(pct[0]); ++i)
+		printf(" p%g %.1f us,", pct[i],
+				latency[(size_t)(KEYS * pct[i] / 100.0)] / 1e3);
+	printf(" max %.1f us\n", latency[KEYS - 1] / 1e3);
+}
+
+/* With background merges c0 is merged and disk levels are compacted by the
+ * lsm itself, otherwise we merge it synchronously. In both cases the
+ * latency includes the time of all merges done on behalf of the key. */
+static int create_lsm(struct lsm *lsm, int background)
 {
-	struct lsm_merge_policy policy;
 	int rc;
 
 	for (size_t i = 0; i != KEYS; ++i) {
 		struct test_key data = { .value = 2 * (long long)i };
 		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
 		struct lsm_val val = { .ptr = NULL, .size = 0 };
+		const double start = test_now();
 
 		rc = lsm_add(lsm, &key, &val);
 		if (rc < 0) {
@@ -107,45 +168,50 @@ static int create_lsm(struct lsm *lsm)
 			return -1;
 		}
 
-		if ((i + 1) % 70000 == 0) {
-			lsm_merge_policy_setup(&policy);
-			rc = lsm_merge(lsm, 0, &policy);
-			lsm_merge_policy_release(&policy);
+		if (!background && (i + 1) % 70000 == 0) {
+			rc = merge_lsm(lsm, 0);
 			if (rc < 0) {
 				puts("lsm_merge failed");
 				return -1;
 			}
 		}
 
-		if ((i + 1) % 490000 == 0) {
-			lsm_merge_policy_setup(&policy);
-			rc = lsm_merge(lsm, 2, &policy);
-			lsm_merge_policy_release(&policy);
+		if (!background && (i + 1) % 490000 == 0) {
+			rc = merge_lsm(lsm, 2);
 			if (rc < 0) {
 				puts("lsm_merge failed");
 				return -1;
 			}
 		}
 
-		if ((i + 1) % 3430000 == 0) {
-			lsm_merge_policy_setup(&policy);
-			rc = lsm_merge(lsm, 3, &policy);
-			lsm_merge_policy_release(&policy);
+		if (!background && (i + 1) % 3430000 == 0) {
+			rc = merge_lsm(lsm, 3);
 			if (rc < 0) {
 				puts("lsm_merge failed");
 				return -1;
 			}
 		}
+		latency[i] = (test_now() - start) * 1e9;
+	}
+
+	if (background && lsm_wait_merger(lsm) < 0) {
+		puts("background lsm_merge failed");
+		return -1;
 	}
+	print_latency(background ? "background" : "synchronous");
+	printf("%s merges wrote %zu pages\n",
+				background ? "background" : "synchronous",
+				lsm->merge_pages);
 	return 0;
 }
 
 static int iterate_lsm_forward(struct lsm *lsm)
 {
-	struct lsm_iter iter;
+	static struct lsm_iter iter;
 	int ret = -1;
 
 	lsm_iter_setup(&iter, lsm);
+	iter.zero_copy = 1;
 	if (lsm_begin(&iter) < 0) {
 		puts("lsm_begin failed");
 		goto out;
@@ -213,7 +279,7 @@ out:
 
 static int iterate_lsm_backward(struct lsm *lsm)
 {
-	struct lsm_iter iter;
+	static struct lsm_iter iter;
 	int ret = -1;
 
 	lsm_iter_setup(&iter, lsm);
@@ -284,7 +350,7 @@ out:
 
 static int lookup_lsm(struct lsm *lsm)
 {
-	struct lsm_iter iter;
+	static struct lsm_iter iter;
 	int ret = -1;
 
 	lsm_iter_setup(&iter, lsm);
@@ -314,6 +380,54 @@ static int lookup_lsm(struct lsm *lsm)
 		}
 	}
 
+	for (size_t i = 0; i != KEYS; ++i) {
+		struct test_key data = { .value = 2 * (long long)i + 1 };
+		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
+		int rc;
+
+		rc = lsm_lookup(&iter, &key);
+		if (rc < 0) {
+			puts("lookup failed");
+			goto out;
+		}
+		if (rc) {
+			puts("unexpected key found");
+			goto out;
+		}
+	}
+
+	for (size_t i = 0; i + 1 < KEYS; i += 1000) {
+		struct test_key data = { .value = 2 * (long long)i };
+		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
+		int rc;
+
+		rc = lsm_lookup(&iter, &key);
+		if (rc <= 0) {
+			puts("key not found");
+			goto out;
+		}
+		rc = lsm_next(&iter);
+		if (rc < 0 || !lsm_has_item(&iter)) {
+			puts("lsm_next after lookup failed");
+			goto out;
+		}
+		memcpy(&data, iter.key.ptr, sizeof(data));
+		if (data.value != 2 * (long long)i + 2) {
+			puts("wrong key value");
+			goto out;
+		}
+		rc = lsm_prev(&iter);
+		if (rc < 0 || !lsm_has_item(&iter)) {
+			puts("lsm_prev after lookup failed");
+			goto out;
+		}
+		memcpy(&data, iter.key.ptr, sizeof(data));
+		if (data.value != 2 * (long long)i) {
+			puts("wrong key value");
+			goto out;
+		}
+	}
+
 	for (size_t i = 0; i != KEYS; ++i) {
 		struct test_key data = { .value = 2 * (long long)i - 1 };
 		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
@@ -345,10 +459,428 @@ out:
 	return ret;
 }
 
+static int get_lsm(struct lsm *lsm)
+{
+	static struct lsm_iter iter;
+	double start, hit, miss;
+	int ret = -1;
+
+	lsm_iter_setup(&iter, lsm);
+
+	start = test_now();
+	for (size_t i = 0; i != KEYS; ++i) {
+		struct test_key data = { .value = 2 * (long long)i };
+		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
+		int rc;
+
+		rc = lsm_get(&iter, &key);
+		if (rc < 0) {
+			puts("lsm_get failed");
+			goto out;
+		}
+		if (!rc) {
+			puts("key not found");
+			goto out;
+		}
+		if (iter.key.size != sizeof(data)) {
+			puts("wrong key size");
+			goto out;
+		}
+		memcpy(&data, iter.key.ptr, iter.key.size);
+		if (data.value != 2 * (long long)i) {
+			puts("wrong key value");
+			goto out;
+		}
+	}
+	hit = test_now() - start;
+
+	start = test_now();
+	for (size_t i = 0; i != KEYS; ++i) {
+		struct test_key data = { .value = 2 * (long long)i + 1 };
+		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
+		int rc;
+
+		rc = lsm_get(&iter, &key);
+		if (rc < 0) {
+			puts("lsm_get failed");
+			goto out;
+		}
+		if (rc) {
+			puts("unexpected key found");
+			goto out;
+		}
+	}
+	miss = test_now() - start;
+
+	printf("lsm_get: %.3f s for hits, %.3f s for misses\n", hit, miss);
+
+	/* The iterator must be usable after lsm_get as well. */
+	for (size_t i = 0; i + 1 < KEYS; i += 1000) {
+		struct test_key data = { .value = 2 * (long long)i };
+		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
+
+		if (lsm_get(&iter, &key) <= 0) {
+			puts("key not found");
+			goto out;
+		}
+		if (lsm_next(&iter) < 0 || !lsm_has_item(&iter)) {
+			puts("lsm_next after lsm_get failed");
+			goto out;
+		}
+		memcpy(&data, iter.key.ptr, sizeof(data));
+		if (data.value != 2 * (long long)i + 2) {
+			puts("wrong key value");
+			goto out;
+		}
+	}
+
+	ret = 0;
+out:
+	lsm_iter_release(&iter);
+	return ret;
+}
+
+/* Updates a narrow range of keys and merges the update all the way down,
+ * merges only rewrite leaves that contain updated keys. Every merge frees
+ * the old partition arrays and the pages of the partitions it replaced, so
+ * the lsm grows by no more than the pages merges wrote less the freed. */
+static int update_lsm(struct lsm *lsm)
+{
+	static struct lsm_iter iter;
+	struct ctree_test_alloc *alloc = (struct ctree_test_alloc *)lsm->alloc;
+	const size_t from = KEYS / 2;
+	const size_t count = 1000;
+	const size_t written = lsm->merge_pages;
+	const uint64_t freed = alloc->freed;
+	size_t old_pages = 0;
+	size_t pages = 0;
+	int ret = -1;
+
+	for (int i = 0; i != lsm->levels; ++i)
+		old_pages += lsm->ci[i].pages;
+
+	for (size_t i = from; i != from + count; ++i) {
+		struct test_key data = { .value = 2 * (long long)i };
+		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
+		struct lsm_val val = { .ptr = &data, .size = sizeof(data) };
+
+		if (lsm_add(lsm, &key, &val) < 0) {
+			puts("lsm_add failed");
+			return -1;
+		}
+	}
+
+	for (int tree = 0; tree <= lsm->levels; tree = tree ? tree + 1 : 2) {
+		if (merge_lsm(lsm, tree) < 0) {
+			puts("lsm_merge failed");
+			return -1;
+		}
+	}
+
+	for (int i = 0; i != lsm->levels; ++i)
+		pages += lsm->ci[i].pages;
+	printf("update of %zu keys: merges wrote %zu pages, freed %llu, "
+				"lsm takes %zu\n", count, lsm->merge_pages - written,
+				(unsigned long long)(alloc->freed - freed), pages);
+
+	if (old_pages + lsm->merge_pages - written >
+				pages + alloc->freed - freed) {
+		puts("merges didn't free replaced partitions");
+		return -1;
+	}
+
+	/* Each merge frees up to two single page partition arrays. */
+	if (old_pages + lsm->merge_pages - written + 2 * (lsm->levels + 1) <
+				pages + alloc->freed - freed) {
+		puts("merges freed reused leaves");
+		return -1;
+	}
+
+	lsm_iter_setup(&iter, lsm);
+	for (size_t i = from - 1; i != from + count + 1; ++i) {
+		struct test_key data = { .value = 2 * (long long)i };
+		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
+		const int updated = i >= from && i < from + count;
+
+		if (lsm_get(&iter, &key) <= 0) {
+			puts("key not found");
+			goto out;
+		}
+		if (iter.val.size != (updated ? sizeof(data) : 0) ||
+			(updated && memcmp(iter.val.ptr, &data, sizeof(data)))) {
+			puts("wrong value");
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	lsm_iter_release(&iter);
+	return ret;
+}
+
+static int fill_lsm(struct lsm *lsm, size_t keys, long long odd)
+{
+	for (size_t i = 0; i != keys; ++i) {
+		struct test_key data = { .value = 2 * (long long)i + odd };
+		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
+		struct lsm_val val = { .ptr = NULL, .size = 0 };
+
+		if (lsm_add(lsm, &key, &val) < 0) {
+			puts("lsm_add failed");
+			return -1;
+		}
+	}
+	return merge_lsm(lsm, 0);
+}
+
+static int add_odd_keys(struct lsm *lsm, size_t from, size_t to)
+{
+	for (size_t i = from; i != to; ++i) {
+		struct test_key data = { .value = 2 * (long long)i + 1 };
+		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
+		struct lsm_val val = { .ptr = NULL, .size = 0 };
+
+		if (lsm_add(lsm, &key, &val) < 0) {
+			puts("lsm_add failed");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Past twice the threshold lsm_add waits for the background merge, so the
+ * merge must not wait for the iterator the writer holds. The first half of
+ * keys starts a merge and the second half fills c0 again while it runs,
+ * the iterator still sees the trees it started with. */
+static int add_with_iterator(struct lsm *lsm, size_t keys)
+{
+	static struct lsm_iter iter;
+	const size_t step = keys / 16;
+	int rc = 0;
+
+	if (add_odd_keys(lsm, 0, keys / 2))
+		return -1;
+
+	lsm_iter_setup(&iter, lsm);
+	for (size_t i = keys / 2; i != keys && rc == 0; i += step) {
+		struct test_key data = { .value = 2 * (long long)(i - keys / 2)
+					+ 1 };
+		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
+
+		rc = add_odd_keys(lsm, i, i + step < keys ? i + step : keys);
+		if (rc == 0 && lsm_lookup(&iter, &key) <= 0) {
+			puts("lsm_lookup with an old iterator failed");
+			rc = -1;
+		}
+	}
+	lsm_iter_release(&iter);
+
+	if (rc)
+		return -1;
+
+	if (lsm_wait_merger(lsm) < 0) {
+		puts("background lsm_merge failed");
+		return -1;
+	}
+
+	lsm_iter_setup(&iter, lsm);
+	for (size_t i = 0; i != keys && rc == 0; ++i) {
+		struct test_key data = { .value = 2 * (long long)i + 1 };
+		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
+
+		if (lsm_lookup(&iter, &key) <= 0) {
+			puts("lsm_lookup failed");
+			rc = -1;
+		}
+	}
+	lsm_iter_release(&iter);
+	return rc;
+}
+
+/* lsm_add lets c0 grow past the threshold while c1 is merged, but not
+ * past twice that. c0 grows by whole slabs, hence the slack. */
+static int add_bounded(struct lsm *lsm, size_t keys)
+{
+	static struct lsm_iter iter;
+	const size_t limit = 2 * lsm->merge_threshold + 128 * 1024;
+	size_t max_bytes = 0;
+	int rc = 0;
+
+	for (size_t i = 0; i != keys; ++i) {
+		struct test_key data = { .value = 2 * (long long)i + 1 };
+		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
+		struct lsm_val val = { .ptr = NULL, .size = 0 };
+
+		if (lsm_add(lsm, &key, &val) < 0) {
+			puts("lsm_add failed");
+			return -1;
+		}
+		if (lsm->c0->bytes > max_bytes)
+			max_bytes = lsm->c0->bytes;
+	}
+
+	if (lsm_wait_merger(lsm) < 0) {
+		puts("background lsm_merge failed");
+		return -1;
+	}
+
+	printf("c0 took up to %zu bytes, threshold %zu\n", max_bytes,
+				lsm->merge_threshold);
+	if (max_bytes > limit) {
+		puts("c0 grew past twice the threshold");
+		return -1;
+	}
+
+	lsm_iter_setup(&iter, lsm);
+	for (size_t i = 0; i != keys && rc == 0; ++i) {
+		struct test_key data = { .value = 2 * (long long)i + 1 };
+		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
+
+		if (lsm_lookup(&iter, &key) <= 0) {
+			puts("lsm_lookup failed");
+			rc = -1;
+		}
+	}
+	lsm_iter_release(&iter);
+	return rc;
+}
+
+/* Keys 0, 4, 8, ... are on disk and keys 2, 6, 10, ... are in c0, so
+ * lsm_upper_bound has to agree on the bound in both kinds of trees. */
+static int upper_bound_lsm(struct io *io, struct alloc *alloc)
+{
+	static struct lsm lsm;
+	static struct lsm_iter iter;
+	const long long keys = 100000;
+	int ret = -1;
+
+	lsm_setup(&lsm, io, alloc, &test_cmp);
+	for (int c0 = 0; c0 != 2; ++c0) {
+		for (long long i = 0; i != keys; ++i) {
+			struct test_key data = { .value = 4 * i + 2 * c0 };
+			struct lsm_key key = { .ptr = &data,
+						.size = sizeof(data) };
+			struct lsm_val val = { .ptr = NULL, .size = 0 };
+
+			if (lsm_add(&lsm, &key, &val) < 0) {
+				puts("lsm_add failed");
+				goto out;
+			}
+		}
+
+		if (!c0 && merge_lsm(&lsm, 0) < 0) {
+			puts("lsm_merge failed");
+			goto out;
+		}
+	}
+
+	lsm_iter_setup(&iter, &lsm);
+	for (long long value = -1; value != 4 * keys; ++value) {
+		struct test_key data = { .value = value };
+		struct lsm_key key = { .ptr = &data, .size = sizeof(data) };
+		const long long upper = value + 2 - (value + 2) % 2;
+
+		if (lsm_upper_bound(&iter, &key) < 0) {
+			puts("lsm_upper_bound failed");
+			goto release_iter;
+		}
+
+		if (upper == 4 * keys) {
+			if (lsm_has_item(&iter)) {
+				puts("lsm_upper_bound found a key past the end");
+				goto release_iter;
+			}
+			continue;
+		}
+
+		if (!lsm_has_item(&iter) ||
+			((struct test_key *)iter.key.ptr)->value != upper) {
+			puts("wrong key after lsm_upper_bound");
+			goto release_iter;
+		}
+	}
+	ret = 0;
+
+release_iter:
+	lsm_iter_release(&iter);
+out:
+	lsm_release(&lsm);
+	return ret;
+}
+
+/* Merges two interleaved levels, so that the merge rewrites every leaf,
+ * with the given number of merge threads. */
+static int parallel_merge_lsm(struct io *io, struct alloc *alloc, int threads)
+{
+	static struct lsm lsm;
+	static struct lsm_iter iter;
+	const size_t keys = KEYS / 10;
+	double start;
+	int ret = -1;
+
+	lsm_setup(&lsm, io, alloc, &test_cmp);
+	lsm_set_bloom_bits(&lsm, 10);
+	lsm_set_merge_threads(&lsm, threads);
+
+	if (fill_lsm(&lsm, keys, 0) || merge_lsm(&lsm, 2) ||
+				fill_lsm(&lsm, keys, 1)) {
+		puts("failed to prepare lsm for parallel merge");
+		goto out;
+	}
+
+	start = test_now();
+	if (merge_lsm(&lsm, 2) < 0) {
+		puts("lsm_merge failed");
+		goto out;
+	}
+	printf("lsm_merge of %zu keys with %d threads: %.3f s\n",
+				2 * keys, threads, test_now() - start);
+
+	if (lsm.ci[1].parts != 1) {
+		puts("parallel merge output isn't a single tree");
+		goto out;
+	}
+
+	lsm_iter_setup(&iter, &lsm);
+	iter.zero_copy = 1;
+	if (lsm_begin(&iter) < 0) {
+		puts("lsm_begin failed");
+		goto release_iter;
+	}
+
+	for (size_t i = 0; i != 2 * keys; ++i) {
+		if (!lsm_has_item(&iter) ||
+			((struct test_key *)iter.key.ptr)->value != (long long)i) {
+			puts("wrong key after parallel merge");
+			goto release_iter;
+		}
+
+		const int rc = lsm_next(&iter);
+
+		if (rc < 0 && rc != -ENOENT) {
+			puts("lsm_next failed");
+			goto release_iter;
+		}
+	}
+
+	if (lsm_has_item(&iter)) {
+		puts("wrong number of keys after parallel merge");
+		goto release_iter;
+	}
+	ret = 0;
+
+release_iter:
+	lsm_iter_release(&iter);
+out:
+	lsm_release(&lsm);
+	return ret;
+}
+
 static struct io_ops test_io_ops = {
 	.read = &test_read,
 	.write = &test_write,
-	.sync = &test_sync
+	.sync = &test_sync,
+	.readahead = &test_readahead
 };
 
 static struct alloc_ops test_alloc_ops = {
@@ -383,15 +915,60 @@ int main()
 		.offs = 0
 	};
 
-	struct lsm lsm;
+	struct ctree_cache_stats stats;
+	struct ctree_pool_stats pool;
+	static struct ctree_cache cache;
+	static struct lsm lsm;
+	static struct lsm bg_lsm;
 	int ret = -1;
 
-	lsm_setup(&lsm, &test_io.io, &test_alloc.alloc, &test_cmp);
+	latency = malloc(KEYS * sizeof(*latency));
+	if (!latency) {
+		puts("failed to allocate latency array");
+		close(fd);
+		return -1;
+	}
 
-	if (create_lsm(&lsm)) {
+	ctree_cache_setup(&cache, 64 * 1024 * 1024);
+	lsm_setup(&lsm, &test_io.io, &test_alloc.alloc, &test_cmp);
+	lsm_set_cache(&lsm, &cache);
+	lsm_set_pin_interior(&lsm, 1);
+	lsm_set_fence_index(&lsm, 1);
+	lsm_set_bloom_bits(&lsm, 10);
+	lsm_set_merge_threads(&lsm, 4);
+
+	lsm_setup(&bg_lsm, &test_io.io, &test_alloc.alloc, &test_cmp);
+	lsm_set_bloom_bits(&bg_lsm, 10);
+	lsm_set_compaction(&bg_lsm, 256, 1024, 10);
+	lsm_set_compression(&bg_lsm, 4);
+
+	if (create_lsm(&lsm, 0)) {
 		puts("create_lsm failed");
 		goto out;
 	}
+	printf("lsm_merge: %.3f s\n", merge_time);
+
+	if (lsm_start_merger(&bg_lsm, 4 * 1024 * 1024)) {
+		puts("lsm_start_merger failed");
+		goto out;
+	}
+	if (create_lsm(&bg_lsm, 1)) {
+		puts("create_lsm with background merges failed");
+		goto out;
+	}
+	if (iterate_lsm_forward(&bg_lsm)) {
+		puts("iterate_iter_forward with background merges failed");
+		goto out;
+	}
+	if (add_with_iterator(&bg_lsm, 500000)) {
+		puts("add_with_iterator failed");
+		goto out;
+	}
+	if (add_bounded(&bg_lsm, 500000)) {
+		puts("add_bounded failed");
+		goto out;
+	}
+
 	if (iterate_lsm_forward(&lsm)) {
 		puts("iterate_iter_forward failed");
 		goto out;
@@ -400,14 +977,48 @@ int main()
 		puts("iterate_iter_forward failed");
 		goto out;
 	}
+
+	const double start = test_now();
+
 	if (lookup_lsm(&lsm)) {
 		puts("lookup_lsm failed");
 		goto out;
 	}
+	printf("lookup_lsm: %.3f s\n", test_now() - start);
+	if (get_lsm(&lsm)) {
+		puts("get_lsm failed");
+		goto out;
+	}
+	if (update_lsm(&lsm)) {
+		puts("update_lsm failed");
+		goto out;
+	}
+	if (iterate_lsm_forward(&lsm)) {
+		puts("iterate_iter_forward after update failed");
+		goto out;
+	}
+	if (upper_bound_lsm(&test_io.io, &test_alloc.alloc)) {
+		puts("upper_bound_lsm failed");
+		goto out;
+	}
+	if (parallel_merge_lsm(&test_io.io, &test_alloc.alloc, 1) ||
+			parallel_merge_lsm(&test_io.io, &test_alloc.alloc, 4)) {
+		puts("parallel_merge_lsm failed");
+		goto out;
+	}
 	ret = 0;
 
+	ctree_cache_stats(&cache, &stats);
+	printf("node cache: %llu hits, %llu misses, %llu evictions\n",
+				stats.hits, stats.misses, stats.evictions);
+	ctree_pool_stats(&pool);
+	printf("node pool: %llu allocated, %llu reused, %llu freed\n",
+				pool.allocs, pool.reuses, pool.frees);
 out:
+	lsm_release(&bg_lsm);
 	lsm_release(&lsm);
+	ctree_cache_release(&cache);
+	free(latency);
 	close(fd);
 
 	return ret;
@@ -0,0 +1,77 @@
+#include <bloom.h>
+#include <crc64.h>
+
+
+static const size_t MIN_BLOOM_BITS = 64;
+
+uint32_t bloom_hash(const void *data, size_t size)
+{
+	const uint64_t crc = crc64(data, size);
+
+	return (uint32_t)crc ^ (uint32_t)(crc >> 32);
+}
+
+int bloom_hashes(size_t bits_per_key)
+{
+	/* Optimal number of probes is bits_per_key * ln(2). */
+	const int hashes = (int)(bits_per_key * 69 / 100);
+
+	if (hashes < 1)
+		return 1;
+	if (hashes > 30)
+		return 30;
+	return hashes;
+}
+
+size_t bloom_size(size_t keys, size_t bits_per_key)
+{
+	size_t bits = keys * bits_per_key;
+
+	if (bits < MIN_BLOOM_BITS)
+		bits = MIN_BLOOM_BITS;
+	return (bits + 7) / 8;
+}
+
+static uint32_t bloom_delta(uint32_t hash)
+{
+	return (hash >> 17) | (hash << 15);
+}
+
+void bloom_build(void *bits, size_t size, int hashes,
+			const uint32_t *hash, size_t count)
+{
+	unsigned char *data = bits;
+	const uint64_t nbits = (uint64_t)size * 8;
+
+	for (size_t i = 0; i != count; ++i) {
+		const uint32_t delta = bloom_delta(hash[i]);
+		uint32_t h = hash[i];
+
+		for (int j = 0; j != hashes; ++j) {
+			const uint64_t bit = h % nbits;
+
+			data[bit / 8] |= 1 << (bit % 8);
+			h += delta;
+		}
+	}
+}
+
+int bloom_may_contain(const void *bits, size_t size, int hashes,
+			uint32_t hash)
+{
+	const unsigned char *data = bits;
+	const uint64_t nbits = (uint64_t)size * 8;
+	const uint32_t delta = bloom_delta(hash);
+
+	if (!nbits)
+		return 1;
+
+	for (int j = 0; j != hashes; ++j) {
+		const uint64_t bit = hash % nbits;
+
+		if (!(data[bit / 8] & (1 << (bit % 8))))
+			return 0;
+		hash += delta;
+	}
+	return 1;
+}
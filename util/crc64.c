@@ -1,5 +1,14 @@
 #include <crc64.h>
 
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CRC64_CLMUL
+#endif
+
 #include "crc64_table.h"
 
 
@@ -19,35 +28,273 @@ uint64_t __crc64(uint64_t init, const void *data, size_t size)
 }
 */
 
-/* TODO: we really need to verify this algorithm implementation,
- * and also port it to big endian (which should be relatively easy). */
-uint64_t __crc64(uint64_t init, const void *data, size_t size)
+/* Both implementations optionally copy the data to dst as they read it,
+ * dst is NULL for a plain checksum. */
+
+/* TODO: port it to big endian (which should be relatively easy). */
+static uint64_t crc64_table_copy(uint64_t init, void *dst, const void *data,
+			size_t size)
 {
 	const uint64_t *word_ptr = data;
+	uint64_t *dst_word = dst;
 	uint64_t crc = init;
 
 	while (size >= 8) {
-		const uint64_t word = *word_ptr++ ^ crc;
+		const uint64_t word = *word_ptr++;
+
+		if (dst_word)
+			memcpy(dst_word++, &word, sizeof(word));
 
-		crc = crc_table[0][(word >> 56) & 0xff] ^
-			crc_table[1][(word >> 48) & 0xff] ^
-			crc_table[2][(word >> 40) & 0xff] ^
-			crc_table[3][(word >> 32) & 0xff] ^
-			crc_table[4][(word >> 24) & 0xff] ^
-			crc_table[5][(word >> 16) & 0xff] ^
-			crc_table[6][(word >> 8) & 0xff] ^
-			crc_table[7][word & 0xff];
+		const uint64_t x = word ^ crc;
+
+		crc = crc_table[0][(x >> 56) & 0xff] ^
+			crc_table[1][(x >> 48) & 0xff] ^
+			crc_table[2][(x >> 40) & 0xff] ^
+			crc_table[3][(x >> 32) & 0xff] ^
+			crc_table[4][(x >> 24) & 0xff] ^
+			crc_table[5][(x >> 16) & 0xff] ^
+			crc_table[6][(x >> 8) & 0xff] ^
+			crc_table[7][x & 0xff];
 
 		size -= 8;
 	}
 
 	const unsigned char *byte_ptr = (const unsigned char *)word_ptr;
+	unsigned char *dst_byte = (unsigned char *)dst_word;
 
 	while (size--) {
-		const unsigned char i = ((crc & 0xff) ^ *byte_ptr++);
+		const unsigned char byte = *byte_ptr++;
+		const unsigned char i = ((crc & 0xff) ^ byte);
 
+		if (dst_byte)
+			*dst_byte++ = byte;
 		crc = crc_table[0][i] ^ (crc >> 8);
 	}
 
 	return crc;
 }
+
+uint64_t __crc64_table(uint64_t init, const void *data, size_t size)
+{
+	return crc64_table_copy(init, NULL, data, size);
+}
+
+#ifdef CRC64_CLMUL
+/* Shorter buffers aren't worth loading into vector registers. */
+static const size_t CLMUL_MIN_SIZE = 64;
+
+/* The data is a polynomial with the first bit as the highest term, in a
+ * 128 bit register it's bit 0 of the low half. Folding multiplies both
+ * halves by x^(d + 63) and x^(d - 1) modulo P, clmul adds the missing x,
+ * so the result is congruent to the register shifted by d bits. */
+__attribute__((target("pclmul")))
+static __m128i crc64_fold(__m128i x, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+				_mm_clmulepi64_si128(x, k, 0x11));
+}
+
+__attribute__((target("pclmul")))
+static __m128i crc64_load(const __m128i *src, __m128i *dst, size_t i)
+{
+	const __m128i x = _mm_loadu_si128(src + i);
+
+	if (dst)
+		_mm_storeu_si128(dst + i, x);
+	return x;
+}
+
+/* Four registers are folded over 64 bytes at a time to hide the clmul
+ * latency, then they are folded into one. CRC of the last register is the
+ * CRC of all the data folded so far, so it and the tail shorter than 16
+ * bytes are left to the table implementation. */
+__attribute__((target("pclmul")))
+static uint64_t crc64_clmul_copy(uint64_t init, void *dst, const void *data,
+			size_t size)
+{
+	const __m128i *ptr = data;
+	__m128i *out = dst;
+	const __m128i k128 = _mm_loadu_si128((const __m128i *)crc_fold[0]);
+	const __m128i k256 = _mm_loadu_si128((const __m128i *)crc_fold[1]);
+	const __m128i k384 = _mm_loadu_si128((const __m128i *)crc_fold[2]);
+	const __m128i k512 = _mm_loadu_si128((const __m128i *)crc_fold[3]);
+	__m128i x0 = crc64_load(ptr, out, 0);
+	__m128i x1 = crc64_load(ptr, out, 1);
+	__m128i x2 = crc64_load(ptr, out, 2);
+	__m128i x3 = crc64_load(ptr, out, 3);
+
+	/* The initial value is xored into the first 8 bytes. */
+	x0 = _mm_xor_si128(x0, _mm_cvtsi64_si128((long long)init));
+	ptr += 4;
+	out = out ? out + 4 : NULL;
+	size -= 64;
+
+	while (size >= 64) {
+		x0 = _mm_xor_si128(crc64_fold(x0, k512),
+					crc64_load(ptr, out, 0));
+		x1 = _mm_xor_si128(crc64_fold(x1, k512),
+					crc64_load(ptr, out, 1));
+		x2 = _mm_xor_si128(crc64_fold(x2, k512),
+					crc64_load(ptr, out, 2));
+		x3 = _mm_xor_si128(crc64_fold(x3, k512),
+					crc64_load(ptr, out, 3));
+		ptr += 4;
+		out = out ? out + 4 : NULL;
+		size -= 64;
+	}
+
+	x0 = _mm_xor_si128(_mm_xor_si128(crc64_fold(x0, k384),
+				crc64_fold(x1, k256)),
+			_mm_xor_si128(crc64_fold(x2, k128), x3));
+
+	while (size >= 16) {
+		x0 = _mm_xor_si128(crc64_fold(x0, k128),
+					crc64_load(ptr, out, 0));
+		ptr++;
+		out = out ? out + 1 : NULL;
+		size -= 16;
+	}
+
+	uint64_t folded[2];
+
+	_mm_storeu_si128((__m128i *)folded, x0);
+	return crc64_table_copy(__crc64_table(0, folded, sizeof(folded)),
+				out, ptr, size);
+}
+#endif
+
+static uint64_t crc64_copy(uint64_t init, void *dst, const void *data,
+			size_t size)
+{
+#ifdef CRC64_CLMUL
+	if (size >= CLMUL_MIN_SIZE && __builtin_cpu_supports("pclmul"))
+		return crc64_clmul_copy(init, dst, data, size);
+#endif
+	return crc64_table_copy(init, dst, data, size);
+}
+
+uint64_t __crc64(uint64_t init, const void *data, size_t size)
+{
+	return crc64_copy(init, NULL, data, size);
+}
+
+void *memcpy_crc64(void *dst, const void *src, size_t size,
+			struct crc64_ctx *ctx)
+{
+	ctx->crc = crc64_copy(ctx->crc, dst, src, size);
+	return dst;
+}
+
+/* a * b mod P, both in the reflected form, a must not be zero. The table
+ * entry for 0x80 is the reversed polynomial itself. */
+static uint64_t crc64_mult_mod(uint64_t a, uint64_t b)
+{
+	uint64_t m = 1ull << 63;
+	uint64_t p = 0;
+
+	while (1) {
+		if (a & m) {
+			p ^= b;
+			if (!(a & (m - 1)))
+				return p;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ crc_table[0][128] : b >> 1;
+	}
+}
+
+/* CRC of data followed by len zero bytes with init 0 is the CRC of data
+ * times x^(8 * len), the crc_shift table has it for every power of two. */
+static uint64_t crc64_shift(uint64_t crc, size_t len)
+{
+	for (int k = 0; len && crc; ++k, len >>= 1) {
+		if (len & 1)
+			crc = crc64_mult_mod(crc_shift[0][k], crc);
+	}
+	return crc;
+}
+
+uint64_t crc64_combine(uint64_t crc_a, uint64_t crc_b, size_t len_b)
+{
+	return crc64_shift(crc_a, len_b) ^ crc_b;
+}
+
+
+#define CRC64_MAX_THREADS	16
+
+/* Slices are large enough to pay for a thread. */
+static const size_t CRC64_MIN_SLICE = 1024 * 1024;
+
+struct crc64_slice {
+	pthread_t thread;
+	int started;
+	const unsigned char *data;
+	size_t size;
+	uint64_t crc;
+};
+
+static void *crc64_slice_thread(void *arg)
+{
+	struct crc64_slice *slice = arg;
+
+	slice->crc = __crc64(CRC64_INIT, slice->data, slice->size);
+	return NULL;
+}
+
+/* sysconf reads /sys on every call, the count is looked up once. Racing
+ * callers store the same value. */
+static int crc64_cpus(void)
+{
+	static int cpus;
+	int count = __atomic_load_n(&cpus, __ATOMIC_RELAXED);
+
+	if (!count) {
+		count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (count < 1)
+			count = 1;
+		__atomic_store_n(&cpus, count, __ATOMIC_RELAXED);
+	}
+	return count;
+}
+
+uint64_t __crc64_parallel(uint64_t init, const void *data, size_t size,
+			int threads)
+{
+	struct crc64_slice slice[CRC64_MAX_THREADS];
+	const unsigned char *ptr = data;
+
+	/* Most buffers are single nodes, they must cost as much as __crc64. */
+	if (size < 2 * CRC64_MIN_SLICE)
+		return __crc64(init, data, size);
+
+	if (threads <= 0)
+		threads = crc64_cpus();
+	if (threads > CRC64_MAX_THREADS)
+		threads = CRC64_MAX_THREADS;
+	if ((size_t)threads > size / CRC64_MIN_SLICE)
+		threads = (int)(size / CRC64_MIN_SLICE);
+	if (threads < 2)
+		return __crc64(init, data, size);
+
+	/* The calling thread takes the first slice, if a thread can't be
+	 * started its slice is done in place while joining. */
+	const size_t step = size / threads;
+
+	for (int i = 1; i != threads; ++i) {
+		slice[i].data = ptr + i * step;
+		slice[i].size = i == threads - 1 ? size - i * step : step;
+		slice[i].started = !pthread_create(&slice[i].thread, NULL,
+					&crc64_slice_thread, &slice[i]);
+	}
+
+	uint64_t crc = __crc64(init, ptr, step);
+
+	for (int i = 1; i != threads; ++i) {
+		if (slice[i].started)
+			pthread_join(slice[i].thread, NULL);
+		else
+			crc64_slice_thread(&slice[i]);
+		crc = crc64_combine(crc, slice[i].crc, slice[i].size);
+	}
+	return crc;
+}
@@ -0,0 +1,99 @@
+#include <key_schema.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define KEY_SEARCH_AVX2
+#endif
+
+
+/* Binary search stops once the range is that short, the rest is counted
+ * in one pass over the prefixes. */
+static const size_t SEARCH_WINDOW = 16;
+
+int key_bytes_cmp(const struct lsm_key *l, const struct lsm_key *r)
+{
+	return key_compare(KEY_SCHEMA_BYTES, NULL, l, r);
+}
+
+int key_u64_cmp(const struct lsm_key *l, const struct lsm_key *r)
+{
+	return key_compare(KEY_SCHEMA_U64, NULL, l, r);
+}
+
+int key_u64_bytes_cmp(const struct lsm_key *l, const struct lsm_key *r)
+{
+	return key_compare(KEY_SCHEMA_U64_BYTES, NULL, l, r);
+}
+
+enum key_schema key_schema_of(int (*cmp)(const struct lsm_key *,
+			const struct lsm_key *))
+{
+	if (cmp == &key_bytes_cmp)
+		return KEY_SCHEMA_BYTES;
+	if (cmp == &key_u64_cmp)
+		return KEY_SCHEMA_U64;
+	if (cmp == &key_u64_bytes_cmp)
+		return KEY_SCHEMA_U64_BYTES;
+	return KEY_SCHEMA_OPAQUE;
+}
+
+static size_t key_prefix_count(const uint64_t *prefix, size_t count,
+			uint64_t value, int upper)
+{
+	size_t less = 0;
+
+	for (size_t i = 0; i != count; ++i)
+		less += upper ? prefix[i] <= value : prefix[i] < value;
+	return less;
+}
+
+#ifdef KEY_SEARCH_AVX2
+/* AVX2 only has a signed 64 bit compare, flipping the top bits of both
+ * sides turns it into the unsigned one. */
+__attribute__((target("avx2")))
+static size_t key_prefix_count_avx2(const uint64_t *prefix, size_t count,
+			uint64_t value, int upper)
+{
+	const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+	const __m256i v = _mm256_xor_si256(_mm256_set1_epi64x(value), bias);
+	size_t less = 0;
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		const __m256i p = _mm256_xor_si256(_mm256_loadu_si256(
+					(const __m256i *)(prefix + i)), bias);
+		const __m256i gt = upper ? _mm256_cmpgt_epi64(p, v)
+					: _mm256_cmpgt_epi64(v, p);
+		const int bits = __builtin_popcount(_mm256_movemask_pd(
+					_mm256_castsi256_pd(gt)));
+
+		less += upper ? 4 - bits : bits;
+	}
+	return less + key_prefix_count(prefix + i, count - i, value, upper);
+}
+#endif
+
+size_t key_prefix_search(const uint64_t *prefix, size_t count,
+			uint64_t value, int upper)
+{
+	size_t begin = 0;
+
+	/* The answer is always in [begin, begin + count], the select
+	 * compiles to a conditional move, so the loop doesn't branch on
+	 * the data. */
+	while (count > SEARCH_WINDOW) {
+		const size_t half = count / 2;
+		const uint64_t mid = prefix[begin + half];
+
+		begin = (upper ? mid <= value : mid < value)
+					? begin + half : begin;
+		count -= half;
+	}
+
+#ifdef KEY_SEARCH_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return begin + key_prefix_count_avx2(prefix + begin, count,
+					value, upper);
+#endif
+	return begin + key_prefix_count(prefix + begin, count, value, upper);
+}
@@ -0,0 +1,179 @@
+#include <lz.h>
+
+#include <string.h>
+#include <errno.h>
+
+
+/* Matches are at least 4 bytes long and the last bytes of the input are
+ * always stored as literals, so that a match never runs past the end. */
+static const size_t MIN_MATCH = 4;
+static const size_t LAST_LITERALS = 5;
+static const size_t MATCH_LIMIT = 12;
+static const size_t MAX_OFFSET = 65535;
+
+static uint32_t lz_read32(const unsigned char *ptr)
+{
+	uint32_t value;
+
+	memcpy(&value, ptr, sizeof(value));
+	return value;
+}
+
+static size_t lz_hash(uint32_t value)
+{
+	return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Worst case number of bytes a sequence takes. */
+static size_t lz_sequence_size(size_t literals, size_t match)
+{
+	return 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1;
+}
+
+static unsigned char *lz_put_length(unsigned char *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+static unsigned char *lz_put_literals(unsigned char *op,
+			const unsigned char *literals, size_t len)
+{
+	unsigned char *token = op++;
+
+	*token = (len < 15 ? len : 15) << 4;
+	if (len >= 15)
+		op = lz_put_length(op, len - 15);
+	memcpy(op, literals, len);
+	return op + len;
+}
+
+size_t lz_compress(struct lz_state *state, const void *src, size_t size,
+			void *dst, size_t cap)
+{
+	const unsigned char *base = src;
+	const unsigned char *end = base + size;
+	const unsigned char *limit = size > MATCH_LIMIT
+				? end - MATCH_LIMIT : base;
+	const unsigned char *ip = base, *anchor = base;
+	unsigned char *op = dst;
+	unsigned char *oend = op + cap;
+
+	memset(state->table, 0, sizeof(state->table));
+	while (ip < limit) {
+		const uint32_t seq = lz_read32(ip);
+		const size_t hash = lz_hash(seq);
+		const unsigned char *ref = base + state->table[hash];
+
+		state->table[hash] = (uint32_t)(ip - base);
+		if (ref >= ip || (size_t)(ip - ref) > MAX_OFFSET ||
+					lz_read32(ref) != seq) {
+			++ip;
+			continue;
+		}
+
+		const unsigned char *mend = end - LAST_LITERALS;
+		const size_t literals = ip - anchor;
+		const size_t offset = ip - ref;
+		size_t len = MIN_MATCH;
+
+		while (ip + len < mend && ref[len] == ip[len])
+			++len;
+
+		if (lz_sequence_size(literals, len) > (size_t)(oend - op))
+			return 0;
+
+		unsigned char *token = op;
+		const size_t match = len - MIN_MATCH;
+
+		op = lz_put_literals(op, anchor, literals);
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		*token |= match < 15 ? match : 15;
+		if (match >= 15)
+			op = lz_put_length(op, match - 15);
+
+		ip += len;
+		anchor = ip;
+	}
+
+	const size_t literals = end - anchor;
+
+	if (1 + literals / 255 + 1 + literals > (size_t)(oend - op))
+		return 0;
+	op = lz_put_literals(op, anchor, literals);
+	return op - (unsigned char *)dst;
+}
+
+static int lz_get_length(const unsigned char **ip, const unsigned char *iend,
+			size_t *len)
+{
+	unsigned char byte;
+
+	do {
+		if (*ip == iend)
+			return -EIO;
+		byte = *(*ip)++;
+		*len += byte;
+	} while (byte == 255);
+	return 0;
+}
+
+int lz_decompress(const void *src, size_t src_size, void *dst, size_t cap,
+			size_t *size)
+{
+	const unsigned char *ip = src;
+	const unsigned char *iend = ip + src_size;
+	unsigned char *op = dst;
+	unsigned char *oend = op + cap;
+
+	while (ip != iend) {
+		const unsigned char token = *ip++;
+		size_t literals = token >> 4;
+		size_t len = token & 15;
+
+		if (literals == 15 && lz_get_length(&ip, iend, &literals))
+			return -EIO;
+		if (literals > (size_t)(iend - ip) ||
+					literals > (size_t)(oend - op))
+			return -EIO;
+
+		memcpy(op, ip, literals);
+		op += literals;
+		ip += literals;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -EIO;
+
+		const size_t offset = ip[0] | ((size_t)ip[1] << 8);
+
+		ip += 2;
+		if (!offset || offset > (size_t)(op - (unsigned char *)dst))
+			return -EIO;
+		if (len == 15 && lz_get_length(&ip, iend, &len))
+			return -EIO;
+		len += MIN_MATCH;
+		if (len > (size_t)(oend - op))
+			return -EIO;
+
+		const unsigned char *ref = op - offset;
+
+		if (offset >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			/* Overlapping match repeats the last offset bytes. */
+			for (size_t i = 0; i != len; ++i)
+				*op++ = ref[i];
+		}
+	}
+
+	*size = op - (unsigned char *)dst;
+	return 0;
+}